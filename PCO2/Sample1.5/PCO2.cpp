@@ -3,10 +3,37 @@
 
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+#include <cfloat>
+#include <vector>
+#include <algorithm>
+#include <iomanip>
+#include <regex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/type_precision.hpp>
+
+//SSE is part of every x64 target, 32 bit builds use it when the compiler targets it
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define USE_SSE
+#include <xmmintrin.h>
+#endif
 
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "tiny_obj_loader.h"
@@ -47,6 +74,43 @@ bool escape = false;
 //Toggle Light Colors
 bool changeLightColor = false;
 
+//Print the GL state cache counters
+bool showStats = false;
+
+//Where the lighting is evaluated
+enum ShadingQuality {
+    SHADING_AUTO, //Per vertex for objects that are small on screen, per pixel otherwise
+    SHADING_PER_PIXEL,
+    SHADING_PER_VERTEX,
+    SHADING_COUNT
+};
+const char* shadingQualityNames[SHADING_COUNT] = { "auto", "per pixel", "per vertex" };
+ShadingQuality shadingQuality = SHADING_AUTO;
+
+//Projected radius in pixels below which SHADING_AUTO lights per vertex
+float perVertexRadius = 16.f;
+
+//Lay down depth first so the lighting pass only shades visible pixels
+bool depthPrepass = false;
+
+//Draw the grid of instanced props
+bool showProps = false;
+
+//Submit the scene through the draw batcher instead of one model at a time
+bool batchDraws = true;
+
+//Skip the objects hidden behind the occluders
+bool occlusionCulling = true;
+
+//Scatter a field of small point lights over the props
+bool showLightField = false;
+
+//Draw the surfaces into a G-buffer and light them in screen space
+bool deferredShading = false;
+
+//Cast the directional light's shadows through cascaded shadow maps
+bool shadowsEnabled = false;
+
 //Keyboard inputs
 void Key_Callback(GLFWwindow* window, // the pointer to the window
     int key, // the keycode being pressed
@@ -147,6 +211,50 @@ void Key_Callback(GLFWwindow* window, // the pointer to the window
     if (key == GLFW_KEY_ESCAPE) {
         escape = true;
     }
+    //Toggle the GL call counters
+    if (key == GLFW_KEY_F1 && action == GLFW_PRESS) {
+        showStats = !showStats;
+    }
+    //Cycle the shading quality
+    if (key == GLFW_KEY_F2 && action == GLFW_PRESS) {
+        shadingQuality = (ShadingQuality)((shadingQuality + 1) % SHADING_COUNT);
+        std::cout << "Shading: " << shadingQualityNames[shadingQuality] << std::endl;
+    }
+    //Toggle the depth pre-pass
+    if (key == GLFW_KEY_F3 && action == GLFW_PRESS) {
+        depthPrepass = !depthPrepass;
+        std::cout << "Depth pre-pass: " << (depthPrepass ? "on" : "off") << std::endl;
+    }
+    //Toggle the instanced props
+    if (key == GLFW_KEY_F4 && action == GLFW_PRESS) {
+        showProps = !showProps;
+        std::cout << "Props: " << (showProps ? "on" : "off") << std::endl;
+    }
+    //Toggle batched draws
+    if (key == GLFW_KEY_F5 && action == GLFW_PRESS) {
+        batchDraws = !batchDraws;
+        std::cout << "Batched draws: " << (batchDraws ? "on" : "off") << std::endl;
+    }
+    //Toggle occlusion culling
+    if (key == GLFW_KEY_F6 && action == GLFW_PRESS) {
+        occlusionCulling = !occlusionCulling;
+        std::cout << "Occlusion culling: " << (occlusionCulling ? "on" : "off") << std::endl;
+    }
+    //Toggle the light field
+    if (key == GLFW_KEY_F7 && action == GLFW_PRESS) {
+        showLightField = !showLightField;
+        std::cout << "Light field: " << (showLightField ? "on" : "off") << std::endl;
+    }
+    //Toggle deferred shading
+    if (key == GLFW_KEY_F8 && action == GLFW_PRESS) {
+        deferredShading = !deferredShading;
+        std::cout << "Deferred shading: " << (deferredShading ? "on" : "off") << std::endl;
+    }
+    //Toggle the directional light's shadows
+    if (key == GLFW_KEY_F9 && action == GLFW_PRESS) {
+        shadowsEnabled = !shadowsEnabled;
+        std::cout << "Shadows: " << (shadowsEnabled ? "on" : "off") << std::endl;
+    }
 }
 
 //Call Mouse
@@ -178,389 +286,4212 @@ void mouse_callback(GLFWwindow* window, double xpos, double ypos)
         pitch = -89.0f;
 }
 
-//Forward Declare Light
-class Light;
-class PointLight;
+//Uniforms used by the renderer, each one is an index into a program's uniform table
+enum UniformID {
+    UNIFORM_TRANSFORM,
+    UNIFORM_NORMAL_MATRIX,
+    UNIFORM_TEX0,
+    UNIFORM_MATERIAL_INDEX,
+    UNIFORM_COUNT
+};
 
-//Create Model
-class Model3D {
+//Names of the uniforms in the shaders, in UniformID order
+const char* uniformNames[UNIFORM_COUNT] = {
+    "transform",
+    "normalMatrix",
+    "tex0",
+    "materialIndex"
+};
 
-//Fields for Model
-private:
-    const char* v; //vertex from Sample.vert
-    const char* f; // frag from Sample.frag
+//Uniform blocks shared between programs, each one has a fixed binding point
+enum UniformBlockID {
+    BLOCK_CAMERA,
+    BLOCK_LIGHTS,
+    BLOCK_MATERIALS,
+    BLOCK_SHADOWS,
+    BLOCK_POINT_SHADOWS,
+    BLOCK_CUBE_SHADOW,
+    BLOCK_COUNT
+};
 
-    int img_width, //Width of the texture
-        img_height, //Height of the texture
-        colorChannels; //Number of color channels
-    unsigned char* tex_bytes; // Tex_bytes
+//Names of the blocks in the shaders, in UniformBlockID order
+const char* uniformBlockNames[BLOCK_COUNT] = {
+    "Camera",
+    "Lights",
+    "Materials",
+    "Shadows",
+    "PointShadows",
+    "CubeShadow"
+};
 
-    //Shaders
-    GLuint texture;
-    GLuint vertexShader;
-    GLuint fragShader;
-    GLuint shaderProg;
+//Size of the light arrays in the Lights block
+const int MAX_POINT_LIGHTS = 64;
+const int MAX_DIRECTION_LIGHTS = 4;
 
-    //Obj file attributes
-    std::string path;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> material;
-    std::string warning, error;
+//Size of the material array in the Materials block
+const int MAX_MATERIALS = 16;
 
-    tinyobj::attrib_t attributes;
-    bool success;
+//Light clusters, screen tiles by exponential depth slices of the camera's view
+const int CLUSTER_TILES_X = 16;
+const int CLUSTER_TILES_Y = 16;
+const int CLUSTER_SLICES = 24;
+const int CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
 
-    std::vector<GLuint> mesh_indices;
-    std::vector<GLfloat> fullVertexData;
+//Shadow cascades of the directional light, the size of the array in the Shadows block
+const int MAX_SHADOW_CASCADES = 4;
 
-    //VertexArrayObject and VertexBufferObject
-    GLuint VAO, VBO;
+//Shadowed point lights, the size of the array in the PointShadows block
+const int MAX_POINT_SHADOWS = 64;
 
-    //Matrices
-    glm::mat4 identity_matrix4 = glm::mat4(1.0f);
-    glm::mat4 transformation_matrix;
+//Resolutions the point light shadow maps come in, a light gets a finer one the larger it is on screen
+const int POINT_SHADOW_TIERS = 3;
 
-public:
-    //Constructor & Destructor
-    Model3D() {}
+//Binding point of each block, the block index doubles as the binding
+GLuint uniformBlockBinding(UniformBlockID block) {
+    return (GLuint)block;
+}
 
-    //Delete Vertex Object
-    ~Model3D() {
-        glDeleteVertexArrays(1, &this->VAO);
-        glDeleteBuffers(1, &this->VBO);
-    }
+//Textures shared between programs, each one stays on a fixed texture unit
+enum SharedTextureID {
+    TEXTURE_CLUSTER_LIGHTS,
+    TEXTURE_CLUSTER_GRID,
+    TEXTURE_CLUSTER_INDICES,
+    TEXTURE_GBUFFER_ALBEDO,
+    TEXTURE_GBUFFER_NORMAL,
+    TEXTURE_GBUFFER_DEPTH,
+    TEXTURE_SHADOW_CASCADES,
+    TEXTURE_POINT_SHADOWS, //One per tier
+    TEXTURE_POINT_SHADOWS_LAST = TEXTURE_POINT_SHADOWS + POINT_SHADOW_TIERS - 1,
+    SHARED_TEXTURE_COUNT
+};
 
-//Methods
-public:
-    //read vertex and frag shader file
-    void setShaders(const char* v, const char* f) {
-        this->v = v;
-        this->f = f;
-    }
+//Names of the samplers in the shaders, in SharedTextureID order
+const char* sharedTextureNames[SHARED_TEXTURE_COUNT] = {
+    "clusterLights",
+    "clusterGrid",
+    "clusterIndices",
+    "gAlbedo",
+    "gNormal",
+    "gDepth",
+    "shadowCascades",
+    "pointShadows0",
+    "pointShadows1",
+    "pointShadows2"
+};
 
-    //Create the texture and the object
-    void setTextureAndObj(std::string image, std::string obj) {
-        //Texture
-        stbi_set_flip_vertically_on_load(true);
+//Texture unit of each shared texture, unit 0 is left to the material's tex0
+GLuint sharedTextureUnit(SharedTextureID texture) {
+    return (GLuint)texture + 1;
+}
 
-        this->tex_bytes =
-            stbi_load(image.c_str(), //Texture path
-                &this->img_width, //Fills out the width
-                &this->img_height, //Fills out the height
-                &this->colorChannels, //Fiills out the colo channels
-                0);
+//Calls made and skipped by the state cache in one frame
+struct GLStateStats {
+    int programBinds = 0, programSkips = 0;
+    int vertexArrayBinds = 0, vertexArraySkips = 0;
+    int textureBinds = 0, textureSkips = 0;
+    int bufferBinds = 0, bufferSkips = 0;
+    int uniformSets = 0, uniformSkips = 0;
+    int drawCalls = 0;
+};
 
-        //Obj
-        this->path = obj.c_str();
+//Remembers the bound GL state and skips calls that wouldn't change it
+class GLStateCache {
+//Fields for the cache
+private:
+    static const int MAX_TEXTURE_UNITS = 16;
+    static const int MAX_BUFFER_BINDINGS = 16;
 
-        this->success = tinyobj::LoadObj(
-            &this->attributes,
-            &this->shapes,
-            &this->material,
-            &this->warning,
-            &this->error,
-            this->path.c_str()
-        );
+    GLuint program;
+    GLuint vertexArray;
+    GLuint activeUnit;
+    GLuint textures[MAX_TEXTURE_UNITS];
+    GLenum textureTargets[MAX_TEXTURE_UNITS];
 
-    }
+    //Depth and color write state
+    bool depthTest;
+    GLenum depthFunc;
+    GLboolean depthMask;
+    GLboolean colorMask;
 
-private:
-    //Generate textures
-    void createTexture() {
-        //Generate reference
-        glGenTextures(1, &this->texture);
-        //Set the current texture we're
-        //working
-        glActiveTexture(GL_TEXTURE0);
+    //Generic bindings per target, the element array buffer belongs to the VAO so it isn't tracked
+    std::unordered_map<GLenum, GLuint> buffers;
 
-        glBindTexture(GL_TEXTURE_2D, this->texture);
+    //Indexed bindings (glBindBufferBase) per target
+    std::unordered_map<GLenum, std::vector<GLuint>> bufferBases;
 
+    //Counters of this frame and of the last finished one
+    GLStateStats stats;
+    GLStateStats lastStats;
 
-        //Assign the loaded teexture
-        //to the OpenGL reference
-        glTexImage2D(GL_TEXTURE_2D,
-            0, //Texture 0
-            GL_RGB, // Target color format of the texture
-            this->img_width, // Texture width
-            this->img_height,// Texture height
-            0,
-            GL_RGB,    //Color format of the texturue
-            GL_UNSIGNED_BYTE, //Data type of texture
-            this->tex_bytes); // Loaded texture in bytes
+public:
+    //Constructor
+    GLStateCache() {
+        this->reset();
+    }
 
-        //Generate thhe mipmaps to the current texture
-        glGenerateMipmap(GL_TEXTURE_2D);
+public:
+    //Forget everything, the next call of each kind always reaches GL
+    void reset() {
+        this->program = 0;
+        this->vertexArray = 0;
+        this->activeUnit = 0;
+        for (int i = 0; i < MAX_TEXTURE_UNITS; i++) {
+            this->textures[i] = 0;
+            this->textureTargets[i] = GL_TEXTURE_2D;
+        }
+        this->buffers.clear();
+        this->bufferBases.clear();
+
+        //GL defaults
+        this->depthTest = false;
+        this->depthFunc = GL_LESS;
+        this->depthMask = GL_TRUE;
+        this->colorMask = GL_TRUE;
+    }
 
-        //Free uo the loaded bytes
-        stbi_image_free(this->tex_bytes);
+    //Start counting a new frame
+    void beginFrame() {
+        this->lastStats = this->stats;
+        this->stats = GLStateStats();
     }
 
-    //Compile vertex and frag shaders into one
-    void compileShaders() {
-        //Create a Vertex Shader
-        this->vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    void useProgram(GLuint program) {
+        if (this->program == program) {
+            this->stats.programSkips++;
+            return;
+        }
+        glUseProgram(program);
+        this->program = program;
+        this->stats.programBinds++;
+    }
 
-        //Assign the source to the Vertex Shader
-        glShaderSource(this->vertexShader, 1, &this->v, NULL);
+    void bindVertexArray(GLuint vertexArray) {
+        if (this->vertexArray == vertexArray) {
+            this->stats.vertexArraySkips++;
+            return;
+        }
+        glBindVertexArray(vertexArray);
+        this->vertexArray = vertexArray;
+        this->stats.vertexArrayBinds++;
+    }
 
-        //Compile the Vertex Shader
-        glCompileShader(this->vertexShader);
+    //Bind a texture to a unit, only switching the active unit when needed
+    void bindTexture(GLuint unit, GLenum target, GLuint texture) {
+        if (unit < MAX_TEXTURE_UNITS && this->textures[unit] == texture && this->textureTargets[unit] == target) {
+            this->stats.textureSkips++;
+            return;
+        }
+        if (this->activeUnit != unit) {
+            glActiveTexture(GL_TEXTURE0 + unit);
+            this->activeUnit = unit;
+        }
+        glBindTexture(target, texture);
+        if (unit < MAX_TEXTURE_UNITS) {
+            this->textures[unit] = texture;
+            this->textureTargets[unit] = target;
+        }
+        this->stats.textureBinds++;
+    }
 
-        //Create a Fragment Shader
-        this->fragShader = glCreateShader(GL_FRAGMENT_SHADER);
+    void bindBuffer(GLenum target, GLuint buffer) {
+        auto bound = this->buffers.find(target);
+        if (bound != this->buffers.end() && bound->second == buffer) {
+            this->stats.bufferSkips++;
+            return;
+        }
+        glBindBuffer(target, buffer);
+        this->buffers[target] = buffer;
+        this->stats.bufferBinds++;
+    }
 
-        //Assign the source to the Fragment Shader
-        glShaderSource(this->fragShader, 1, &this->f, NULL);
+    //glBindBufferBase also changes the generic binding of the target
+    void bindBufferBase(GLenum target, GLuint index, GLuint buffer) {
+        std::vector<GLuint>& bases = this->bufferBases[target];
+        if (bases.size() < MAX_BUFFER_BINDINGS)
+            bases.resize(MAX_BUFFER_BINDINGS, 0);
 
-        //Compile the Fragment Shader
-        glCompileShader(this->fragShader);
+        if (index < bases.size() && bases[index] == buffer) {
+            this->stats.bufferSkips++;
+            return;
+        }
+        glBindBufferBase(target, index, buffer);
+        if (index < bases.size())
+            bases[index] = buffer;
+        this->buffers[target] = buffer;
+        this->stats.bufferBinds++;
+    }
 
-        //Create the Shader Program
-        this->shaderProg = glCreateProgram();
-        //Attach the compiled Vertex Shader
-        glAttachShader(this->shaderProg, this->vertexShader);
-        //Attach the compiled Fragment Shader
-        glAttachShader(this->shaderProg, this->fragShader);
+    void setDepthTest(bool enabled) {
+        if (this->depthTest == enabled)
+            return;
+        if (enabled)
+            glEnable(GL_DEPTH_TEST);
+        else
+            glDisable(GL_DEPTH_TEST);
+        this->depthTest = enabled;
+    }
 
-        //Finalize the compilation process
-        glLinkProgram(this->shaderProg);
+    void setDepthFunc(GLenum func) {
+        if (this->depthFunc == func)
+            return;
+        glDepthFunc(func);
+        this->depthFunc = func;
     }
 
-    //set the Vertex and texture data of the object
-    void setVertAndTex() {
-        for (int i = 0; i < this->shapes[0].mesh.indices.size(); i++) {
-            this->mesh_indices.push_back(
-                this->shapes[0].mesh.indices[i].vertex_index
-            );
-        }
+    void setDepthMask(GLboolean mask) {
+        if (this->depthMask == mask)
+            return;
+        glDepthMask(mask);
+        this->depthMask = mask;
+    }
 
-        for (int i = 0; i < this->shapes[0].mesh.indices.size(); i++) {
+    //Write all color channels or none
+    void setColorMask(GLboolean mask) {
+        if (this->colorMask == mask)
+            return;
+        glColorMask(mask, mask, mask, mask);
+        this->colorMask = mask;
+    }
 
-            //Assign the Index data for easy access
-            tinyobj::index_t vData = this->shapes[0].mesh.indices[i];
+    //Forget a deleted program so a new one with the same name gets bound
+    void forgetProgram(GLuint program) {
+        if (this->program == program)
+            this->program = 0;
+    }
 
-            //Push the X position of the vertex
-            this->fullVertexData.push_back(
-                //Multiply the index by 3 to get the base offset
-                this->attributes.vertices[(vData.vertex_index * 3)]
-            );
+    //Forget a deleted buffer so a new one with the same name gets bound
+    void forgetBuffer(GLuint buffer) {
+        for (auto& bound : this->buffers)
+            if (bound.second == buffer)
+                bound.second = 0;
+        for (auto& bases : this->bufferBases)
+            for (GLuint& base : bases.second)
+                if (base == buffer)
+                    base = 0;
+    }
 
-            //Push the Y position of the vertex
-            this->fullVertexData.push_back(
-                //Add the base offset to 1 to get Y
-                this->attributes.vertices[(vData.vertex_index * 3) + 1]
-            );
+    //Uniform counters, the values themselves are cached per program
+    void countUniform(bool skipped) {
+        if (skipped)
+            this->stats.uniformSkips++;
+        else
+            this->stats.uniformSets++;
+    }
 
-            //Push the Z position of the vertex
-            this->fullVertexData.push_back(
-                //Add the base offset to 2 to get Z
-                this->attributes.vertices[(vData.vertex_index * 3) + 2]
-            );
+    void countDraw() {
+        this->stats.drawCalls++;
+    }
 
-            this->fullVertexData.push_back(
-                //Add the base offset to 2 to get X
-                this->attributes.normals[(vData.normal_index * 3)]
-            );
+    //Counters of the last finished frame
+    const GLStateStats& getLastStats() {
+        return this->lastStats;
+    }
 
-            this->fullVertexData.push_back(
-                //Add the base offset to 2 to get Y
-                this->attributes.normals[(vData.normal_index * 3) + 1]
-            );
+    //Print the last frame's counters
+    void printStats() {
+        const GLStateStats& s = this->lastStats;
+        std::cout << "Draws " << s.drawCalls
+            << " | Programs " << s.programBinds << " bound, " << s.programSkips << " skipped"
+            << " | VAOs " << s.vertexArrayBinds << " bound, " << s.vertexArraySkips << " skipped"
+            << " | Textures " << s.textureBinds << " bound, " << s.textureSkips << " skipped"
+            << " | Buffers " << s.bufferBinds << " bound, " << s.bufferSkips << " skipped"
+            << " | Uniforms " << s.uniformSets << " set, " << s.uniformSkips << " skipped" << std::endl;
+    }
+};
 
-            this->fullVertexData.push_back(
-                //Add the base offset to 2 to get Z
-                this->attributes.normals[(vData.normal_index * 3) + 2]
-            );
+//GL state shared by the whole renderer
+GLStateCache glState;
 
-            //Push the U of the Tex Coords
-            this->fullVertexData.push_back(
-                //Multiply the index by 3 to get the base offset
-                this->attributes.texcoords[(vData.texcoord_index * 2)]
-            );
+constexpr size_t alignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
 
-            //Push the V of the Tex Coords
-            this->fullVertexData.push_back(
-                //Add the base offset to 1 to get V
-                this->attributes.texcoords[(vData.texcoord_index * 2) + 1]
-            );
-        }
+//Blocks follow the std140 layout, the only one GLSL 330 has for uniform blocks
+//Base alignment, size and GLSL name of a block member type
+//Anything without a specialization must be a struct declared with DECLARE_BLOCK_STRUCT
+template <typename T>
+struct BlockMember {
+    static_assert(T::checkLayout(), "Nested block structs must be declared with DECLARE_BLOCK_STRUCT");
+    static constexpr size_t align = alignof(T);
+    static constexpr size_t size = sizeof(T);
+    static const char* glslName() { return T::glslName(); }
+};
 
-    }
+#define BLOCK_MEMBER_TYPE(Type, Align, Size, Name) \
+    template <> struct BlockMember<Type> { \
+        static constexpr size_t align = Align; \
+        static constexpr size_t size = Size; \
+        static const char* glslName() { return Name; } \
+    };
+BLOCK_MEMBER_TYPE(float, 4, 4, "float")
+BLOCK_MEMBER_TYPE(int, 4, 4, "int")
+BLOCK_MEMBER_TYPE(glm::uint, 4, 4, "uint")
+BLOCK_MEMBER_TYPE(glm::vec2, 8, 8, "vec2")
+BLOCK_MEMBER_TYPE(glm::vec3, 16, 12, "vec3")
+BLOCK_MEMBER_TYPE(glm::vec4, 16, 16, "vec4")
+BLOCK_MEMBER_TYPE(glm::ivec4, 16, 16, "ivec4")
+BLOCK_MEMBER_TYPE(glm::mat4, 16, 64, "mat4")
+#undef BLOCK_MEMBER_TYPE
+
+//Alignment of an array element, std140 rounds it up to a vec4
+template <typename T>
+constexpr size_t blockArrayAlign() {
+    return alignUp(BlockMember<T>::align, 16);
+}
+
+//Alignment of a whole struct, std140 rounds it up to a vec4
+const size_t BLOCK_STRUCT_ALIGN = 16;
+
+//Fields of a block, declared in a list macro as FIELD(type, name) and ARRAY(type, name, count)
+#define BLOCK_FIELD_DECLARE(type, name) alignas(BlockMember<type>::align) type name;
+#define BLOCK_ARRAY_DECLARE(type, name, count) alignas(blockArrayAlign<type>()) type name[count];
+
+#define BLOCK_FIELD_GLSL(type, name) glsl += std::string("\t") + BlockMember<type>::glslName() + " " #name ";\n";
+#define BLOCK_ARRAY_GLSL(type, name, count) glsl += std::string("\t") + BlockMember<type>::glslName() + " " #name "[" + std::to_string(count) + "];\n";
+
+//Walk the fields with the GLSL rules and compare every offset with the C++ one
+#define BLOCK_FIELD_CHECK(type, name) \
+    offset = alignUp(offset, BlockMember<type>::align); \
+    if (offsetof(Self, name) != offset) return false; \
+    offset += BlockMember<type>::size;
+#define BLOCK_ARRAY_CHECK(type, name, count) \
+    offset = alignUp(offset, blockArrayAlign<type>()); \
+    if (offsetof(Self, name) != offset) return false; \
+    if (alignUp(BlockMember<type>::size, blockArrayAlign<type>()) != sizeof(type)) return false; \
+    offset += sizeof(type) * (count);
+
+//Declare a C++ struct that matches a GLSL struct or block byte for byte
+//The GLSL text comes from the same field list, so the two can't drift apart
+#define DECLARE_BLOCK_STRUCT(Name, FIELDS) \
+    struct alignas(BLOCK_STRUCT_ALIGN) Name { \
+        FIELDS(BLOCK_FIELD_DECLARE, BLOCK_ARRAY_DECLARE) \
+        static const char* glslName() { return #Name; } \
+        static std::string glslFields() { \
+            std::string glsl; \
+            FIELDS(BLOCK_FIELD_GLSL, BLOCK_ARRAY_GLSL) \
+            return glsl; \
+        } \
+        static std::string glslStruct() { \
+            return std::string("struct " #Name " {\n") + glslFields() + "};\n"; \
+        } \
+        static std::string glslBlock(const std::string& blockName) { \
+            return std::string("layout(std140) uniform ") + blockName + " {\n" + glslFields() + "};\n"; \
+        } \
+        static constexpr bool checkLayout() { \
+            typedef Name Self; \
+            size_t offset = 0; \
+            FIELDS(BLOCK_FIELD_CHECK, BLOCK_ARRAY_CHECK) \
+            return sizeof(Self) == alignUp(offset, BLOCK_STRUCT_ALIGN); \
+        } \
+    }; \
+    static_assert(Name::checkLayout(), #Name " doesn't match its GLSL layout");
+
+//Camera matrices, filled in by MyCamera
+#define CAMERA_BLOCK_FIELDS(FIELD, ARRAY) \
+    FIELD(glm::mat4, view) \
+    FIELD(glm::mat4, projection) \
+    FIELD(glm::mat4, viewProjection) /* projection * view */ \
+    FIELD(glm::mat4, inverseViewProjection) /* clip space back to world space */ \
+    FIELD(glm::vec4, cameraPos) /* w is unused */
+DECLARE_BLOCK_STRUCT(CameraBlock, CAMERA_BLOCK_FIELDS)
+
+//Point light
+#define POINT_LIGHT_FIELDS(FIELD, ARRAY) \
+    FIELD(glm::vec4, position) /* w is the brightness */ \
+    FIELD(glm::vec4, color) /* w is the ambient strength */ \
+    FIELD(glm::vec4, ambientColor) /* w is the slot in pointShadowMaps + 1, 0 when unshadowed */ \
+    FIELD(glm::vec4, attenuation) /* constant, linear, exponent, unused */
+DECLARE_BLOCK_STRUCT(PointLightData, POINT_LIGHT_FIELDS)
+
+//Directional light
+#define DIRECTION_LIGHT_FIELDS(FIELD, ARRAY) \
+    FIELD(glm::vec4, direction) /* w is the brightness */ \
+    FIELD(glm::vec4, color) /* w is the ambient strength */ \
+    FIELD(glm::vec4, ambientColor) /* w is unused */
+DECLARE_BLOCK_STRUCT(DirectionLightData, DIRECTION_LIGHT_FIELDS)
+
+//Every light in the scene
+#define LIGHT_BLOCK_FIELDS(FIELD, ARRAY) \
+    FIELD(glm::ivec4, lightCounts) /* x point lights, y directional lights */ \
+    FIELD(glm::vec4, clusterDepth) /* slice = log(view depth) * x + y, zw unused */ \
+    ARRAY(PointLightData, pointLights, MAX_POINT_LIGHTS) \
+    ARRAY(DirectionLightData, directionLights, MAX_DIRECTION_LIGHTS)
+DECLARE_BLOCK_STRUCT(LightBlock, LIGHT_BLOCK_FIELDS)
+
+//Shading parameters of a surface
+#define MATERIAL_FIELDS(FIELD, ARRAY) \
+    FIELD(glm::vec4, color) /* multiplies the lit color, w is unused */ \
+    FIELD(glm::vec4, specular) /* x strength, y phong exponent, zw unused */
+DECLARE_BLOCK_STRUCT(MaterialData, MATERIAL_FIELDS)
+
+//Every material, a draw picks its own with materialIndex
+#define MATERIAL_BLOCK_FIELDS(FIELD, ARRAY) \
+    ARRAY(MaterialData, materials, MAX_MATERIALS)
+DECLARE_BLOCK_STRUCT(MaterialBlock, MATERIAL_BLOCK_FIELDS)
+
+//Cascaded shadow maps of one directional light, filled in by ShadowCascades
+#define SHADOW_BLOCK_FIELDS(FIELD, ARRAY) \
+    ARRAY(glm::mat4, cascadeMatrices, MAX_SHADOW_CASCADES) /* world space to the cascade's map, xyz in [0, 1] */ \
+    FIELD(glm::vec4, cascadeSplits) /* view depth where each cascade ends */ \
+    FIELD(glm::vec4, cascadeTexels) /* world size of a texel of each cascade */ \
+    FIELD(glm::ivec4, shadowInfo) /* x cascade count, y slot of the shadowed directional light, zw unused */
+DECLARE_BLOCK_STRUCT(ShadowBlock, SHADOW_BLOCK_FIELDS)
+
+//Cube shadow maps of the point lights, filled in by PointShadows
+#define POINT_SHADOW_BLOCK_FIELDS(FIELD, ARRAY) \
+    ARRAY(glm::vec4, pointShadowMaps, MAX_POINT_SHADOWS) /* x tier, y first of the six face layers, z near, w far */
+DECLARE_BLOCK_STRUCT(PointShadowBlock, POINT_SHADOW_BLOCK_FIELDS)
+
+//One layered pass into the faces of a point light's cube map, written by PointShadows before each pass
+#define CUBE_SHADOW_BLOCK_FIELDS(FIELD, ARRAY) \
+    ARRAY(glm::mat4, faceMatrices, 6) /* world space to each face's clip space */ \
+    FIELD(glm::ivec4, cubeFaces) /* x layer of the first face, y mask of the faces drawn, zw unused */
+DECLARE_BLOCK_STRUCT(CubeShadowBlock, CUBE_SHADOW_BLOCK_FIELDS)
+
+//GLSL declarations of the shared structs and blocks, added to every shader by the shader cache
+std::string blockDeclarations() {
+    return PointLightData::glslStruct() +
+        DirectionLightData::glslStruct() +
+        MaterialData::glslStruct() +
+        CameraBlock::glslBlock(uniformBlockNames[BLOCK_CAMERA]) +
+        LightBlock::glslBlock(uniformBlockNames[BLOCK_LIGHTS]) +
+        MaterialBlock::glslBlock(uniformBlockNames[BLOCK_MATERIALS]) +
+        ShadowBlock::glslBlock(uniformBlockNames[BLOCK_SHADOWS]) +
+        PointShadowBlock::glslBlock(uniformBlockNames[BLOCK_POINT_SHADOWS]) +
+        CubeShadowBlock::glslBlock(uniformBlockNames[BLOCK_CUBE_SHADOW]);
+}
+
+//Buffer backing a uniform block
+class UniformBuffer {
+//Fields for the buffer
+private:
+    GLuint id;
+    GLsizeiptr size;
+    UniformBlockID block;
 
 public:
-    //Createing thhe model
-    void createModel() {
-        //Call the neccessary functions to create model
-        this->createTexture();
-        this->compileShaders();
-        this->setVertAndTex();
+    //Constructor
+    UniformBuffer() {
+        this->id = 0;
+        this->size = 0;
+        this->block = BLOCK_CAMERA;
+    }
 
-        glGenVertexArrays(1, &this->VAO);
-        glGenBuffers(1, &this->VBO);
+public:
+    //Allocate the buffer for a block
+    void create(UniformBlockID block, GLsizeiptr size) {
+        this->block = block;
+        this->size = size;
+
+        glGenBuffers(1, &this->id);
+        glState.bindBuffer(GL_UNIFORM_BUFFER, this->id);
+        glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    }
 
-        //Generate VAO
-        glGenVertexArrays(1, &this->VAO);
+    //Copy data into the buffer
+    void upload(const void* data, GLsizeiptr size, GLintptr offset = 0) {
+        glState.bindBuffer(GL_UNIFORM_BUFFER, this->id);
+        glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+    }
 
-        //Generate VBO
-        glGenBuffers(1, &this->VBO);
+    //Replace the whole block with one copy into the mapped buffer
+    //Invalidating lets the driver hand out fresh memory instead of waiting on draws still reading the old one
+    template <typename Block>
+    void write(const Block& block) {
+        static_assert(Block::checkLayout(), "Only declared blocks can be written whole");
+
+        glState.bindBuffer(GL_UNIFORM_BUFFER, this->id);
+        void* mapped = glMapBufferRange(GL_UNIFORM_BUFFER, 0, sizeof(Block), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (mapped == NULL) {
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Block), &block);
+            return;
+        }
+        memcpy(mapped, &block, sizeof(Block));
+        glUnmapBuffer(GL_UNIFORM_BUFFER);
+    }
 
+    //Attach the buffer to the block's binding point
+    void bind() {
+        glState.bindBufferBase(GL_UNIFORM_BUFFER, uniformBlockBinding(this->block), this->id);
+    }
 
-        //Bind VAO and VBO
-        glBindVertexArray(this->VAO);
+    //Delete the buffer
+    void destroy() {
+        glState.forgetBuffer(this->id);
+        glDeleteBuffers(1, &this->id);
+        this->id = 0;
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, this->VBO);
+    //Getters
+    GLuint getID() {
+        return this->id;
+    }
+};
 
-        //Position
-        glBufferData(
-            GL_ARRAY_BUFFER,
-            //Size of the whole array in bytes
-            sizeof(GLfloat) * this->fullVertexData.size(),
-            //Data of the array
-            this->fullVertexData.data(),
-            GL_DYNAMIC_DRAW
-        );
+//Linked program with its active uniforms reflected once after linking
+class ShaderProgram {
+public:
+    //Build state of the program
+    enum State {
+        PENDING, //Submitted, the driver may still be compiling
+        READY, //Linked and reflected
+        FAILED //Compile or link error, never drawn with
+    };
+
+    //One line of an info log mapped back to the shader file
+    struct ShaderError {
+        std::string file;
+        int line; //0 when the log has no line number
+        std::string message;
+    };
+
+//Fields for the program
+private:
+    //Reflected uniform data
+    struct UniformInfo {
+        GLint location; //-1 when the program doesn't use it
+        GLenum type; //GL type of the uniform (GL_FLOAT_MAT4...)
+        GLint size; //Array size
+    };
 
-        glVertexAttribPointer(
-            0, //index 0 is the vertex position
-            3, //Position is 3 floats (x,y,z)
-            GL_FLOAT, // Data type of array
-            GL_FALSE,
+    //Last value sent to each uniform, a program keeps its uniforms between uses
+    struct UniformValue {
+        bool valid;
+        float data[16];
+    };
 
-            //Our vertex data has 8 floats in it
-            //(X,Y,Z,Normals,U,V)
-            8 * sizeof(GLfloat),//size of the vertex data in bytes
-            (void*)0
-        );
+    GLuint id;
+    UniformInfo uniforms[UNIFORM_COUNT];
+    UniformValue values[UNIFORM_COUNT];
 
-        glEnableVertexAttribArray(0);
+    State state;
 
-        //Since our UV starts at index 3
-        //or the 4th of our index data
+    //Stages kept attached until the build finishes: vertex, fragment and the optional geometry stage
+    GLuint stages[3];
 
-        //Normalize
-        GLintptr normalPtr = 3 * sizeof(float);
+    //Files of each stage, source string n of the stage comes from stageFiles[stage][n]
+    std::vector<std::string> stageFiles[3];
 
-        glVertexAttribPointer(
-            1, //index 0 is the vertex position
-            3, //Position is 3 floats (x,y,z)
-            GL_FLOAT, // Data type of array
-            GL_FALSE,
+    //Driver compiles in the background and reports completion
+    bool parallel;
 
-            //Our vertex data has 8 floats in it
-            //(X,Y,Z,Normals,U,V)
-            8 * sizeof(GLfloat),//size of the vertex data in bytes
-            (void*)normalPtr
-        );
+    //Errors and warnings from the last build
+    std::vector<ShaderError> errors;
 
-        glEnableVertexAttribArray(1);
+public:
+    //Constructor
+    ShaderProgram() {
+        this->id = 0;
+        this->state = READY;
+        this->stages[0] = this->stages[1] = this->stages[2] = 0;
+        this->parallel = false;
+        this->clearUniforms();
+    }
 
-        
-        //UV
-        GLintptr uvPtr = 6 * sizeof(float);
-
-        glVertexAttribPointer(
-            2, //index 0 is the vertex position
-            2, //Position is 3 floats (x,,z)
-            GL_FLOAT, // Data type of array
-            GL_FALSE,
-
-            //Our vertex data has 8 floats in it
-            //(X,Y,Z,Normals,U,V)
-            8 * sizeof(GLfloat),//size of the vertex data in bytes
-            (void*)uvPtr
-        );
-        glEnableVertexAttribArray(2);
+private:
+    //Mark every uniform as missing
+    void clearUniforms() {
+        for (int i = 0; i < UNIFORM_COUNT; i++) {
+            this->uniforms[i] = { -1, GL_NONE, 0 };
+            this->values[i].valid = false;
+        }
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        //Currently editing VBO = null
+    //Store a new uniform value, returns false when it's already set
+    bool changeValue(UniformID uniform, const float* data, int count) {
+        if (this->uniforms[uniform].location < 0)
+            return false;
 
-        //Currently editing VAO = VAO
-        glBindVertexArray(0);
-        //Currently editing VAO = null
+        UniformValue& value = this->values[uniform];
+        bool same = value.valid && memcmp(value.data, data, count * sizeof(float)) == 0;
+        glState.countUniform(same);
+        if (same)
+            return false;
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        memcpy(value.data, data, count * sizeof(float));
+        value.valid = true;
+        return true;
     }
 
-    //Set Object Position
-    void updateTranslate(float translate_x, float translate_y, float translate_z) {
-        this->transformation_matrix =
-            glm::translate(this->identity_matrix4,
-                glm::vec3(translate_x, translate_y, translate_z)
-            );
-    }
-    //Scale the Object
-    void updateScale(float scale_x, float scale_y, float scale_z) {
-        this->transformation_matrix =
-            glm::scale(this->transformation_matrix,
-                glm::vec3(scale_x, scale_y, scale_z)
-            );
-    }
+    //Split an info log into errors with the file and line of the original source
+    //Handles the "0:42(7):" (Mesa), "0(42) :" (NVIDIA) and "ERROR: 0:42:" (AMD) formats
+    //The shader cache numbers every file as its own source string with #line, so the location maps straight back
+    void parseLog(const std::string& log, const std::vector<std::string>& files) {
+        static const std::regex location("(\\d+)[:(](\\d+)\\)?(\\(\\d+\\))?\\s*:");
+
+        std::stringstream lines(log);
+        std::string text;
+        while (std::getline(lines, text)) {
+            if (text.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+
+            ShaderError error = { files[0], 0, text };
+
+            std::smatch match;
+            if (std::regex_search(text, match, location)) {
+                size_t file = (size_t)std::stoul(match[1].str());
+                if (file < files.size())
+                    error.file = files[file];
+                error.line = std::stoi(match[2].str());
+
+                //Drop the driver's own location, the mapped one replaces it
+                std::string message = match.suffix().str();
+                size_t start = message.find_first_not_of(" \t");
+                error.message = match.prefix().str() + (start == std::string::npos ? "" : message.substr(start));
+            }
 
-    //Rotate the Object
-    void updateRotation(float rotate_x, float rotate_y, float rotate_z) {
-        //X Rotation
-        this->transformation_matrix =
-            glm::rotate(this->transformation_matrix,
-                glm::radians(rotate_x),
-                glm::normalize(glm::vec3(1.f, 0.f, 0.f))
-            );
-        //Y Rotation
-        this->transformation_matrix =
-            glm::rotate(this->transformation_matrix,
-                glm::radians(rotate_y),
-                glm::normalize(glm::vec3(0.f, 1.f, 0.f))
-            );
-        //Z Rotation
-        this->transformation_matrix =
-            glm::rotate(this->transformation_matrix,
-                glm::radians(rotate_z),
-                glm::normalize(glm::vec3(0.f, 0.f, 1.f))
-            );
+            this->errors.push_back(error);
+        }
     }
 
-    //Revolve object around a center
-    void updateRevolution(float revolve_x, float revolve_y, float revolve_z, float rotate_x,
-        float rotate_y, float rotate_z, PointLight* lightPos);
+    //Read the status and logs once the driver is done
+    void finish() {
+        bool compiled = true;
 
-    //Updating Transformation matrix
-    void update() {
+        for (int i = 0; i < 3; i++) {
+            //No geometry stage
+            if (this->stages[i] == 0)
+                continue;
 
-        unsigned int transformLoc = glGetUniformLocation(this->shaderProg, "transform");
+            GLint status = GL_FALSE, length = 0;
+            glGetShaderiv(this->stages[i], GL_COMPILE_STATUS, &status);
+            glGetShaderiv(this->stages[i], GL_INFO_LOG_LENGTH, &length);
 
-        glUniformMatrix4fv(transformLoc,
-            1,
-            GL_FALSE,
-            glm::value_ptr(this->transformation_matrix));
-    }
-    //Render Texture with light
-    void renderTexture(Light* light, glm::vec3 cameraPos);
+            if (length > 1) {
+                std::string log(length, '\0');
+                glGetShaderInfoLog(this->stages[i], length, NULL, &log[0]);
+                log.resize(length - 1);
+                this->parseLog(log, this->stageFiles[i]);
+            }
+            compiled = compiled && status == GL_TRUE;
 
-    //Render the Complete object
-    void perform(Light* light, glm::vec3 cameraPos) {
-        //Update object
-        this->update();
-        //Render Texture
-        this->renderTexture(light, cameraPos);
+            //The linked program keeps its own copy so the shader objects can go
+            glDetachShader(this->id, this->stages[i]);
+            glDeleteShader(this->stages[i]);
+            this->stages[i] = 0;
+        }
 
+        GLint linked = GL_FALSE, length = 0;
+        glGetProgramiv(this->id, GL_LINK_STATUS, &linked);
+        glGetProgramiv(this->id, GL_INFO_LOG_LENGTH, &length);
+        if (compiled && length > 1) {
+            std::string log(length, '\0');
+            glGetProgramInfoLog(this->id, length, NULL, &log[0]);
+            log.resize(length - 1);
+            this->parseLog(log, { this->stageFiles[0][0] + " + " + this->stageFiles[1][0] });
+        }
 
-        glBindVertexArray(this->VAO);
+        this->state = compiled && linked ? READY : FAILED;
 
-        //Rendering the model
-        glDrawArrays(GL_TRIANGLES, 0, this->fullVertexData.size() / 8);
-    }
+        //Report every problem with the file it came from
+        for (ShaderError& error : this->errors) {
+            std::cout << error.file;
+            if (error.line > 0)
+                std::cout << ":" << error.line;
+            std::cout << ": " << error.message << std::endl;
+        }
+        if (this->state == FAILED)
+            std::cout << "Shader program failed to build: " << this->stageFiles[0][0] << ", " << this->stageFiles[1][0] << std::endl;
 
-    //Getters
-    GLuint getShaderProg() {
-        return this->shaderProg;
+        //Look up the uniforms once instead of on every draw
+        if (this->state == READY)
+            this->reflect(this->id);
     }
-};
 
-//Create Camera Abstract Class
-class MyCamera {
-//Camera Fields
-protected:
-    //Matrix for the projection
-    glm::mat4 projectionMatrix;
+public:
+    //Take over a program whose compile and link were just issued, geomShader is 0 without a geometry stage
+    void submit(GLuint id, GLuint vertexShader, GLuint fragShader, GLuint geomShader,
+        const std::vector<std::string>& vertFiles, const std::vector<std::string>& fragFiles,
+        const std::vector<std::string>& geomFiles, bool parallel) {
+        this->id = id;
+        this->stages[0] = vertexShader;
+        this->stages[1] = fragShader;
+        this->stages[2] = geomShader;
+        this->stageFiles[0] = vertFiles;
+        this->stageFiles[1] = fragFiles;
+        this->stageFiles[2] = geomFiles;
+        this->parallel = parallel;
+        this->errors.clear();
+        this->state = PENDING;
+    }
+
+    //Poll the build, only blocks when the driver can't compile in the background
+    bool isReady() {
+        if (this->state == PENDING) {
+            if (this->parallel) {
+                GLint done = GL_FALSE;
+                glGetProgramiv(this->id, GL_COMPLETION_STATUS_KHR, &done);
+                if (!done)
+                    return false;
+            }
+            this->finish();
+        }
+        return this->state == READY;
+    }
+
+    bool hasFailed() {
+        return this->state == FAILED;
+    }
+
+    //Switch to a rebuilt program, the old one is deleted
+    //The uniform table and block bindings are read again from the new program
+    void replace(ShaderProgram& build) {
+        if (this->id != 0) {
+            glState.forgetProgram(this->id);
+            glDeleteProgram(this->id);
+        }
+        this->errors = build.errors;
+        this->state = READY;
+        this->reflect(build.id);
+        build.id = 0;
+    }
+
+    //Throw away a build without waiting for it, its shader objects are deleted with the program
+    void discard() {
+        for (int i = 0; i < 3; i++) {
+            if (this->stages[i] != 0)
+                glDeleteShader(this->stages[i]);
+            this->stages[i] = 0;
+        }
+        if (this->id != 0) {
+            glState.forgetProgram(this->id);
+            glDeleteProgram(this->id);
+        }
+        this->id = 0;
+    }
+
+public:
+    //Enumerate the active uniforms of a linked program into the table
+    void reflect(GLuint id) {
+        this->id = id;
+        this->clearUniforms();
+
+        GLint count = 0, maxLength = 0;
+        glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+        std::string name(maxLength > 0 ? maxLength : 1, '\0');
+        for (GLint i = 0; i < count; i++) {
+            GLsizei length = 0;
+            GLint size = 0;
+            GLenum type = GL_NONE;
+            glGetActiveUniform(id, i, maxLength, &length, &size, &type, &name[0]);
+
+            //Arrays are reported as name[0]
+            std::string uniformName = name.substr(0, length);
+            size_t bracket = uniformName.find('[');
+            if (bracket != std::string::npos)
+                uniformName = uniformName.substr(0, bracket);
+
+            for (int u = 0; u < UNIFORM_COUNT; u++) {
+                if (uniformName == uniformNames[u]) {
+                    //Uniforms inside blocks have no location
+                    GLint location = glGetUniformLocation(id, uniformNames[u]);
+                    this->uniforms[u] = { location, type, size };
+                    break;
+                }
+            }
+        }
+
+        //Point the shared blocks at their fixed binding points
+        for (int b = 0; b < BLOCK_COUNT; b++) {
+            GLuint index = glGetUniformBlockIndex(id, uniformBlockNames[b]);
+            if (index != GL_INVALID_INDEX)
+                glUniformBlockBinding(id, index, uniformBlockBinding((UniformBlockID)b));
+        }
+
+        //Point the shared samplers at their fixed texture units
+        for (int t = 0; t < SHARED_TEXTURE_COUNT; t++) {
+            GLint location = glGetUniformLocation(id, sharedTextureNames[t]);
+            if (location >= 0) {
+                glState.useProgram(id);
+                glUniform1i(location, sharedTextureUnit((SharedTextureID)t));
+            }
+        }
+    }
+
+    //Make this the current program
+    void use() {
+        glState.useProgram(this->id);
+    }
+
+    //Uniform setters, the program must be in use
+    //Skipped when the program doesn't use the uniform or already has the value
+    void setMat4(UniformID uniform, const glm::mat4& value) {
+        if (this->changeValue(uniform, glm::value_ptr(value), 16))
+            glUniformMatrix4fv(this->uniforms[uniform].location, 1, GL_FALSE, glm::value_ptr(value));
+    }
+    void setMat3(UniformID uniform, const glm::mat3& value) {
+        if (this->changeValue(uniform, glm::value_ptr(value), 9))
+            glUniformMatrix3fv(this->uniforms[uniform].location, 1, GL_FALSE, glm::value_ptr(value));
+    }
+    void setVec3(UniformID uniform, const glm::vec3& value) {
+        if (this->changeValue(uniform, glm::value_ptr(value), 3))
+            glUniform3fv(this->uniforms[uniform].location, 1, glm::value_ptr(value));
+    }
+    void setFloat(UniformID uniform, float value) {
+        if (this->changeValue(uniform, &value, 1))
+            glUniform1f(this->uniforms[uniform].location, value);
+    }
+    void setInt(UniformID uniform, int value) {
+        float stored = (float)value;
+        if (this->changeValue(uniform, &stored, 1))
+            glUniform1i(this->uniforms[uniform].location, value);
+    }
+
+    //Getters
+    GLuint getID() {
+        return this->id;
+    }
+    State getState() {
+        return this->state;
+    }
+    const std::vector<ShaderError>& getErrors() {
+        return this->errors;
+    }
+    GLint getLocation(UniformID uniform) {
+        return this->uniforms[uniform].location;
+    }
+    GLenum getType(UniformID uniform) {
+        return this->uniforms[uniform].type;
+    }
+    bool hasUniform(UniformID uniform) {
+        return this->uniforms[uniform].location >= 0;
+    }
+};
+
+//Background thread that reports shader files whose contents changed
+//Files are compared by content so editors that only touch the file don't trigger a rebuild
+class ShaderWatcher {
+//Fields for the watcher
+private:
+    //A watched file and the hash of its last contents
+    struct WatchedFile {
+        std::string path;
+        size_t hash;
+    };
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::atomic<bool> running;
+
+    //Time between two checks
+    std::chrono::milliseconds interval;
+
+    //Guarded by the mutex
+    std::vector<WatchedFile> files;
+    std::vector<std::pair<std::string, std::string>> changed; //Path and new contents
+
+public:
+    //Constructor & Destructor
+    ShaderWatcher() : running(false), interval(500) {}
+    ~ShaderWatcher() {
+        this->stop();
+    }
+
+private:
+    //Read a whole file, returns false when it can't be opened
+    static bool readFile(const std::string& path, std::string& text) {
+        std::ifstream file(path);
+        if (!file)
+            return false;
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        text = buffer.str();
+        return true;
+    }
+
+    //Thread body, checks every file then sleeps until the next check or stop()
+    void run() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (this->running) {
+            std::vector<WatchedFile> snapshot = this->files;
+            lock.unlock();
+
+            //File reads happen without the lock so the render thread never waits on them
+            std::vector<std::pair<std::string, std::string>> found;
+            for (WatchedFile& file : snapshot) {
+                std::string text;
+                if (!readFile(file.path, text))
+                    continue; //Editors can briefly remove the file while saving
+
+                size_t hash = std::hash<std::string>()(text);
+                if (hash != file.hash) {
+                    file.hash = hash;
+                    found.push_back({ file.path, text });
+                }
+            }
+
+            lock.lock();
+            for (auto& update : found) {
+                for (WatchedFile& file : this->files)
+                    if (file.path == update.first)
+                        file.hash = std::hash<std::string>()(update.second);
+                this->changed.push_back(update);
+            }
+            this->wake.wait_for(lock, this->interval, [this] { return !this->running; });
+        }
+    }
+
+public:
+    //Watch a file from its current contents, starts the thread on first use
+    void watch(const std::string& path, const std::string& contents) {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            for (WatchedFile& file : this->files)
+                if (file.path == path)
+                    return;
+            this->files.push_back({ path, std::hash<std::string>()(contents) });
+        }
+
+        if (!this->running) {
+            this->running = true;
+            this->thread = std::thread(&ShaderWatcher::run, this);
+        }
+    }
+
+    //Take the files that changed since the last call
+    std::vector<std::pair<std::string, std::string>> takeChanged() {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        std::vector<std::pair<std::string, std::string>> result;
+        result.swap(this->changed);
+        return result;
+    }
+
+    //Stop the thread and forget every file
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->running = false;
+            this->files.clear();
+            this->changed.clear();
+        }
+        this->wake.notify_all();
+        if (this->thread.joinable())
+            this->thread.join();
+    }
+};
+
+//Starting value of an FNV-1a hash
+const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+//FNV-1a hash of raw bytes, stable between runs so it can name files
+uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+//Hash of a string, the length goes in first so the same text split differently between strings hashes differently
+uint64_t hashString(const std::string& text, uint64_t hash = HASH_SEED) {
+    uint64_t length = text.size();
+    hash = hashBytes(hash, &length, sizeof(length));
+    return hashBytes(hash, text.data(), text.size());
+}
+
+//Shared shader programs so identical sources are only compiled once
+class ShaderCache {
+//Fields for the cache
+private:
+    //Linked programs keyed by the hash of their sources and defines
+    std::unordered_map<uint64_t, ShaderProgram> programs;
+
+    //Folder the program binaries are saved to
+    std::string binaryFolder = "Shaders/";
+
+    //Vendor, renderer and version of the driver, binaries are only valid for the same one
+    std::string driverID;
+
+    //Driver can save and load program binaries
+    bool binarySupported = false;
+    bool driverChecked = false;
+
+    //Driver compiles on its own threads (KHR/ARB_parallel_shader_compile)
+    bool parallelCompile = false;
+
+    //Shader files read so far, keyed by path
+    std::unordered_map<std::string, std::string> sources;
+
+    //Programs still being built
+    std::vector<uint64_t> pending;
+
+    //Files and defines a program was built from, so it can be rebuilt when a file changes
+    struct ProgramSource {
+        std::string vertPath;
+        std::string fragPath;
+        std::string variantDefines;
+        std::vector<std::string> files; //Every file read, includes too
+        std::string geomPath; //Empty without a geometry stage
+    };
+
+    //Every stage of a program ready to compile, with includes expanded and defines injected
+    struct ExpandedProgram {
+        std::string vertSource;
+        std::string fragSource;
+        std::string geomSource; //Empty without a geometry stage
+        std::vector<std::string> vertFiles; //Source string n of the stage comes from vertFiles[n]
+        std::vector<std::string> fragFiles;
+        std::vector<std::string> geomFiles;
+        uint64_t key;
+    };
+    std::unordered_map<uint64_t, ProgramSource> programSources;
+
+    //Sources a key was hashed from, a cache hit is only trusted when they match
+    struct KeySources {
+        std::string vertSource;
+        std::string fragSource;
+        std::string geomSource;
+        bool probed; //Moved past a colliding key, kept out of the binary cache
+    };
+    std::unordered_map<uint64_t, KeySources> keySources;
+
+    //Keys of rebuilt sources pointing at the program they replaced
+    std::unordered_map<uint64_t, uint64_t> reloadedKeys;
+
+    //A rebuild in progress, swapped in only once it links
+    struct Reload {
+        uint64_t key; //Program being replaced
+        uint64_t sourceKey; //Key of the new sources, the binary is saved under it
+        ShaderProgram build;
+    };
+    std::vector<Reload> reloads;
+
+    //Rebuild programs when their files change on disk
+    ShaderWatcher watcher;
+    bool hotReload = true;
+
+public:
+    //Constructor
+    ShaderCache() {}
+
+private:
+    //Insert the defines right after the #version line
+    //They get their own source string so the file's line numbers stay the same
+    std::string injectDefines(const std::string& source, const std::string& defines, std::vector<std::string>& files) {
+        if (defines.empty())
+            return source;
+
+        size_t versionEnd = 0;
+        if (source.compare(0, 8, "#version") == 0) {
+            versionEnd = source.find('\n');
+            versionEnd = versionEnd == std::string::npos ? source.size() : versionEnd + 1;
+        }
+
+        std::string definesString = std::to_string(files.size());
+        files.push_back("<engine defines>");
+
+        return source.substr(0, versionEnd) +
+            "#line 1 " + definesString + "\n" + defines +
+            "#line " + (versionEnd > 0 ? "2" : "1") + " 0\n" +
+            source.substr(versionEnd);
+    }
+
+    //Replace #include "file" lines with the file, the path is relative to the including file
+    //Each file becomes its own source string numbered by its index in files, a file is included once
+    std::string expandIncludes(const std::string& path, std::vector<std::string>& files) {
+        static const std::regex include("\\s*#\\s*include\\s+\"([^\"]+)\"\\s*");
+
+        std::string fileString = std::to_string(files.size());
+        files.push_back(path);
+
+        size_t slash = path.find_last_of("/\\");
+        std::string folder = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+        std::stringstream lines(this->loadSource(path));
+        std::string text, result;
+        int line = 0;
+        while (std::getline(lines, text)) {
+            line++;
+
+            std::smatch match;
+            if (!std::regex_match(text, match, include)) {
+                result += text + "\n";
+                continue;
+            }
+
+            std::string includePath = folder + match[1].str();
+            if (std::find(files.begin(), files.end(), includePath) == files.end()) {
+                result += "#line 1 " + std::to_string(files.size()) + "\n";
+                result += this->expandIncludes(includePath, files);
+            }
+
+            //Back to the including file on the line after the #include
+            result += "#line " + std::to_string(line + 1) + " " + fileString + "\n";
+        }
+        return result;
+    }
+
+    //Engine limits and shared block declarations every shader sees, so they match the C++ side
+    std::string limitDefines() {
+        return "#define MAX_POINT_LIGHTS " + std::to_string(MAX_POINT_LIGHTS) + "\n" +
+            "#define MAX_DIRECTION_LIGHTS " + std::to_string(MAX_DIRECTION_LIGHTS) + "\n" +
+            "#define CLUSTER_TILES_X " + std::to_string(CLUSTER_TILES_X) + "\n" +
+            "#define CLUSTER_TILES_Y " + std::to_string(CLUSTER_TILES_Y) + "\n" +
+            "#define CLUSTER_SLICES " + std::to_string(CLUSTER_SLICES) + "\n" +
+            blockDeclarations();
+    }
+
+    //Check once whether the driver can give back program binaries
+    void checkDriver() {
+        if (this->driverChecked)
+            return;
+        this->driverChecked = true;
+
+        const char* vendor = (const char*)glGetString(GL_VENDOR);
+        const char* renderer = (const char*)glGetString(GL_RENDERER);
+        const char* version = (const char*)glGetString(GL_VERSION);
+        this->driverID = std::string(vendor ? vendor : "") + "|" +
+            (renderer ? renderer : "") + "|" + (version ? version : "");
+
+        GLint formats = 0;
+        if (GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary)
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        this->binarySupported = formats > 0;
+
+        //Let the driver use as many compiler threads as it wants
+        if (GLAD_GL_KHR_parallel_shader_compile) {
+            glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+            this->parallelCompile = true;
+        }
+        else if (GLAD_GL_ARB_parallel_shader_compile) {
+            glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+            this->parallelCompile = true;
+        }
+    }
+
+    //Read a shader file once
+    const std::string& loadSource(const std::string& path) {
+        auto found = this->sources.find(path);
+        if (found != this->sources.end())
+            return found->second;
+
+        //Load the shader file into a string stream
+        std::ifstream file(path);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+
+        if (!file)
+            std::cout << path << ": could not open shader file" << std::endl;
+
+        std::string& source = this->sources[path] = buffer.str();
+        if (this->hotReload)
+            this->watcher.watch(path, source);
+        return source;
+    }
+
+    //Expand every stage and hash them into the program key
+    ExpandedProgram expand(const std::string& vertPath, const std::string& fragPath, const std::string& defines,
+        const std::string& geomPath) {
+        ExpandedProgram expanded;
+        expanded.vertSource = this->injectDefines(this->expandIncludes(vertPath, expanded.vertFiles), defines, expanded.vertFiles);
+        expanded.fragSource = this->injectDefines(this->expandIncludes(fragPath, expanded.fragFiles), defines, expanded.fragFiles);
+        expanded.key = hashString(expanded.fragSource, hashString(expanded.vertSource));
+        if (!geomPath.empty()) {
+            expanded.geomSource = this->injectDefines(this->expandIncludes(geomPath, expanded.geomFiles), defines, expanded.geomFiles);
+            expanded.key = hashString(expanded.geomSource, expanded.key);
+        }
+        return expanded;
+    }
+
+    //Key of the expanded sources, checked against the sources stored for it
+    //A different program already holding the hash moves the key on to the next free one
+    uint64_t resolveKey(const ExpandedProgram& expanded) {
+        uint64_t key = expanded.key;
+        bool probed = false;
+        for (;;) {
+            auto found = this->keySources.find(key);
+            if (found == this->keySources.end()) {
+                this->keySources[key] = { expanded.vertSource, expanded.fragSource, expanded.geomSource, probed };
+                return key;
+            }
+
+            const KeySources& stored = found->second;
+            if (stored.vertSource == expanded.vertSource && stored.fragSource == expanded.fragSource &&
+                stored.geomSource == expanded.geomSource)
+                return key;
+
+            if (!probed)
+                std::cout << "Shader program key collision, the program is left out of the binary cache" << std::endl;
+            probed = true;
+            key++;
+        }
+    }
+
+    //Keys moved past a collision may match another program's binary from an earlier run
+    bool binaryCacheable(uint64_t key) {
+        auto found = this->keySources.find(key);
+        return this->binarySupported && (found == this->keySources.end() || !found->second.probed);
+    }
+
+    //Files a program reads, for the watcher
+    std::vector<std::string> sourceFiles(const ExpandedProgram& expanded) {
+        std::vector<std::string> files;
+        for (const std::vector<std::string>* stage : { &expanded.vertFiles, &expanded.fragFiles, &expanded.geomFiles })
+            for (const std::string& file : *stage)
+                if (file[0] != '<' && std::find(files.begin(), files.end(), file) == files.end())
+                    files.push_back(file);
+        return files;
+    }
+
+    //Path of the binary for a program key
+    std::string binaryPath(uint64_t key) {
+        //The driver is part of the file name so a driver update never loads a stale binary
+        uint64_t fileKey = hashString(this->driverID, key);
+
+        std::stringstream path;
+        path << this->binaryFolder << "program_" << std::hex << std::setw(16) << std::setfill('0') << fileKey << ".bin";
+        return path.str();
+    }
+
+    //Try to create the program from a saved binary, returns 0 when there is none or the driver rejects it
+    GLuint loadBinary(uint64_t key) {
+        if (!this->binaryCacheable(key))
+            return 0;
+
+        std::ifstream file(this->binaryPath(key), std::ios::binary);
+        if (!file)
+            return 0;
+
+        //Header is the program key and the binary format
+        uint64_t savedKey = 0;
+        GLenum format = 0;
+        file.read((char*)&savedKey, sizeof(savedKey));
+        file.read((char*)&format, sizeof(format));
+        if (!file || savedKey != key)
+            return 0;
+
+        std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (binary.empty())
+            return 0;
+
+        GLuint shaderProg = glCreateProgram();
+        glProgramBinary(shaderProg, format, binary.data(), (GLsizei)binary.size());
+
+        GLint linked = GL_FALSE;
+        glGetProgramiv(shaderProg, GL_LINK_STATUS, &linked);
+        if (!linked) {
+            glDeleteProgram(shaderProg);
+            return 0;
+        }
+        return shaderProg;
+    }
+
+    //Save the linked program so the next run can skip compiling it
+    void saveBinary(uint64_t key, GLuint shaderProg) {
+        if (!this->binaryCacheable(key))
+            return;
+
+        GLint length = 0;
+        glGetProgramiv(shaderProg, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return;
+
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(shaderProg, length, &length, &format, binary.data());
+
+        std::ofstream file(this->binaryPath(key), std::ios::binary | std::ios::trunc);
+        if (!file)
+            return;
+
+        file.write((const char*)&key, sizeof(key));
+        file.write((const char*)&format, sizeof(format));
+        file.write(binary.data(), length);
+    }
+
+    //Compile a single shader stage
+    GLuint compileStage(GLenum type, const std::string& source) {
+        GLuint shader = glCreateShader(type);
+
+        const char* src = source.c_str();
+        glShaderSource(shader, 1, &src, NULL);
+        glCompileShader(shader);
+
+        return shader;
+    }
+
+public:
+    //Get the program for the shader files, compiling and linking it only on first use
+    //The build is only submitted here, check isReady() before drawing with it
+    //A geometry shader is added between the two stages when geomPath is given
+    ShaderProgram* getProgram(const std::string& vertPath, const std::string& fragPath, const std::string& variantDefines = "",
+        const std::string& geomPath = "") {
+        //Hash every stage with its includes and defines into one key
+        ExpandedProgram expanded = this->expand(vertPath, fragPath, this->limitDefines() + variantDefines, geomPath);
+        uint64_t key = this->resolveKey(expanded);
+
+        //Sources that were edited while running map to the program that was rebuilt from them
+        auto reloaded = this->reloadedKeys.find(key);
+        if (reloaded != this->reloadedKeys.end())
+            key = reloaded->second;
+
+        auto cached = this->programs.find(key);
+        if (cached != this->programs.end())
+            return &cached->second;
+
+        this->programSources[key] = { vertPath, fragPath, variantDefines, this->sourceFiles(expanded), geomPath };
+
+        //Use the binary from an earlier run when the driver still accepts it
+        this->checkDriver();
+        GLuint binaryProg = this->loadBinary(key);
+        if (binaryProg != 0) {
+            ShaderProgram& program = this->programs[key];
+            program.reflect(binaryProg);
+            return &program;
+        }
+
+        ShaderProgram& program = this->programs[key];
+        this->build(program, expanded);
+        this->pending.push_back(key);
+        return &program;
+    }
+
+private:
+    //Compile and link the files into the program, the result is read later by isReady()
+    void build(ShaderProgram& program, const ExpandedProgram& expanded) {
+        GLuint vertexShader = this->compileStage(GL_VERTEX_SHADER, expanded.vertSource);
+        GLuint fragShader = this->compileStage(GL_FRAGMENT_SHADER, expanded.fragSource);
+        GLuint geomShader = expanded.geomSource.empty() ? 0 : this->compileStage(GL_GEOMETRY_SHADER, expanded.geomSource);
+
+        //Create the Shader Program
+        GLuint shaderProg = glCreateProgram();
+        glAttachShader(shaderProg, vertexShader);
+        glAttachShader(shaderProg, fragShader);
+        if (geomShader != 0)
+            glAttachShader(shaderProg, geomShader);
+
+        //Ask the driver to keep the binary around for saving
+        if (this->binarySupported)
+            glProgramParameteri(shaderProg, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+        //Finalize the compilation process
+        //Nothing is queried here so the driver can keep compiling in the background
+        glLinkProgram(shaderProg);
+
+        program.submit(shaderProg, vertexShader, fragShader, geomShader,
+            expanded.vertFiles, expanded.fragFiles, expanded.geomFiles, this->parallelCompile);
+    }
+
+    //Start rebuilding every program that uses a file the watcher saw change
+    void startReloads() {
+        for (auto& change : this->watcher.takeChanged()) {
+            this->sources[change.first] = change.second;
+            std::cout << change.first << ": changed, rebuilding" << std::endl;
+
+            for (auto& entry : this->programSources) {
+                ProgramSource& source = entry.second;
+                if (std::find(source.files.begin(), source.files.end(), change.first) == source.files.end())
+                    continue;
+
+                //A newer edit supersedes a rebuild that hasn't finished
+                for (size_t i = 0; i < this->reloads.size(); i++) {
+                    if (this->reloads[i].key == entry.first) {
+                        this->reloads[i].build.discard();
+                        this->reloads.erase(this->reloads.begin() + i);
+                        break;
+                    }
+                }
+
+                ExpandedProgram expanded = this->expand(source.vertPath, source.fragPath,
+                    this->limitDefines() + source.variantDefines, source.geomPath);
+                source.files = this->sourceFiles(expanded);
+
+                Reload reload;
+                reload.key = entry.first;
+                reload.sourceKey = this->resolveKey(expanded);
+                this->build(reload.build, expanded);
+                this->reloads.push_back(reload);
+            }
+        }
+    }
+
+    //Swap in the rebuilds that linked, a failed one leaves the last good program in place
+    void finishReloads() {
+        for (size_t i = 0; i < this->reloads.size();) {
+            Reload& reload = this->reloads[i];
+            ShaderProgram& program = this->programs[reload.key];
+
+            //Wait for the first build too so it can't overwrite the rebuild
+            if (program.getState() == ShaderProgram::PENDING ||
+                (reload.build.getState() == ShaderProgram::PENDING && !reload.build.isReady())) {
+                i++;
+                continue;
+            }
+
+            if (reload.build.getState() == ShaderProgram::READY) {
+                program.replace(reload.build);
+                this->reloadedKeys[reload.sourceKey] = reload.key;
+                this->saveBinary(reload.sourceKey, program.getID());
+                std::cout << "Reloaded shader program: " << this->programSources[reload.key].vertPath << ", "
+                    << this->programSources[reload.key].fragPath << std::endl;
+            }
+            else {
+                reload.build.discard();
+                std::cout << "Keeping the last working shader program" << std::endl;
+            }
+
+            this->reloads.erase(this->reloads.begin() + i);
+        }
+    }
+
+public:
+    //Turn watching the shader files on or off, files loaded while it's off aren't watched
+    void setHotReload(bool enabled) {
+        this->hotReload = enabled;
+        if (!enabled)
+            this->watcher.stop();
+    }
+
+    //Finish the programs the driver is done with, call once per frame
+    //Newly linked programs get their binary saved for the next run
+    //Edited shader files are rebuilt here and swapped in once they link
+    void poll() {
+        this->startReloads();
+        this->finishReloads();
+
+        for (size_t i = 0; i < this->pending.size();) {
+            ShaderProgram& program = this->programs[this->pending[i]];
+
+            if (program.getState() == ShaderProgram::PENDING && !program.isReady()) {
+                i++;
+                continue;
+            }
+
+            if (program.getState() == ShaderProgram::READY)
+                this->saveBinary(this->pending[i], program.getID());
+
+            this->pending.erase(this->pending.begin() + i);
+        }
+    }
+
+    //Number of programs still compiling
+    size_t getPendingCount() {
+        return this->pending.size();
+    }
+
+    //Number of unique programs
+    size_t size() {
+        return this->programs.size();
+    }
+
+    //Delete every program, must be called while the context is alive
+    void clear() {
+        this->watcher.stop();
+        glState.useProgram(0);
+        for (Reload& reload : this->reloads)
+            reload.build.discard();
+        for (auto& program : this->programs)
+            glDeleteProgram(program.second.getID());
+        this->programs.clear();
+        this->programSources.clear();
+        this->keySources.clear();
+        this->reloadedKeys.clear();
+        this->reloads.clear();
+        this->pending.clear();
+        this->sources.clear();
+    }
+};
+
+//Program cache shared by every model
+ShaderCache shaderCache;
+
+//Features a draw needs from Sample.vert/Sample.frag
+//Each combination compiles to its own program so unused paths are compiled out
+struct ShaderVariant {
+    int pointLights = -1; //Number of point lights, -1 reads the count from the Lights block
+    int directionLights = -1; //Number of directional lights, -1 reads the count from the Lights block
+    bool textured = true; //Sample tex0
+    bool specular = true; //Add the specular term
+    bool perVertex = false; //Light the vertices and interpolate (Gouraud) instead of lighting every pixel
+    bool depthOnly = false; //Position only, for the depth pre-pass, every other feature is ignored
+    bool instanced = false; //Transform, normal matrix and material come from the instance buffer
+    bool clustered = false; //Point lights come from the light clusters instead of the Lights block
+    bool gbuffer = false; //Write the surface into the G-buffer for deferred lighting, the lights are ignored
+    bool shadowed = false; //The directional light is shadowed by the shadow cascades, the point lights by their cube maps
+
+    //Pack the variant into a small key for quick lookups
+    uint32_t getKey() const {
+        if (this->depthOnly)
+            return (1u << 19) | ((uint32_t)this->instanced << 20);
+        if (this->gbuffer)
+            return ((uint32_t)this->textured << 16) | ((uint32_t)this->instanced << 20) | (1u << 22);
+        return (uint32_t)(this->pointLights + 1) |
+            ((uint32_t)(this->directionLights + 1) << 8) |
+            ((uint32_t)this->textured << 16) |
+            ((uint32_t)this->specular << 17) |
+            ((uint32_t)this->perVertex << 18) |
+            ((uint32_t)this->instanced << 20) |
+            ((uint32_t)this->clustered << 21) |
+            ((uint32_t)this->shadowed << 23);
+    }
+
+    //Defines that select this variant in the shaders
+    std::string getDefines() const {
+        std::string defines;
+        if (this->instanced)
+            defines += "#define INSTANCED\n";
+        if (this->depthOnly)
+            return defines + "#define DEPTH_ONLY\n";
+        if (this->gbuffer)
+            return defines + "#define GBUFFER\n" + (this->textured ? "#define TEXTURED\n" : "");
+
+        if (this->pointLights >= 0)
+            defines += "#define POINT_LIGHT_COUNT " + std::to_string(this->pointLights) + "\n";
+        if (this->directionLights >= 0)
+            defines += "#define DIRECTION_LIGHT_COUNT " + std::to_string(this->directionLights) + "\n";
+        if (this->textured)
+            defines += "#define TEXTURED\n";
+        if (this->specular)
+            defines += "#define SPECULAR\n";
+        if (this->perVertex)
+            defines += "#define PER_VERTEX_LIGHTING\n";
+        if (this->clustered)
+            defines += "#define CLUSTERED_LIGHTING\n";
+        if (this->shadowed)
+            defines += "#define SHADOWS\n";
+        return defines;
+    }
+};
+
+//GL format of a C++ vertex attribute type
+//Matrices take one location per column, integer types are read as ints with glVertexAttribIPointer
+//Other integer types are normalized so the shader reads them as floats in [0, 1] or [-1, 1]
+template <GLenum Type, GLint Components, GLboolean Normalized, GLint Columns = 1, bool Integer = false>
+struct VertexAttribFormat {
+    static constexpr GLenum type = Type;
+    static constexpr GLint components = Components; //Per column
+    static constexpr GLboolean normalized = Normalized;
+    static constexpr GLint columns = Columns;
+    static constexpr bool integer = Integer;
+};
+
+template <typename T> struct VertexAttribType;
+template <> struct VertexAttribType<float> : VertexAttribFormat<GL_FLOAT, 1, GL_FALSE> {};
+template <> struct VertexAttribType<glm::vec2> : VertexAttribFormat<GL_FLOAT, 2, GL_FALSE> {};
+template <> struct VertexAttribType<glm::vec3> : VertexAttribFormat<GL_FLOAT, 3, GL_FALSE> {};
+template <> struct VertexAttribType<glm::vec4> : VertexAttribFormat<GL_FLOAT, 4, GL_FALSE> {};
+template <> struct VertexAttribType<glm::mat3> : VertexAttribFormat<GL_FLOAT, 3, GL_FALSE, 3> {};
+template <> struct VertexAttribType<glm::mat4> : VertexAttribFormat<GL_FLOAT, 4, GL_FALSE, 4> {};
+template <> struct VertexAttribType<glm::u8vec4> : VertexAttribFormat<GL_UNSIGNED_BYTE, 4, GL_TRUE> {};
+template <> struct VertexAttribType<glm::i16vec2> : VertexAttribFormat<GL_SHORT, 2, GL_TRUE> {};
+template <> struct VertexAttribType<glm::i16vec4> : VertexAttribFormat<GL_SHORT, 4, GL_TRUE> {};
+template <> struct VertexAttribType<GLint> : VertexAttribFormat<GL_INT, 1, GL_FALSE, 1, true> {};
+
+//One attribute of a vertex struct at a shader location
+template <GLuint Location, typename T, size_t Offset>
+struct VertexAttrib {
+    typedef T Type;
+    typedef VertexAttribType<T> Format;
+    static constexpr GLuint location = Location;
+    static constexpr size_t offset = Offset;
+
+    //Point the attribute at its field in the bound GL_ARRAY_BUFFER
+    //A divisor of 1 advances the attribute once per instance instead of once per vertex
+    static void setup(GLsizei stride, GLuint divisor) {
+        const size_t columnSize = sizeof(T) / Format::columns;
+
+        for (GLint column = 0; column < Format::columns; column++) {
+            GLuint columnLocation = Location + column;
+            void* pointer = (void*)(Offset + column * columnSize);
+
+            if (Format::integer)
+                glVertexAttribIPointer(columnLocation, Format::components, Format::type, stride, pointer);
+            else
+                glVertexAttribPointer(columnLocation, Format::components, Format::type, Format::normalized, stride, pointer);
+            glEnableVertexAttribArray(columnLocation);
+            glVertexAttribDivisor(columnLocation, divisor);
+        }
+    }
+};
+
+//Describe a field of a vertex struct as the attribute at a location
+#define VERTEX_ATTRIB(Vertex, field, location) VertexAttrib<location, decltype(Vertex::field), offsetof(Vertex, field)>
+
+//Compile time helpers for the layout checks
+constexpr bool allTrue(std::initializer_list<bool> values) {
+    for (bool value : values)
+        if (!value)
+            return false;
+    return true;
+}
+//Ranges of locations [first, first + count) that don't overlap
+constexpr bool disjointRanges(std::initializer_list<GLuint> firsts, std::initializer_list<GLint> counts) {
+    for (size_t a = 0; a < firsts.size(); a++)
+        for (size_t b = a + 1; b < firsts.size(); b++)
+            if (firsts.begin()[a] < firsts.begin()[b] + counts.begin()[b] &&
+                firsts.begin()[b] < firsts.begin()[a] + counts.begin()[a])
+                return false;
+    return true;
+}
+
+//Shape of a vertex input, on the C++ side or as the shader declares it
+struct AttribShape {
+    GLint components; //Per column
+    GLint columns;
+    bool integer;
+
+    bool operator==(const AttribShape& other) const {
+        return this->components == other.components && this->columns == other.columns && this->integer == other.integer;
+    }
+};
+
+//Shape of a GLSL attribute type, no components for types the renderer never feeds
+inline AttribShape glslAttribShape(GLenum type) {
+    switch (type) {
+    case GL_FLOAT: return { 1, 1, false };
+    case GL_FLOAT_VEC2: return { 2, 1, false };
+    case GL_FLOAT_VEC3: return { 3, 1, false };
+    case GL_FLOAT_VEC4: return { 4, 1, false };
+    case GL_FLOAT_MAT3: return { 3, 3, false };
+    case GL_FLOAT_MAT4: return { 4, 4, false };
+    case GL_INT: return { 1, 1, true };
+    case GL_INT_VEC2: return { 2, 1, true };
+    case GL_INT_VEC3: return { 3, 1, true };
+    case GL_INT_VEC4: return { 4, 1, true };
+    default: return { 0, 0, false };
+    }
+}
+
+//Vertex struct and its attributes, everything about the layout is known at compile time
+template <typename Vertex, typename... Attribs>
+struct VertexLayout {
+    static_assert(sizeof...(Attribs) > 0, "A vertex layout needs at least one attribute");
+    static_assert(allTrue({ (Attribs::offset + sizeof(typename Attribs::Type) <= sizeof(Vertex))... }),
+        "Vertex attribute outside of the vertex struct");
+    static_assert(allTrue({ (Attribs::offset % alignof(typename Attribs::Type) == 0)... }),
+        "Vertex attribute is misaligned");
+    static_assert(disjointRanges({ Attribs::location... }, { Attribs::Format::columns... }),
+        "Two vertex attributes share a location");
+
+    static constexpr GLsizei stride = sizeof(Vertex);
+
+    //Set up every attribute of the bound VAO from the bound GL_ARRAY_BUFFER
+    static void setup(GLuint divisor = 0) {
+        int expand[] = { 0, (Attribs::setup(stride, divisor), 0)... };
+        (void)expand;
+    }
+
+    //Shape of the attribute starting at a location, returns false when the layout has none there
+    static bool shapeAt(GLuint location, AttribShape& shape) {
+        bool found = false;
+        int expand[] = { 0, (Attribs::location == location ?
+            (shape = { Attribs::Format::components, Attribs::Format::columns, Attribs::Format::integer }, found = true, 0) : 0)... };
+        (void)expand;
+        return found;
+    }
+};
+
+//Find an attribute location in any of the layouts a draw uses
+template <typename... Layouts>
+bool vertexInputShape(GLuint location, AttribShape& shape) {
+    bool found = false;
+    int expand[] = { 0, (found = found || Layouts::shapeAt(location, shape), 0)... };
+    (void)expand;
+    return found;
+}
+
+//Check that every attribute the program reads is provided by the layouts with the right shape
+template <typename... Layouts>
+bool validateVertexInputs(GLuint program, const std::string& label) {
+    GLint count = 0, maxLength = 0;
+    glGetProgramiv(program, GL_ACTIVE_ATTRIBUTES, &count);
+    glGetProgramiv(program, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+
+    bool valid = true;
+    std::string name(maxLength > 0 ? maxLength : 1, '\0');
+    for (GLint i = 0; i < count; i++) {
+        GLsizei length = 0;
+        GLint size = 0;
+        GLenum type = GL_NONE;
+        glGetActiveAttrib(program, i, maxLength, &length, &size, &type, &name[0]);
+        std::string attribName = name.substr(0, length);
+
+        //Built in inputs like gl_VertexID don't come from the buffer
+        if (attribName.compare(0, 3, "gl_") == 0)
+            continue;
+
+        GLint location = glGetAttribLocation(program, attribName.c_str());
+        AttribShape provided = { 0, 0, false };
+        AttribShape expected = glslAttribShape(type);
+
+        if (location < 0 || !vertexInputShape<Layouts...>((GLuint)location, provided)) {
+            std::cout << label << ": attribute " << attribName << " at location " << location
+                << " is not in the vertex layout" << std::endl;
+            valid = false;
+        }
+        else if (!(provided == expected)) {
+            std::cout << label << ": attribute " << attribName << " at location " << location
+                << " reads " << expected.columns << "x" << expected.components << (expected.integer ? " int" : " float")
+                << " but the vertex layout gives " << provided.columns << "x" << provided.components
+                << (provided.integer ? " int" : " float") << std::endl;
+            valid = false;
+        }
+    }
+    return valid;
+}
+
+//Vertex of the OBJ meshes
+struct MeshVertex {
+    glm::vec3 position;
+    glm::vec3 normal;
+    glm::vec2 uv;
+};
+
+//Attribute locations match Sample.vert
+typedef VertexLayout<MeshVertex,
+    VERTEX_ATTRIB(MeshVertex, position, 0),
+    VERTEX_ATTRIB(MeshVertex, normal, 1),
+    VERTEX_ATTRIB(MeshVertex, uv, 2)> MeshVertexLayout;
+
+//Per instance data of an instanced draw
+struct InstanceData {
+    glm::mat4 transform;
+    glm::mat3 normalMatrix; //Inverse transpose of the transform
+    GLint materialIndex; //Slot in the Materials block
+};
+
+//Instance attribute locations match the INSTANCED inputs of Sample.vert
+typedef VertexLayout<InstanceData,
+    VERTEX_ATTRIB(InstanceData, transform, 3),
+    VERTEX_ATTRIB(InstanceData, normalMatrix, 7),
+    VERTEX_ATTRIB(InstanceData, materialIndex, 10)> InstanceLayout;
+
+//Vertex of the light volume sphere
+struct VolumeVertex {
+    glm::vec3 position;
+};
+
+//Attribute locations match the LIGHT_VOLUME inputs of Deferred.vert
+//Each instance is a point light, attenuation.w holds its range
+typedef VertexLayout<VolumeVertex,
+    VERTEX_ATTRIB(VolumeVertex, position, 0)> VolumeVertexLayout;
+typedef VertexLayout<PointLightData,
+    VERTEX_ATTRIB(PointLightData, position, 1),
+    VERTEX_ATTRIB(PointLightData, color, 2),
+    VERTEX_ATTRIB(PointLightData, ambientColor, 3),
+    VERTEX_ATTRIB(PointLightData, attenuation, 4)> LightVolumeLayout;
+
+//Inverse transpose of a transform's upper 3x3, used to transform normals
+//Rotation with uniform scale: the inverse transpose is the matrix divided by the squared scale
+inline glm::mat3 computeNormalMatrix(const glm::mat4& transform) {
+    glm::mat3 model = glm::mat3(transform);
+
+    float scale2 = glm::dot(model[0], model[0]);
+    const float epsilon = 1e-4f * scale2;
+    bool uniformScale = scale2 > 0.0f &&
+        std::abs(glm::dot(model[1], model[1]) - scale2) <= epsilon &&
+        std::abs(glm::dot(model[2], model[2]) - scale2) <= epsilon &&
+        std::abs(glm::dot(model[0], model[1])) <= epsilon &&
+        std::abs(glm::dot(model[0], model[2])) <= epsilon &&
+        std::abs(glm::dot(model[1], model[2])) <= epsilon;
+
+    if (uniformScale)
+        return model / scale2;
+    return glm::transpose(glm::inverse(model));
+}
+
+//World space bounds of an object: a box and the sphere around its center
+struct WorldBounds {
+    glm::vec3 center = glm::vec3(0.f);
+    glm::vec3 extent = glm::vec3(0.f); //Half size of the box
+    float radius = 0.f;
+};
+
+//Bounds of a model space box and sphere after a transform
+//The box stays axis aligned by growing to hold the rotated one
+inline WorldBounds transformBounds(const glm::mat4& transform, glm::vec3 center, glm::vec3 extent, float radius) {
+    glm::mat3 model = glm::mat3(transform);
+
+    WorldBounds bounds;
+    bounds.center = glm::vec3(transform * glm::vec4(center, 1.f));
+    bounds.extent = glm::abs(model[0]) * extent.x + glm::abs(model[1]) * extent.y + glm::abs(model[2]) * extent.z;
+    bounds.radius = radius * std::max(glm::length(model[0]), std::max(glm::length(model[1]), glm::length(model[2])));
+    return bounds;
+}
+
+//Result of testing a box against a frustum
+enum FrustumTest {
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_CROSSING, //Crosses at least one plane
+    FRUSTUM_INSIDE
+};
+
+//Tests the bounds of every object against the camera's frustum, 4 objects at a time
+//Bounds are kept as arrays of each component so a test loads 4 objects per register
+class FrustumCuller {
+//Fields for the culler
+private:
+    //Plane normals and distances, a point is inside when dot(normal, point) + distance >= 0
+    glm::vec4 planes[6];
+
+    //Bounds, padded to a multiple of 4 with empty bounds
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> extentX, extentY, extentZ;
+    std::vector<float> radius;
+    size_t count = 0;
+
+    //Result of the last perform() for each slot
+    std::vector<uint8_t> visible;
+    size_t visibleCount = 0;
+
+public:
+    //Start a frame with the planes of a view projection matrix
+    void begin(const glm::mat4& viewProjection) {
+        //Rows of the matrix, the planes are sums and differences of the last row with the others
+        glm::mat4 rows = glm::transpose(viewProjection);
+        this->planes[0] = rows[3] + rows[0]; //Left
+        this->planes[1] = rows[3] - rows[0]; //Right
+        this->planes[2] = rows[3] + rows[1]; //Bottom
+        this->planes[3] = rows[3] - rows[1]; //Top
+        this->planes[4] = rows[3] + rows[2]; //Near
+        this->planes[5] = rows[3] - rows[2]; //Far
+
+        for (glm::vec4& plane : this->planes)
+            plane /= glm::length(glm::vec3(plane));
+
+        this->count = 0;
+    }
+
+    //Where a box is relative to the frustum, for tree nodes tested one at a time
+    FrustumTest classify(glm::vec3 center, glm::vec3 extent) {
+        bool crossing = false;
+        for (const glm::vec4& plane : this->planes) {
+            float distance = glm::dot(glm::vec3(plane), center) + plane.w;
+            float reach = glm::dot(glm::abs(glm::vec3(plane)), extent);
+            if (distance < -reach)
+                return FRUSTUM_OUTSIDE;
+            crossing = crossing || distance < reach;
+        }
+        return crossing ? FRUSTUM_CROSSING : FRUSTUM_INSIDE;
+    }
+
+    //Add bounds to test, returns their slot
+    size_t add(const WorldBounds& bounds) {
+        size_t slot = this->count++;
+        if (this->centerX.size() < this->count) {
+            size_t padded = (this->count + 3) & ~(size_t)3;
+            for (std::vector<float>* component : { &this->centerX, &this->centerY, &this->centerZ,
+                &this->extentX, &this->extentY, &this->extentZ, &this->radius })
+                component->resize(padded, 0.f);
+        }
+
+        this->centerX[slot] = bounds.center.x;
+        this->centerY[slot] = bounds.center.y;
+        this->centerZ[slot] = bounds.center.z;
+        this->extentX[slot] = bounds.extent.x;
+        this->extentY[slot] = bounds.extent.y;
+        this->extentZ[slot] = bounds.extent.z;
+        this->radius[slot] = bounds.radius;
+        return slot;
+    }
+
+    //Test every slot against the six planes
+    //An object is outside when it is fully behind one plane, using the tighter of its box and sphere
+    void perform() {
+        size_t padded = (this->count + 3) & ~(size_t)3;
+        this->visible.resize(padded);
+
+#ifdef USE_SSE
+        for (size_t i = 0; i < padded; i += 4) {
+            __m128 cx = _mm_loadu_ps(&this->centerX[i]);
+            __m128 cy = _mm_loadu_ps(&this->centerY[i]);
+            __m128 cz = _mm_loadu_ps(&this->centerZ[i]);
+            __m128 ex = _mm_loadu_ps(&this->extentX[i]);
+            __m128 ey = _mm_loadu_ps(&this->extentY[i]);
+            __m128 ez = _mm_loadu_ps(&this->extentZ[i]);
+            __m128 r = _mm_loadu_ps(&this->radius[i]);
+
+            __m128 outside = _mm_setzero_ps();
+            for (const glm::vec4& plane : this->planes) {
+                __m128 distance = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(plane.x)), _mm_mul_ps(cy, _mm_set1_ps(plane.y))),
+                    _mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+                __m128 reach = _mm_add_ps(
+                    _mm_add_ps(_mm_mul_ps(ex, _mm_set1_ps(std::abs(plane.x))), _mm_mul_ps(ey, _mm_set1_ps(std::abs(plane.y)))),
+                    _mm_mul_ps(ez, _mm_set1_ps(std::abs(plane.z))));
+                reach = _mm_min_ps(reach, r);
+
+                //distance < -reach
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, reach), _mm_setzero_ps()));
+            }
+
+            int mask = _mm_movemask_ps(outside);
+            for (int lane = 0; lane < 4; lane++)
+                this->visible[i + lane] = !(mask & (1 << lane));
+        }
+#else
+        for (size_t i = 0; i < padded; i++) {
+            bool outside = false;
+            for (const glm::vec4& plane : this->planes) {
+                float distance = plane.x * this->centerX[i] + plane.y * this->centerY[i] + plane.z * this->centerZ[i] + plane.w;
+                float reach = std::abs(plane.x) * this->extentX[i] + std::abs(plane.y) * this->extentY[i] +
+                    std::abs(plane.z) * this->extentZ[i];
+                reach = std::min(reach, this->radius[i]);
+                outside = outside || distance + reach < 0.f;
+            }
+            this->visible[i] = !outside;
+        }
+#endif
+
+        this->visibleCount = 0;
+        for (size_t i = 0; i < this->count; i++)
+            this->visibleCount += this->visible[i];
+    }
+
+    //Result of the last perform()
+    bool isVisible(size_t slot) {
+        return this->visible[slot] != 0;
+    }
+
+    size_t getCount() {
+        return this->count;
+    }
+    size_t getVisibleCount() {
+        return this->visibleCount;
+    }
+};
+
+//Size of the CPU depth buffer occluders are drawn into, the width is a multiple of 4 for the SSE rows
+const int OCCLUSION_WIDTH = 128;
+const int OCCLUSION_HEIGHT = 128;
+
+//Worker threads splitting a job into bands, the calling thread runs band 0 itself
+//perform() wakes the workers by bumping the frame number and returns once every band is done
+class BandWorkers {
+//Fields for the workers
+private:
+    //Runs one band out of the total
+    std::function<void(int, int)> job;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    unsigned int workFrame = 0;
+    int busyWorkers = 0;
+    bool running = false;
+
+public:
+    //Destructor
+    ~BandWorkers() {
+        this->stop();
+    }
+
+public:
+    //Start up to 3 workers, with the calling thread the job gets at most 4 bands
+    void create(std::function<void(int, int)> job) {
+        this->job = job;
+
+        unsigned int cores = std::thread::hardware_concurrency();
+        int count = (int)std::min(std::max(cores, 1u), 4u) - 1;
+
+        this->running = true;
+        for (int i = 0; i < count; i++)
+            this->workers.push_back(std::thread(&BandWorkers::run, this, i + 1, count + 1));
+    }
+
+    //Join the workers
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (!this->running)
+                return;
+            this->running = false;
+        }
+        this->wake.notify_all();
+        for (std::thread& worker : this->workers)
+            worker.join();
+        this->workers.clear();
+    }
+
+    //Run every band of the job and wait for them
+    void perform() {
+        int bands = (int)this->workers.size() + 1;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->workFrame++;
+            this->busyWorkers = (int)this->workers.size();
+        }
+        this->wake.notify_all();
+
+        this->job(0, bands);
+
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->done.wait(lock, [this] { return this->busyWorkers == 0; });
+        }
+    }
+
+private:
+    //Worker body, runs its band each time a frame starts
+    void run(int band, int bands) {
+        unsigned int seenFrame = 0;
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true) {
+            this->wake.wait(lock, [&] { return !this->running || this->workFrame != seenFrame; });
+            if (!this->running)
+                return;
+            seenFrame = this->workFrame;
+
+            lock.unlock();
+            this->job(band, bands);
+            lock.lock();
+
+            if (--this->busyWorkers == 0)
+                this->done.notify_one();
+        }
+    }
+};
+
+//Result of testing a box against the occluders
+enum OcclusionTest {
+    OCCLUSION_HIDDEN, //Behind the occluders everywhere it covers
+    OCCLUSION_PARTIAL,
+    OCCLUSION_CLEAR //In front of every occluder it covers
+};
+
+//Draws a few chosen occluders into a small depth buffer on the CPU and tests bounds against it
+//Rows of the buffer are split between worker threads, the depth hierarchy keeps the nearest and farthest depth of each texel block
+class OcclusionCuller {
+//Fields for the culler
+private:
+    //Occluder mesh and its transform for this frame
+    struct Occluder {
+        const std::vector<glm::vec3>* positions;
+        const std::vector<GLuint>* indices;
+        glm::mat4 transform;
+    };
+
+    //Triangle ready to rasterize: edge functions, depth plane and pixel bounds
+    struct Triangle {
+        float edgeA[3], edgeB[3], edgeC[3]; //Inside where edgeA * x + edgeB * y + edgeC >= 0 for every edge
+        float depthA, depthB, depthC; //Depth at a pixel is depthA * x + depthB * y + depthC
+        int minX, minY, maxX, maxY;
+    };
+
+    //One level of the hierarchy, level 0 is the depth buffer
+    struct Level {
+        int width, height;
+        std::vector<float> nearest, farthest;
+    };
+
+    glm::mat4 viewProjection;
+    std::vector<Occluder> occluders;
+    std::vector<Triangle> triangles;
+    std::vector<glm::vec4> clipScratch;
+    std::vector<Level> levels;
+
+    //Workers rasterize their band of rows each frame
+    BandWorkers workers;
+
+public:
+    //Constructor & Destructor
+    OcclusionCuller() {
+        this->levels.resize(1);
+        this->levels[0].width = OCCLUSION_WIDTH;
+        this->levels[0].height = OCCLUSION_HEIGHT;
+        this->levels[0].nearest.assign(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 1.f);
+        this->levels[0].farthest.assign(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 1.f);
+
+        //Each level halves the one below until a single texel is left
+        while (this->levels.back().width > 1 || this->levels.back().height > 1) {
+            Level level;
+            level.width = std::max(1, (this->levels.back().width + 1) / 2);
+            level.height = std::max(1, (this->levels.back().height + 1) / 2);
+            level.nearest.assign(level.width * level.height, 1.f);
+            level.farthest.assign(level.width * level.height, 1.f);
+            this->levels.push_back(level);
+        }
+    }
+    ~OcclusionCuller() {
+        this->stop();
+    }
+
+public:
+    //Start the worker threads, the calling thread rasterizes a band too
+    void create() {
+        this->workers.create([this](int band, int bands) { this->rasterizeBand(band, bands); });
+    }
+
+    //Join the workers
+    void stop() {
+        this->workers.stop();
+    }
+
+    //Start a frame seen through a view projection matrix
+    void begin(const glm::mat4& viewProjection) {
+        this->viewProjection = viewProjection;
+        this->occluders.clear();
+    }
+
+    //Draw a mesh into this frame's depth buffer, the mesh must stay alive until perform()
+    void addOccluder(const std::vector<glm::vec3>& positions, const std::vector<GLuint>& indices, const glm::mat4& transform) {
+        this->occluders.push_back({ &positions, &indices, transform });
+    }
+
+    //Rasterize the occluders and build the depth hierarchy
+    void perform() {
+        this->setupTriangles();
+        this->workers.perform();
+        this->buildHierarchy();
+    }
+
+    //Compare a world space box with the occluders behind it
+    OcclusionTest test(glm::vec3 center, glm::vec3 extent) {
+        glm::vec3 screenMin = glm::vec3(FLT_MAX), screenMax = glm::vec3(-FLT_MAX);
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec3 offset = glm::vec3(corner & 1 ? 1.f : -1.f, corner & 2 ? 1.f : -1.f, corner & 4 ? 1.f : -1.f);
+            glm::vec4 clip = this->viewProjection * glm::vec4(center + offset * extent, 1.f);
+
+            //Crosses the camera plane, can't be projected
+            if (clip.w <= 1e-4f)
+                return OCCLUSION_PARTIAL;
+            glm::vec3 screen = this->toScreen(clip);
+            screenMin = glm::min(screenMin, screen);
+            screenMax = glm::max(screenMax, screen);
+        }
+
+        //Texels the box covers, boxes off the buffer are left to the frustum test
+        int x0 = std::max((int)std::floor(screenMin.x), 0);
+        int y0 = std::max((int)std::floor(screenMin.y), 0);
+        int x1 = std::min((int)std::floor(screenMax.x), OCCLUSION_WIDTH - 1);
+        int y1 = std::min((int)std::floor(screenMax.y), OCCLUSION_HEIGHT - 1);
+        if (x0 > x1 || y0 > y1)
+            return OCCLUSION_PARTIAL;
+
+        //Level where the box covers at most 2x2 texels
+        int level = 0;
+        while ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1)
+            level++;
+
+        const Level& texels = this->levels[level];
+        float nearest = 1.f, farthest = 0.f;
+        for (int y = y0 >> level; y <= (y1 >> level); y++) {
+            for (int x = x0 >> level; x <= (x1 >> level); x++) {
+                nearest = std::min(nearest, texels.nearest[y * texels.width + x]);
+                farthest = std::max(farthest, texels.farthest[y * texels.width + x]);
+            }
+        }
+
+        if (screenMin.z > farthest)
+            return OCCLUSION_HIDDEN;
+        if (screenMax.z < nearest)
+            return OCCLUSION_CLEAR;
+        return OCCLUSION_PARTIAL;
+    }
+
+    size_t getTriangleCount() {
+        return this->triangles.size();
+    }
+
+private:
+    //Clip space to depth buffer pixels, depth in [0, 1]
+    glm::vec3 toScreen(const glm::vec4& clip) {
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        return glm::vec3((ndc.x * 0.5f + 0.5f) * OCCLUSION_WIDTH, (ndc.y * 0.5f + 0.5f) * OCCLUSION_HEIGHT, ndc.z * 0.5f + 0.5f);
+    }
+
+    //Transform the occluders and set up the triangles facing any way
+    //Triangles crossing the near plane are dropped, an occluder may hide less than it covers but never more
+    void setupTriangles() {
+        this->triangles.clear();
+        for (const Occluder& occluder : this->occluders) {
+            glm::mat4 transform = this->viewProjection * occluder.transform;
+
+            this->clipScratch.resize(occluder.positions->size());
+            for (size_t i = 0; i < occluder.positions->size(); i++)
+                this->clipScratch[i] = transform * glm::vec4((*occluder.positions)[i], 1.f);
+
+            const std::vector<GLuint>& indices = *occluder.indices;
+            for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+                const glm::vec4& c0 = this->clipScratch[indices[i]];
+                const glm::vec4& c1 = this->clipScratch[indices[i + 1]];
+                const glm::vec4& c2 = this->clipScratch[indices[i + 2]];
+                if (c0.w <= 1e-4f || c1.w <= 1e-4f || c2.w <= 1e-4f)
+                    continue;
+
+                glm::vec3 v[3] = { this->toScreen(c0), this->toScreen(c1), this->toScreen(c2) };
+
+                //In front of the near plane, the GPU clips it away
+                if (v[0].z < 0.f || v[1].z < 0.f || v[2].z < 0.f)
+                    continue;
+
+                float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+                if (std::abs(area) < 1e-8f)
+                    continue;
+
+                Triangle triangle;
+                triangle.minX = std::max((int)std::floor(std::min(v[0].x, std::min(v[1].x, v[2].x))), 0);
+                triangle.minY = std::max((int)std::floor(std::min(v[0].y, std::min(v[1].y, v[2].y))), 0);
+                triangle.maxX = std::min((int)std::ceil(std::max(v[0].x, std::max(v[1].x, v[2].x))), OCCLUSION_WIDTH - 1);
+                triangle.maxY = std::min((int)std::ceil(std::max(v[0].y, std::max(v[1].y, v[2].y))), OCCLUSION_HEIGHT - 1);
+                if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+                    continue;
+
+                //Edges oriented so the inside is positive whichever way the triangle faces
+                float sign = area > 0.f ? 1.f : -1.f;
+                for (int edge = 0; edge < 3; edge++) {
+                    const glm::vec3& a = v[(edge + 1) % 3];
+                    const glm::vec3& b = v[(edge + 2) % 3];
+                    triangle.edgeA[edge] = (a.y - b.y) * sign;
+                    triangle.edgeB[edge] = (b.x - a.x) * sign;
+                    triangle.edgeC[edge] = (a.x * b.y - a.y * b.x) * sign;
+                }
+
+                //Depth plane through the three vertices
+                float inverseArea = 1.f / area;
+                float dz1 = v[1].z - v[0].z, dz2 = v[2].z - v[0].z;
+                triangle.depthA = (dz1 * (v[2].y - v[0].y) - dz2 * (v[1].y - v[0].y)) * inverseArea;
+                triangle.depthB = (dz2 * (v[1].x - v[0].x) - dz1 * (v[2].x - v[0].x)) * inverseArea;
+                triangle.depthC = v[0].z - triangle.depthA * v[0].x - triangle.depthB * v[0].y;
+
+                this->triangles.push_back(triangle);
+            }
+        }
+    }
+
+    //Clear and rasterize the rows of one band, sampling pixel centers 4 at a time
+    void rasterizeBand(int band, int bands) {
+        int rowBegin = OCCLUSION_HEIGHT * band / bands;
+        int rowEnd = OCCLUSION_HEIGHT * (band + 1) / bands;
+        float* depth = this->levels[0].nearest.data();
+
+        std::fill(depth + rowBegin * OCCLUSION_WIDTH, depth + rowEnd * OCCLUSION_WIDTH, 1.f);
+
+        for (const Triangle& triangle : this->triangles) {
+            int y0 = std::max(triangle.minY, rowBegin);
+            int y1 = std::min(triangle.maxY, rowEnd - 1);
+            int x0 = triangle.minX & ~3;
+
+            for (int y = y0; y <= y1; y++) {
+                float centerY = y + 0.5f;
+                float* row = depth + y * OCCLUSION_WIDTH;
+
+#ifdef USE_SSE
+                __m128 zero = _mm_setzero_ps();
+                __m128 laneOffsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+                for (int x = x0; x <= triangle.maxX; x += 4) {
+                    __m128 centerX = _mm_add_ps(_mm_set1_ps((float)x), laneOffsets);
+
+                    __m128 inside = _mm_cmpge_ps(zero, zero);
+                    for (int edge = 0; edge < 3; edge++) {
+                        __m128 value = _mm_add_ps(_mm_mul_ps(centerX, _mm_set1_ps(triangle.edgeA[edge])),
+                            _mm_set1_ps(triangle.edgeB[edge] * centerY + triangle.edgeC[edge]));
+                        inside = _mm_and_ps(inside, _mm_cmpge_ps(value, zero));
+                    }
+                    if (_mm_movemask_ps(inside) == 0)
+                        continue;
+
+                    __m128 z = _mm_add_ps(_mm_mul_ps(centerX, _mm_set1_ps(triangle.depthA)),
+                        _mm_set1_ps(triangle.depthB * centerY + triangle.depthC));
+                    __m128 old = _mm_loadu_ps(row + x);
+                    __m128 nearer = _mm_min_ps(old, z);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+                }
+#else
+                for (int x = x0; x <= triangle.maxX; x++) {
+                    float centerX = x + 0.5f;
+                    bool inside = true;
+                    for (int edge = 0; edge < 3; edge++)
+                        inside = inside && triangle.edgeA[edge] * centerX + triangle.edgeB[edge] * centerY + triangle.edgeC[edge] >= 0.f;
+                    if (inside)
+                        row[x] = std::min(row[x], triangle.depthA * centerX + triangle.depthB * centerY + triangle.depthC);
+                }
+#endif
+            }
+        }
+    }
+
+    //Nearest and farthest depth of each block of texels, level by level
+    void buildHierarchy() {
+        Level& base = this->levels[0];
+        base.farthest = base.nearest;
+
+        for (size_t index = 1; index < this->levels.size(); index++) {
+            const Level& below = this->levels[index - 1];
+            Level& level = this->levels[index];
+            for (int y = 0; y < level.height; y++) {
+                for (int x = 0; x < level.width; x++) {
+                    float nearest = 1.f, farthest = 0.f;
+                    for (int dy = 0; dy < 2; dy++) {
+                        for (int dx = 0; dx < 2; dx++) {
+                            int sx = std::min(x * 2 + dx, below.width - 1);
+                            int sy = std::min(y * 2 + dy, below.height - 1);
+                            nearest = std::min(nearest, below.nearest[sy * below.width + sx]);
+                            farthest = std::max(farthest, below.farthest[sy * below.width + sx]);
+                        }
+                    }
+                    level.nearest[y * level.width + x] = nearest;
+                    level.farthest[y * level.width + x] = farthest;
+                }
+            }
+        }
+    }
+};
+
+//Forward Declare Model
+class Model3D;
+
+//Bins the SAH build sorts the objects of a node into
+const int TREE_SAH_BINS = 12;
+
+//A refit node whose surface area grew past this many times its area when built gets its subtree rebuilt
+const float TREE_REBUILD_GROWTH = 2.f;
+
+//Surface area of a box, the SAH cost of visiting it
+inline float boxArea(glm::vec3 min, glm::vec3 max) {
+    glm::vec3 size = glm::max(max - min, glm::vec3(0.f));
+    return 2.f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+//Bounding volume hierarchy over every model and instance of the scene, built with the surface area heuristic
+//Moved objects refit the boxes on their path to the root, subtrees that grew too loose are rebuilt
+class SceneTree {
+public:
+    //Object in the tree, a model or one of its instances
+    struct Leaf {
+        Model3D* model;
+        size_t instance;
+        WorldBounds bounds;
+        int node = -1;
+        bool dirty = false;
+        bool alive = true;
+    };
+
+//Fields for the tree
+private:
+    //Inner nodes have two children, leaf nodes hold one object
+    struct Node {
+        glm::vec3 min, max;
+        int parent = -1;
+        int left = -1, right = -1;
+        int leaf = -1;
+        float builtArea = 0.f; //Surface area when the node was built
+    };
+
+    std::vector<Node> nodes;
+    int root = -1;
+
+    std::vector<Leaf> leaves;
+    std::vector<int> freeLeaves;
+
+    //Leaves moved since the last update()
+    std::vector<int> dirtyLeaves;
+
+    //Objects were added or removed, the whole tree is built again
+    bool needsBuild = false;
+
+    //Frame of the last frustum query, objects marked visible in it are drawn
+    unsigned int frame = 0;
+    size_t visibleCount = 0;
+
+    //Node to visit during culling and the tests its parents already passed for it
+    struct Visit {
+        int node;
+        bool inFrustum;
+        bool unoccluded;
+    };
+
+    //Reused between calls
+    std::vector<int> stack;
+    std::vector<Visit> traversal;
+    std::vector<int> candidates;
+
+public:
+    //Add a model or one of its instances, the tree is rebuilt on the next update()
+    int insert(Model3D* model, size_t instance) {
+        int index;
+        if (!this->freeLeaves.empty()) {
+            index = this->freeLeaves.back();
+            this->freeLeaves.pop_back();
+        }
+        else {
+            index = (int)this->leaves.size();
+            this->leaves.push_back(Leaf());
+        }
+
+        Leaf& leaf = this->leaves[index];
+        leaf = Leaf();
+        leaf.model = model;
+        leaf.instance = instance;
+        this->fetchBounds(leaf);
+
+        this->needsBuild = true;
+        return index;
+    }
+
+    //Take an object out of the tree, the tree is rebuilt on the next update()
+    void remove(int leaf) {
+        this->leaves[leaf].alive = false;
+        this->freeLeaves.push_back(leaf);
+        this->needsBuild = true;
+    }
+
+    //The object's transform changed, its bounds are read again on the next update()
+    void markDirty(int leaf) {
+        if (this->leaves[leaf].dirty)
+            return;
+        this->leaves[leaf].dirty = true;
+        this->dirtyLeaves.push_back(leaf);
+    }
+
+    //Refit the moved objects, rebuilding the tree or its degraded subtrees when needed
+    void update() {
+        for (int index : this->dirtyLeaves) {
+            Leaf& leaf = this->leaves[index];
+            leaf.dirty = false;
+            if (leaf.alive)
+                this->fetchBounds(leaf);
+        }
+
+        if (this->needsBuild) {
+            this->dirtyLeaves.clear();
+            this->build();
+            return;
+        }
+
+        //Walk up from every moved object, the topmost node that grew too much is rebuilt
+        std::vector<int> degraded;
+        for (int index : this->dirtyLeaves) {
+            const Leaf& leaf = this->leaves[index];
+            if (!leaf.alive || leaf.node < 0)
+                continue;
+
+            Node& node = this->nodes[leaf.node];
+            node.min = leaf.bounds.center - leaf.bounds.extent;
+            node.max = leaf.bounds.center + leaf.bounds.extent;
+
+            int worst = -1;
+            for (int parent = node.parent; parent != -1; parent = this->nodes[parent].parent) {
+                Node& inner = this->nodes[parent];
+                glm::vec3 min = glm::min(this->nodes[inner.left].min, this->nodes[inner.right].min);
+                glm::vec3 max = glm::max(this->nodes[inner.left].max, this->nodes[inner.right].max);
+
+                //Boxes above only change when this one did
+                if (min == inner.min && max == inner.max)
+                    break;
+                inner.min = min;
+                inner.max = max;
+
+                if (boxArea(min, max) > inner.builtArea * TREE_REBUILD_GROWTH)
+                    worst = parent;
+            }
+            if (worst != -1)
+                degraded.push_back(worst);
+        }
+        this->dirtyLeaves.clear();
+
+        //Rebuild each degraded subtree once, skipping the ones inside another degraded subtree
+        std::sort(degraded.begin(), degraded.end());
+        degraded.erase(std::unique(degraded.begin(), degraded.end()), degraded.end());
+
+        std::vector<int> rebuilt;
+        for (int node : degraded) {
+            bool nested = false;
+            for (int other : degraded)
+                if (other != node && this->isAncestor(other, node))
+                    nested = true;
+            if (!nested)
+                rebuilt.push_back(node);
+        }
+        for (int node : rebuilt)
+            this->rebuildSubtree(node);
+    }
+
+    //Mark the objects inside a frustum, and not hidden by the occluders, visible for this frame
+    //Nodes fully inside the frustum skip the plane tests below them, nodes in front of every occluder skip the occlusion tests
+    //The objects of nodes crossing a plane are tested together by the frustum culler
+    void cullFrustum(FrustumCuller& culler, OcclusionCuller* occlusion = NULL) {
+        this->frame++;
+        this->visibleCount = 0;
+        if (this->root == -1)
+            return;
+
+        this->candidates.clear();
+        this->traversal.clear();
+        this->traversal.push_back({ this->root, false, occlusion == NULL });
+        while (!this->traversal.empty()) {
+            Visit visit = this->traversal.back();
+            this->traversal.pop_back();
+            const Node& node = this->nodes[visit.node];
+            glm::vec3 center = (node.min + node.max) * 0.5f;
+            glm::vec3 extent = (node.max - node.min) * 0.5f;
+
+            if (!visit.inFrustum) {
+                FrustumTest test = culler.classify(center, extent);
+                if (test == FRUSTUM_OUTSIDE)
+                    continue;
+                visit.inFrustum = test == FRUSTUM_INSIDE;
+            }
+            if (!visit.unoccluded) {
+                OcclusionTest test = occlusion->test(center, extent);
+                if (test == OCCLUSION_HIDDEN)
+                    continue;
+                visit.unoccluded = test == OCCLUSION_CLEAR;
+            }
+
+            if (visit.inFrustum && visit.unoccluded) {
+                this->markSubtreeVisible(visit.node);
+                continue;
+            }
+
+            //Leaves reached here aren't hidden, only the plane test is left
+            if (node.leaf != -1) {
+                if (visit.inFrustum)
+                    this->markVisible(node.leaf);
+                else {
+                    culler.add(this->leaves[node.leaf].bounds);
+                    this->candidates.push_back(node.leaf);
+                }
+                continue;
+            }
+            this->traversal.push_back({ node.left, visit.inFrustum, visit.unoccluded });
+            this->traversal.push_back({ node.right, visit.inFrustum, visit.unoccluded });
+        }
+
+        culler.perform();
+        for (size_t i = 0; i < this->candidates.size(); i++)
+            if (culler.isVisible(i))
+                this->markVisible(this->candidates[i]);
+    }
+
+    //Objects inside a frustum, for passes seen from another point of view
+    //Same walk as cullFrustum() without occlusion, nothing is marked visible
+    void queryFrustum(FrustumCuller& culler, std::vector<int>& found) {
+        found.clear();
+        if (this->root == -1)
+            return;
+
+        this->candidates.clear();
+        this->traversal.clear();
+        this->traversal.push_back({ this->root, false, true });
+        while (!this->traversal.empty()) {
+            Visit visit = this->traversal.back();
+            this->traversal.pop_back();
+            const Node& node = this->nodes[visit.node];
+
+            if (!visit.inFrustum) {
+                FrustumTest test = culler.classify((node.min + node.max) * 0.5f, (node.max - node.min) * 0.5f);
+                if (test == FRUSTUM_OUTSIDE)
+                    continue;
+                visit.inFrustum = test == FRUSTUM_INSIDE;
+            }
+
+            if (visit.inFrustum) {
+                this->collectSubtree(visit.node, found);
+                continue;
+            }
+            if (node.leaf != -1) {
+                culler.add(this->leaves[node.leaf].bounds);
+                this->candidates.push_back(node.leaf);
+                continue;
+            }
+            this->traversal.push_back({ node.left, false, true });
+            this->traversal.push_back({ node.right, false, true });
+        }
+
+        culler.perform();
+        for (size_t i = 0; i < this->candidates.size(); i++)
+            if (culler.isVisible(i))
+                found.push_back(this->candidates[i]);
+    }
+
+    //Objects whose box touches a sphere
+    void querySphere(glm::vec3 center, float radius, std::vector<int>& found) {
+        found.clear();
+        if (this->root == -1)
+            return;
+
+        this->stack.clear();
+        this->stack.push_back(this->root);
+        while (!this->stack.empty()) {
+            const Node& node = this->nodes[this->stack.back()];
+            this->stack.pop_back();
+
+            //Closest point of the box to the center
+            glm::vec3 closest = glm::clamp(center, node.min, node.max);
+            if (glm::dot(closest - center, closest - center) > radius * radius)
+                continue;
+
+            if (node.leaf != -1)
+                found.push_back(node.leaf);
+            else {
+                this->stack.push_back(node.left);
+                this->stack.push_back(node.right);
+            }
+        }
+    }
+
+    //Closest object whose box a ray hits within a distance, returns false when there is none
+    //Children are visited nearest first and boxes further than the best hit are skipped
+    bool raycast(glm::vec3 origin, glm::vec3 direction, float maxDistance, int& hitLeaf, float& hitDistance) {
+        hitLeaf = -1;
+        hitDistance = maxDistance;
+        if (this->root == -1)
+            return false;
+
+        glm::vec3 inverse = 1.f / direction;
+        float entry;
+        if (!this->rayBox(this->nodes[this->root], origin, inverse, hitDistance, entry))
+            return false;
+
+        this->stack.clear();
+        this->stack.push_back(this->root);
+        while (!this->stack.empty()) {
+            const Node& node = this->nodes[this->stack.back()];
+            this->stack.pop_back();
+
+            if (!this->rayBox(node, origin, inverse, hitDistance, entry))
+                continue;
+
+            if (node.leaf != -1) {
+                hitLeaf = node.leaf;
+                hitDistance = entry;
+                continue;
+            }
+
+            float leftEntry, rightEntry;
+            bool hitLeft = this->rayBox(this->nodes[node.left], origin, inverse, hitDistance, leftEntry);
+            bool hitRight = this->rayBox(this->nodes[node.right], origin, inverse, hitDistance, rightEntry);
+
+            //The nearer child goes on top of the stack
+            if (hitLeft && hitRight) {
+                bool leftFirst = leftEntry <= rightEntry;
+                this->stack.push_back(leftFirst ? node.right : node.left);
+                this->stack.push_back(leftFirst ? node.left : node.right);
+            }
+            else if (hitLeft)
+                this->stack.push_back(node.left);
+            else if (hitRight)
+                this->stack.push_back(node.right);
+        }
+        return hitLeaf != -1;
+    }
+
+    //Getters
+    const Leaf& getLeaf(int leaf) {
+        return this->leaves[leaf];
+    }
+    unsigned int getFrame() {
+        return this->frame;
+    }
+    size_t getLeafCount() {
+        return this->leaves.size() - this->freeLeaves.size();
+    }
+    size_t getVisibleCount() {
+        return this->visibleCount;
+    }
+
+private:
+    //Read the world bounds of a leaf from its model
+    void fetchBounds(Leaf& leaf);
+
+    //Tell the model of a leaf it is visible this frame
+    void markVisible(int leaf);
+
+    //Every object below a node is visible
+    void markSubtreeVisible(int index) {
+        size_t bottom = this->stack.size();
+        this->stack.push_back(index);
+        while (this->stack.size() > bottom) {
+            const Node& node = this->nodes[this->stack.back()];
+            this->stack.pop_back();
+            if (node.leaf != -1)
+                this->markVisible(node.leaf);
+            else {
+                this->stack.push_back(node.left);
+                this->stack.push_back(node.right);
+            }
+        }
+    }
+
+    //Every object below a node
+    void collectSubtree(int index, std::vector<int>& found) {
+        size_t bottom = this->stack.size();
+        this->stack.push_back(index);
+        while (this->stack.size() > bottom) {
+            const Node& node = this->nodes[this->stack.back()];
+            this->stack.pop_back();
+            if (node.leaf != -1)
+                found.push_back(node.leaf);
+            else {
+                this->stack.push_back(node.left);
+                this->stack.push_back(node.right);
+            }
+        }
+    }
+
+    bool isAncestor(int ancestor, int node) {
+        for (int parent = this->nodes[node].parent; parent != -1; parent = this->nodes[parent].parent)
+            if (parent == ancestor)
+                return true;
+        return false;
+    }
+
+    //Slab test of a ray against a node's box, gives the entry distance
+    bool rayBox(const Node& node, glm::vec3 origin, glm::vec3 inverse, float maxDistance, float& entry) {
+        glm::vec3 t0 = (node.min - origin) * inverse;
+        glm::vec3 t1 = (node.max - origin) * inverse;
+        glm::vec3 closer = glm::min(t0, t1);
+        glm::vec3 further = glm::max(t0, t1);
+
+        entry = std::max(std::max(closer.x, closer.y), std::max(closer.z, 0.f));
+        float exit = std::min(std::min(further.x, further.y), std::min(further.z, maxDistance));
+        return entry <= exit;
+    }
+
+    //Build the whole tree from the live objects
+    void build() {
+        std::vector<int> items;
+        for (int i = 0; i < (int)this->leaves.size(); i++)
+            if (this->leaves[i].alive)
+                items.push_back(i);
+
+        this->nodes.clear();
+        this->root = -1;
+        this->needsBuild = false;
+        if (items.empty())
+            return;
+
+        std::vector<int> reuse;
+        this->root = this->allocateNode(reuse);
+        this->buildNode(this->root, -1, items, 0, items.size(), reuse);
+    }
+
+    //Build a subtree again over the same objects, reusing its node slots so the rest of the tree is untouched
+    void rebuildSubtree(int index) {
+        std::vector<int> items, reuse;
+        this->stack.clear();
+        this->stack.push_back(index);
+        while (!this->stack.empty()) {
+            int current = this->stack.back();
+            this->stack.pop_back();
+            const Node& node = this->nodes[current];
+            if (current != index)
+                reuse.push_back(current);
+            if (node.leaf != -1)
+                items.push_back(node.leaf);
+            else {
+                this->stack.push_back(node.left);
+                this->stack.push_back(node.right);
+            }
+        }
+        this->buildNode(index, this->nodes[index].parent, items, 0, items.size(), reuse);
+    }
+
+    int allocateNode(std::vector<int>& reuse) {
+        if (!reuse.empty()) {
+            int index = reuse.back();
+            reuse.pop_back();
+            this->nodes[index] = Node();
+            return index;
+        }
+        this->nodes.push_back(Node());
+        return (int)this->nodes.size() - 1;
+    }
+
+    //Split the objects [begin, end) where the surface area heuristic is the lowest
+    void buildNode(int index, int parent, std::vector<int>& items, size_t begin, size_t end, std::vector<int>& reuse) {
+        glm::vec3 min = glm::vec3(FLT_MAX), max = glm::vec3(-FLT_MAX);
+        glm::vec3 centerMin = glm::vec3(FLT_MAX), centerMax = glm::vec3(-FLT_MAX);
+        for (size_t i = begin; i < end; i++) {
+            const WorldBounds& bounds = this->leaves[items[i]].bounds;
+            min = glm::min(min, bounds.center - bounds.extent);
+            max = glm::max(max, bounds.center + bounds.extent);
+            centerMin = glm::min(centerMin, bounds.center);
+            centerMax = glm::max(centerMax, bounds.center);
+        }
+
+        {
+            Node& node = this->nodes[index];
+            node.min = min;
+            node.max = max;
+            node.parent = parent;
+            node.builtArea = boxArea(min, max);
+            node.left = node.right = node.leaf = -1;
+        }
+
+        if (end - begin == 1) {
+            this->nodes[index].leaf = items[begin];
+            this->leaves[items[begin]].node = index;
+            return;
+        }
+
+        //Bin the object centers along the longest axis of their bounds
+        glm::vec3 spread = centerMax - centerMin;
+        int axis = spread.x > spread.y ? (spread.x > spread.z ? 0 : 2) : (spread.y > spread.z ? 1 : 2);
+        size_t middle = begin + (end - begin) / 2;
+
+        if (spread[axis] > 0.f) {
+            struct Bin {
+                glm::vec3 min = glm::vec3(FLT_MAX), max = glm::vec3(-FLT_MAX);
+                size_t count = 0;
+            } bins[TREE_SAH_BINS];
+
+            float scale = TREE_SAH_BINS / spread[axis];
+            auto binOf = [&](int item) {
+                int bin = (int)((this->leaves[item].bounds.center[axis] - centerMin[axis]) * scale);
+                return std::min(bin, TREE_SAH_BINS - 1);
+            };
+            for (size_t i = begin; i < end; i++) {
+                const WorldBounds& bounds = this->leaves[items[i]].bounds;
+                Bin& bin = bins[binOf(items[i])];
+                bin.min = glm::min(bin.min, bounds.center - bounds.extent);
+                bin.max = glm::max(bin.max, bounds.center + bounds.extent);
+                bin.count++;
+            }
+
+            //Cost of splitting after each bin: objects on each side times the area of their box
+            float rightCost[TREE_SAH_BINS];
+            glm::vec3 sideMin = glm::vec3(FLT_MAX), sideMax = glm::vec3(-FLT_MAX);
+            size_t sideCount = 0;
+            for (int bin = TREE_SAH_BINS - 1; bin > 0; bin--) {
+                sideMin = glm::min(sideMin, bins[bin].min);
+                sideMax = glm::max(sideMax, bins[bin].max);
+                sideCount += bins[bin].count;
+                rightCost[bin] = sideCount * boxArea(sideMin, sideMax);
+            }
+
+            float bestCost = FLT_MAX;
+            int bestSplit = -1;
+            sideMin = glm::vec3(FLT_MAX);
+            sideMax = glm::vec3(-FLT_MAX);
+            sideCount = 0;
+            for (int bin = 0; bin < TREE_SAH_BINS - 1; bin++) {
+                sideMin = glm::min(sideMin, bins[bin].min);
+                sideMax = glm::max(sideMax, bins[bin].max);
+                sideCount += bins[bin].count;
+                if (sideCount == 0 || sideCount == end - begin)
+                    continue;
+
+                float cost = sideCount * boxArea(sideMin, sideMax) + rightCost[bin + 1];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestSplit = bin;
+                }
+            }
+
+            if (bestSplit != -1)
+                middle = std::partition(items.begin() + begin, items.begin() + end,
+                    [&](int item) { return binOf(item) <= bestSplit; }) - items.begin();
+        }
+
+        //Every center in the same place, split by count
+        if (middle == begin || middle == end || spread[axis] <= 0.f) {
+            middle = begin + (end - begin) / 2;
+            std::nth_element(items.begin() + begin, items.begin() + middle, items.begin() + end,
+                [&](int a, int b) { return this->leaves[a].bounds.center[axis] < this->leaves[b].bounds.center[axis]; });
+        }
+
+        int left = this->allocateNode(reuse);
+        int right = this->allocateNode(reuse);
+        this->nodes[index].left = left;
+        this->nodes[index].right = right;
+        this->buildNode(left, index, items, begin, middle, reuse);
+        this->buildNode(right, index, items, middle, end, reuse);
+    }
+};
+
+//Surface of a model: its texture, shading parameters and the shader features they need
+//The parameters live in the Materials block, a draw only sets its index
+class Material {
+//Fields for the material
+private:
+    int index; //Slot in the Materials block
+
+    GLuint texture = 0;
+    bool hasTexture = false; //Texture loaded, untextured materials skip sampling
+
+    glm::vec3 color = glm::vec3(1.f, 1.f, 1.f);
+
+    //Spec strength
+    float specStr = 0.f;
+
+    //Spec phong
+    float specPhong = 1.f;
+
+    //Material and program last bound, a new draw with both unchanged sets nothing
+    static Material* boundMaterial;
+    static GLuint boundProgram;
+
+public:
+    //Constructor
+    Material(int index) {
+        this->index = index;
+    }
+
+public:
+    //Load an image into the material's texture
+    void loadTexture(const std::string& image) {
+        int img_width, //Width of the texture
+            img_height, //Height of the texture
+            colorChannels; //Number of color channels
+
+        //Texture
+        stbi_set_flip_vertically_on_load(true);
+
+        unsigned char* tex_bytes =
+            stbi_load(image.c_str(), //Texture path
+                &img_width, //Fills out the width
+                &img_height, //Fills out the height
+                &colorChannels, //Fiills out the colo channels
+                0);
+
+        if (tex_bytes == NULL) {
+            std::cout << image << ": could not load texture" << std::endl;
+            return;
+        }
+
+        //Generate reference
+        glGenTextures(1, &this->texture);
+        //Set the current texture we're
+        //working
+        glState.bindTexture(0, GL_TEXTURE_2D, this->texture);
+
+
+        //Assign the loaded teexture
+        //to the OpenGL reference
+        glTexImage2D(GL_TEXTURE_2D,
+            0, //Texture 0
+            GL_RGB, // Target color format of the texture
+            img_width, // Texture width
+            img_height,// Texture height
+            0,
+            GL_RGB,    //Color format of the texturue
+            GL_UNSIGNED_BYTE, //Data type of texture
+            tex_bytes); // Loaded texture in bytes
+
+        //Generate thhe mipmaps to the current texture
+        glGenerateMipmap(GL_TEXTURE_2D);
+
+        //Free uo the loaded bytes
+        stbi_image_free(tex_bytes);
+        this->hasTexture = true;
+    }
+
+    //Setters
+    void setColor(glm::vec3 color) {
+        this->color = color;
+    }
+    void setSpecular(float specStr, float specPhong) {
+        this->specStr = specStr;
+        this->specPhong = specPhong;
+    }
+
+    //Write the material into its slot of the Materials block
+    void packMaterial(MaterialBlock& block) {
+        MaterialData& data = block.materials[this->index];
+        data.color = glm::vec4(this->color, 0.f);
+        data.specular = glm::vec4(this->specStr, this->specPhong, 0.f, 0.f);
+    }
+
+    //Shader features this material needs
+    void applyVariant(ShaderVariant& variant) {
+        variant.textured = this->hasTexture;
+        variant.specular = this->specStr > 0.f;
+    }
+
+    //Key that groups draws sharing the same program features and texture
+    //Variant in the top 32 bits, texture in the next 24 and the material slot in the low 8
+    uint64_t getKey() {
+        static_assert(MAX_MATERIALS <= 0x100, "Material slots don't fit the 8 bits of the key");
+        assert(this->texture <= 0xFFFFFF && "Texture name doesn't fit the 24 bits of the key");
+
+        ShaderVariant variant;
+        this->applyVariant(variant);
+        return ((uint64_t)variant.getKey() << 32) | ((uint64_t)(this->texture & 0xFFFFFF) << 8) | (uint64_t)(this->index & 0xFF);
+    }
+
+    //Bind the texture and select the material in the program, skipped when nothing changed since the last draw
+    void bind(ShaderProgram* shaderProg) {
+        if (boundMaterial == this && boundProgram == shaderProg->getID())
+            return;
+        boundMaterial = this;
+        boundProgram = shaderProg->getID();
+
+        if (this->hasTexture)
+            glState.bindTexture(0, GL_TEXTURE_2D, this->texture);
+
+        shaderProg->setInt(UNIFORM_TEX0, 0);
+        shaderProg->setInt(UNIFORM_MATERIAL_INDEX, this->index);
+    }
+
+    //Free the texture
+    void destroy() {
+        if (boundMaterial == this)
+            boundMaterial = nullptr;
+        glDeleteTextures(1, &this->texture);
+        this->texture = 0;
+        this->hasTexture = false;
+    }
+
+    //Getters
+    int getIndex() {
+        return this->index;
+    }
+    bool getHasTexture() {
+        return this->hasTexture;
+    }
+    GLuint getTexture() {
+        return this->texture;
+    }
+};
+
+Material* Material::boundMaterial = nullptr;
+GLuint Material::boundProgram = 0;
+
+//Every material of the scene and the buffer backing the Materials block
+class MaterialLibrary {
+//Fields for the library
+private:
+    std::vector<Material*> materials;
+
+    //Uniform buffer holding the Materials block
+    UniformBuffer buffer;
+
+    //Last uploaded block, used to skip unchanged uploads
+    MaterialBlock uploaded;
+    bool hasUploaded = false;
+
+public:
+    //Constructor
+    MaterialLibrary() {
+        memset(&this->uploaded, 0, sizeof(MaterialBlock));
+    }
+
+public:
+    //Create the buffer and bind it to the Materials block
+    void create() {
+        this->buffer.create(BLOCK_MATERIALS, sizeof(MaterialBlock));
+        this->buffer.bind();
+    }
+
+    //Add a material, returns NULL when the block is full
+    Material* createMaterial() {
+        if ((int)this->materials.size() >= MAX_MATERIALS) {
+            std::cout << "Material ignored, the Materials block is full" << std::endl;
+            return NULL;
+        }
+
+        Material* material = new Material((int)this->materials.size());
+        this->materials.push_back(material);
+        return material;
+    }
+
+    //Pack every material and upload the block when something changed
+    void perform() {
+        MaterialBlock block;
+        memset(&block, 0, sizeof(MaterialBlock));
+
+        for (Material* material : this->materials)
+            material->packMaterial(block);
+
+        if (this->hasUploaded && memcmp(&block, &this->uploaded, sizeof(MaterialBlock)) == 0)
+            return;
+
+        this->buffer.write(block);
+        this->uploaded = block;
+        this->hasUploaded = true;
+    }
+
+    //Free the textures and the buffer
+    void destroy() {
+        for (Material* material : this->materials) {
+            material->destroy();
+            delete material;
+        }
+        this->materials.clear();
+        this->buffer.destroy();
+    }
+};
+
+//Part of a mesh pool holding one mesh
+struct MeshRange {
+    GLuint firstIndex = 0; //First index in the pool's element buffer
+    GLuint indexCount = 0;
+    GLint baseVertex = 0; //Added to every index of the mesh
+};
+
+//Meshes of the MeshVertex format sharing one vertex and element buffer
+//Every mesh is drawn from the same VAO so a whole pass can be one multi draw
+class MeshPool {
+//Fields for the pool
+private:
+    std::vector<MeshVertex> vertices;
+    std::vector<GLuint> indices;
+
+    //VAO of the pool, the per draw buffer feeds the InstanceLayout attributes
+    GLuint VAO = 0, VBO = 0, EBO = 0;
+    GLuint drawVBO = 0;
+
+    //Size of the buffers on the GPU, in elements
+    size_t vertexCapacity = 0, indexCapacity = 0, drawCapacity = 0;
+    //Vertices and indices not uploaded yet
+    size_t uploadedVertices = 0, uploadedIndices = 0;
+
+public:
+    //Create the VAO and its buffers
+    void create() {
+        glGenVertexArrays(1, &this->VAO);
+        glGenBuffers(1, &this->VBO);
+        glGenBuffers(1, &this->EBO);
+        glGenBuffers(1, &this->drawVBO);
+
+        glState.bindVertexArray(this->VAO);
+        glState.bindBuffer(GL_ARRAY_BUFFER, this->VBO);
+        MeshVertexLayout::setup();
+        glState.bindBuffer(GL_ARRAY_BUFFER, this->drawVBO);
+        InstanceLayout::setup(1);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
+        glState.bindVertexArray(0);
+    }
+
+    //Append a mesh, it is uploaded with the next perform()
+    MeshRange addMesh(const std::vector<MeshVertex>& meshVertices, const std::vector<GLuint>& meshIndices) {
+        MeshRange range;
+        range.firstIndex = (GLuint)this->indices.size();
+        range.indexCount = (GLuint)meshIndices.size();
+        range.baseVertex = (GLint)this->vertices.size();
+
+        this->vertices.insert(this->vertices.end(), meshVertices.begin(), meshVertices.end());
+        this->indices.insert(this->indices.end(), meshIndices.begin(), meshIndices.end());
+        return range;
+    }
+
+    //Upload the meshes added since the last call, the buffers grow when they run out of room
+    void perform() {
+        glState.bindVertexArray(this->VAO);
+
+        if (this->uploadedVertices != this->vertices.size()) {
+            glState.bindBuffer(GL_ARRAY_BUFFER, this->VBO);
+            if (this->vertices.size() > this->vertexCapacity) {
+                this->vertexCapacity = std::max(this->vertices.size(), this->vertexCapacity * 2);
+                glBufferData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * this->vertexCapacity, NULL, GL_STATIC_DRAW);
+                this->uploadedVertices = 0;
+            }
+            glBufferSubData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * this->uploadedVertices,
+                sizeof(MeshVertex) * (this->vertices.size() - this->uploadedVertices),
+                this->vertices.data() + this->uploadedVertices);
+            this->uploadedVertices = this->vertices.size();
+        }
+
+        if (this->uploadedIndices != this->indices.size()) {
+            if (this->indices.size() > this->indexCapacity) {
+                this->indexCapacity = std::max(this->indices.size(), this->indexCapacity * 2);
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * this->indexCapacity, NULL, GL_STATIC_DRAW);
+                this->uploadedIndices = 0;
+            }
+            glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * this->uploadedIndices,
+                sizeof(GLuint) * (this->indices.size() - this->uploadedIndices),
+                this->indices.data() + this->uploadedIndices);
+            this->uploadedIndices = this->indices.size();
+        }
+    }
+
+    //Replace the per draw data, orphaning the old storage so the GPU can keep reading it
+    void uploadDraws(const std::vector<InstanceData>& draws) {
+        glState.bindBuffer(GL_ARRAY_BUFFER, this->drawVBO);
+        if (draws.size() > this->drawCapacity)
+            this->drawCapacity = std::max(draws.size(), this->drawCapacity * 2);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(InstanceData) * this->drawCapacity, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(InstanceData) * draws.size(), draws.data());
+    }
+
+    void bind() {
+        glState.bindVertexArray(this->VAO);
+    }
+
+    //Free the buffers
+    void destroy() {
+        glDeleteVertexArrays(1, &this->VAO);
+        glDeleteBuffers(1, &this->VBO);
+        glDeleteBuffers(1, &this->EBO);
+        glDeleteBuffers(1, &this->drawVBO);
+        this->VAO = this->VBO = this->EBO = this->drawVBO = 0;
+    }
+};
+
+//Passes of a frame in the order they are drawn
+enum RenderPass {
+    PASS_DEPTH, //Depth pre-pass
+    PASS_OPAQUE,
+    PASS_COUNT
+};
+
+//View depth mapped to the last depth bucket, anything further shares it
+const float SORT_DEPTH_RANGE = 200.f;
+
+//64 bit sort key of a draw, the fields sort in this order:
+//pass (4 bits) | program (16) | texture (16) | VAO (12) | depth bucket (16)
+//Draws sharing state end up next to each other, and front to back within the same state
+inline uint64_t makeSortKey(RenderPass pass, GLuint program, GLuint texture, GLuint vao, float viewDepth) {
+    float depth = std::min(std::max(viewDepth / SORT_DEPTH_RANGE, 0.f), 1.f);
+    uint64_t depthBucket = (uint64_t)(depth * 65535.f);
+
+    return ((uint64_t)(pass & 0xF) << 60) |
+        ((uint64_t)(program & 0xFFFF) << 44) |
+        ((uint64_t)(texture & 0xFFFF) << 28) |
+        ((uint64_t)(vao & 0xFFF) << 16) |
+        depthBucket;
+}
+
+//Stable LSD radix sort on the key field, one byte per pass
+//Bytes that are the same in every key are skipped, most frames only sort a few of them
+template <typename T>
+void radixSort(std::vector<T>& items, std::vector<T>& scratch) {
+    if (items.size() < 2)
+        return;
+
+    //Histogram of every byte in one read of the keys
+    size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (const T& item : items)
+        for (int digit = 0; digit < 8; digit++)
+            counts[digit][(item.key >> (digit * 8)) & 0xFF]++;
+
+    scratch.resize(items.size());
+    for (int digit = 0; digit < 8; digit++) {
+        size_t* count = counts[digit];
+
+        //Every key has the same byte, the order doesn't change
+        if (count[(items[0].key >> (digit * 8)) & 0xFF] == items.size())
+            continue;
+
+        size_t offsets[256];
+        size_t offset = 0;
+        for (int byte = 0; byte < 256; byte++) {
+            offsets[byte] = offset;
+            offset += count[byte];
+        }
+        for (const T& item : items)
+            scratch[offsets[(item.key >> (digit * 8)) & 0xFF]++] = item;
+        items.swap(scratch);
+    }
+}
+
+//Command read by glMultiDrawElementsIndirect, layout fixed by GL
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance; //First entry of the draw in the per draw buffer
+};
+
+//Collects the draws of a frame and submits them as one multi draw per program and texture
+//Per draw transforms and material slots reach Sample.vert as INSTANCED attributes through the base instance
+class DrawBatcher {
+//Fields for the batcher
+private:
+    //A submitted draw, its per draw data is at baseInstance in draws
+    struct BatchedDraw {
+        ShaderProgram* program;
+        ShaderProgram* depthProgram;
+        Material* material;
+        float viewDepth; //Of the closest instance
+        bool depthReady; //The depth program is built, set when the buckets are built
+        DrawElementsIndirectCommand command;
+    };
+
+    //Draw index with its sort key for the pass being built
+    struct SortedDraw {
+        uint64_t key;
+        size_t draw;
+    };
+    std::vector<SortedDraw> sorted, sortScratch;
+
+    MeshPool* pool = NULL;
+
+    std::vector<BatchedDraw> batched;
+    std::vector<InstanceData> draws;
+
+    //Commands of the lighting pass followed by the ones of the depth pass
+    std::vector<DrawElementsIndirectCommand> commands;
+    GLuint indirectBuffer = 0;
+    size_t indirectCapacity = 0;
+
+    //First command and count of each state bucket
+    struct Bucket {
+        ShaderProgram* program;
+        Material* material;
+        size_t first;
+        size_t count;
+    };
+    std::vector<Bucket> buckets, depthBuckets;
+
+    //Lighting buckets of the draws whose depth program isn't built yet, they are missing from the depth pass
+    std::vector<Bucket> unpreparedBuckets;
+
+    //Built and uploaded since the last begin()
+    bool uploaded = false;
+    //Pixels of the batch are already in the depth buffer
+    bool depthPrepared = false;
+
+    //Multi draw needs GL 4.3, the loop fallback needs base instance from GL 4.2
+    bool multiDraw = false;
+    bool supported = false;
+
+    //Programs whose attributes were checked against the layouts
+    std::vector<GLuint> checkedPrograms;
+
+public:
+    //Create the indirect buffer for the meshes of a pool
+    void create(MeshPool* pool) {
+        this->pool = pool;
+        this->multiDraw = GLAD_GL_VERSION_4_3 || GLAD_GL_ARB_multi_draw_indirect;
+        this->supported = this->multiDraw || GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_base_instance;
+        if (!this->supported) {
+            std::cout << "Batched draws need base instance (GL 4.2), models draw one by one" << std::endl;
+            return;
+        }
+        glGenBuffers(1, &this->indirectBuffer);
+    }
+
+    bool isSupported() {
+        return this->supported;
+    }
+
+    //Forget the last frame's draws
+    void begin() {
+        this->batched.clear();
+        this->draws.clear();
+        this->uploaded = false;
+        this->depthPrepared = false;
+    }
+
+    //Add a draw of a pooled mesh, one instance per entry of instances
+    //Commands of the same program and texture are drawn front to back by their view depth
+    void add(ShaderProgram* program, ShaderProgram* depthProgram, Material* material, const MeshRange& mesh,
+        const InstanceData* instances, size_t count, float viewDepth) {
+        if (count == 0)
+            return;
+
+        BatchedDraw draw;
+        draw.program = program;
+        draw.depthProgram = depthProgram;
+        draw.material = material;
+        draw.viewDepth = viewDepth;
+        draw.depthReady = false;
+        draw.command.count = mesh.indexCount;
+        draw.command.instanceCount = (GLuint)count;
+        draw.command.firstIndex = mesh.firstIndex;
+        draw.command.baseVertex = mesh.baseVertex;
+        draw.command.baseInstance = (GLuint)this->draws.size();
+
+        this->batched.push_back(draw);
+        this->draws.insert(this->draws.end(), instances, instances + count);
+    }
+
+    //Lay down the depth of every draw, the lighting pass then shades each pixel once
+    void performDepth() {
+        if (!this->prepare() || this->depthBuckets.empty())
+            return;
+
+        glState.setDepthFunc(GL_LESS);
+        glState.setDepthMask(GL_TRUE);
+        this->submit(this->depthBuckets, false);
+        this->depthPrepared = true;
+    }
+
+    //Draw every submitted draw, one call per program and texture
+    void perform() {
+        if (!this->prepare())
+            return;
+
+        if (this->depthPrepared) {
+            glState.setDepthFunc(GL_EQUAL);
+            glState.setDepthMask(GL_FALSE);
+        }
+        else {
+            glState.setDepthFunc(GL_LESS);
+            glState.setDepthMask(GL_TRUE);
+        }
+        this->submit(this->buckets, true);
+
+        //Draws without their depth fall back to a normal depth test, like Model3D::performDepth
+        if (!this->unpreparedBuckets.empty()) {
+            glState.setDepthFunc(GL_LESS);
+            glState.setDepthMask(GL_TRUE);
+            this->submit(this->unpreparedBuckets, true);
+        }
+    }
+
+    //Free the indirect buffer
+    void destroy() {
+        glDeleteBuffers(1, &this->indirectBuffer);
+        this->indirectBuffer = 0;
+    }
+
+private:
+    //Group the draws into buckets and upload the commands and per draw data, once per frame
+    bool prepare() {
+        if (!this->supported || this->batched.empty())
+            return false;
+        if (this->uploaded)
+            return true;
+
+        this->commands.clear();
+        this->buckets.clear();
+        this->unpreparedBuckets.clear();
+        this->depthBuckets.clear();
+
+        //Checked once so a build finishing in between can't leave a draw out of both lighting passes
+        for (BatchedDraw& draw : this->batched)
+            draw.depthReady = draw.depthProgram->isReady();
+        this->buildBuckets(this->buckets, true, true);
+        this->buildBuckets(this->unpreparedBuckets, true, false);
+        this->buildBuckets(this->depthBuckets, false, true);
+
+        this->pool->perform();
+        this->pool->uploadDraws(this->draws);
+
+        glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, this->indirectBuffer);
+        if (this->commands.size() > this->indirectCapacity)
+            this->indirectCapacity = std::max(this->commands.size(), this->indirectCapacity * 2);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, sizeof(DrawElementsIndirectCommand) * this->indirectCapacity, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0,
+            sizeof(DrawElementsIndirectCommand) * this->commands.size(), this->commands.data());
+
+        this->uploaded = true;
+        return true;
+    }
+
+    //Append the commands of a pass sorted by their keys, draws with the same program and texture end up next to each other
+    //Only the draws whose depth program is ready, or only the others when depthReady is false
+    void buildBuckets(std::vector<Bucket>& passBuckets, bool lighting, bool depthReady) {
+        //Depth only programs ignore the texture, a single bucket per program
+        this->sorted.clear();
+        for (size_t i = 0; i < this->batched.size(); i++) {
+            const BatchedDraw& draw = this->batched[i];
+            uint64_t key = lighting ?
+                makeSortKey(PASS_OPAQUE, draw.program->getID(), draw.material->getTexture(), 0, draw.viewDepth) :
+                makeSortKey(PASS_DEPTH, draw.depthProgram->getID(), 0, 0, draw.viewDepth);
+            this->sorted.push_back({ key, i });
+        }
+        radixSort(this->sorted, this->sortScratch);
+
+        for (const SortedDraw& entry : this->sorted) {
+            const BatchedDraw& draw = this->batched[entry.draw];
+            if (draw.depthReady != depthReady)
+                continue;
+            ShaderProgram* program = lighting ? draw.program : draw.depthProgram;
+            if (!program->isReady())
+                continue;
+
+            bool sameBucket = !passBuckets.empty() && passBuckets.back().program == program &&
+                (!lighting || passBuckets.back().material->getTexture() == draw.material->getTexture());
+            if (!sameBucket)
+                passBuckets.push_back({ program, draw.material, this->commands.size(), 0 });
+
+            this->commands.push_back(draw.command);
+            passBuckets.back().count++;
+        }
+    }
+
+    //Bind each bucket's program and texture and draw its commands
+    void submit(const std::vector<Bucket>& passBuckets, bool lighting) {
+        this->pool->bind();
+        glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, this->indirectBuffer);
+
+        for (const Bucket& bucket : passBuckets) {
+            //Check the program's inputs against the vertex and per draw formats once
+            GLuint programID = bucket.program->getID();
+            if (std::find(this->checkedPrograms.begin(), this->checkedPrograms.end(), programID) == this->checkedPrograms.end()) {
+                validateVertexInputs<MeshVertexLayout, InstanceLayout>(programID, "Batched draw");
+                this->checkedPrograms.push_back(programID);
+            }
+
+            bucket.program->use();
+            if (lighting)
+                bucket.material->bind(bucket.program);
+
+            if (this->multiDraw) {
+                glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                    (void*)(sizeof(DrawElementsIndirectCommand) * bucket.first), (GLsizei)bucket.count, 0);
+                glState.countDraw();
+                continue;
+            }
+
+            //Same draws one call each, still without any state change in between
+            for (size_t i = bucket.first; i < bucket.first + bucket.count; i++) {
+                const DrawElementsIndirectCommand& command = this->commands[i];
+                glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, command.count, GL_UNSIGNED_INT,
+                    (void*)(sizeof(GLuint) * command.firstIndex), command.instanceCount, command.baseVertex,
+                    command.baseInstance);
+                glState.countDraw();
+            }
+        }
+    }
+};
+
+//Forward Declare Light
+class Light;
+class PointLight;
+class LightBuffer;
+class RenderQueue;
+
+//Create Model
+class Model3D {
+
+//Fields for Model
+private:
+    std::string v; //Path of the vertex shader (Sample.vert)
+    std::string f; //Path of the frag shader (Sample.frag)
+    std::string defines; //Defines prepended to both stages
+
+    //Surface of the model, owned by the material library
+    Material* material = NULL;
+
+    //Shaders
+    ShaderProgram* shaderProg; //Program of the current draw, owned by the shader cache
+    ShaderProgram* defaultProg; //Variant that works for any draw, used while others compile
+
+    //Programs already picked for each variant
+    std::unordered_map<uint32_t, ShaderProgram*> variants;
+
+    //Obj file attributes
+    std::string path;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> objMaterials;
+    std::string warning, error;
+
+    tinyobj::attrib_t attributes;
+    bool success;
+
+    //Unique vertices of the mesh and the triangles indexing them
+    std::vector<GLuint> mesh_indices;
+    std::vector<MeshVertex> fullVertexData;
+
+    //Copies of the mesh drawn with one instanced call, empty draws the model once with its own transform
+    std::vector<InstanceData> instances;
+    //Instances changed since the last upload, [dirtyBegin, dirtyEnd)
+    size_t dirtyBegin = 0, dirtyEnd = 0;
+    //Instances the instance buffer has room for
+    size_t instanceCapacity = 0;
+
+    //Copy of the mesh in a shared pool for batched draws
+    MeshRange poolRange;
+    bool pooled = false;
+
+    //Programs whose attributes were checked against the vertex layout
+    std::vector<GLuint> checkedPrograms;
+
+    //Depth of this frame's draw is already in the depth buffer
+    bool depthPrepared = false;
+
+    //Bounding box and sphere of the mesh in model space, both centered on the box
+    glm::vec3 boundCenter = glm::vec3(0.f);
+    glm::vec3 boundExtent = glm::vec3(0.f);
+    float boundRadius = 0.f;
+
+    //Leaves of the model, or of each instance, in the scene tree
+    SceneTree* tree = NULL;
+    std::vector<int> treeLeaves;
+
+    //Frame of the tree's last frustum query that found the model, and the instances it found
+    unsigned int visibleFrame = 0;
+    std::vector<InstanceData> visibleInstances;
+
+    //Drawn into the CPU depth buffer to hide the objects behind it
+    bool occluder = false;
+
+    //Moves during the scene, its shadows are cached apart from the ones of the still models
+    bool dynamic = false;
+    std::vector<glm::vec3> occluderPositions;
+
+    //VertexArrayObject, VertexBufferObject, ElementBufferObject and the instance buffer
+    GLuint VAO, VBO, EBO;
+    GLuint instanceVBO = 0;
+
+    //Matrices
+    glm::mat4 identity_matrix4 = glm::mat4(1.0f);
+    glm::mat4 transformation_matrix;
+
+    //Inverse transpose of the transform, rebuilt only when the transform changes
+    glm::mat3 normal_matrix = glm::mat3(1.0f);
+    glm::mat4 normal_source = glm::mat4(1.0f);
+
+public:
+    //Constructor & Destructor
+    Model3D() {}
+
+    //Delete Vertex Object
+    ~Model3D() {
+        glDeleteVertexArrays(1, &this->VAO);
+        glDeleteBuffers(1, &this->VBO);
+        glDeleteBuffers(1, &this->EBO);
+        if (this->instanceVBO != 0)
+            glDeleteBuffers(1, &this->instanceVBO);
+    }
+
+//Methods
+public:
+    //Set the vertex and frag shader files
+    void setShaders(std::string v, std::string f, std::string defines = "") {
+        this->v = v;
+        this->f = f;
+        this->defines = defines;
+    }
+
+    //Set the surface the model is drawn with
+    void setMaterial(Material* material) {
+        this->material = material;
+    }
+
+    //Load the object
+    void setObj(std::string obj) {
+        //Obj
+        this->path = obj.c_str();
+
+        this->success = tinyobj::LoadObj(
+            &this->attributes,
+            &this->shapes,
+            &this->objMaterials,
+            &this->warning,
+            &this->error,
+            this->path.c_str()
+        );
+
+    }
+
+private:
+    //Get the vertex and frag shaders as one program
+    //Models with the same sources share the same program
+    //The default variant reads the light counts at runtime and works for any draw
+    void compileShaders() {
+        ShaderVariant variant;
+        variant.instanced = !this->instances.empty();
+        this->material->applyVariant(variant);
+        this->defaultProg = this->getVariant(variant);
+        this->shaderProg = this->defaultProg;
+    }
+
+    //Get the program for a variant, compiled on first use
+    ShaderProgram* getVariant(const ShaderVariant& variant) {
+        uint32_t key = variant.getKey();
+
+        auto found = this->variants.find(key);
+        if (found != this->variants.end())
+            return found->second;
+
+        ShaderProgram* program = shaderCache.getProgram(this->v, this->f, this->defines + variant.getDefines());
+        this->variants[key] = program;
+        return program;
+    }
+
+    //set the Vertex and texture data of the object
+    //Corners sharing the same position, normal and UV become one vertex
+    void setVertAndTex() {
+        std::map<std::tuple<int, int, int>, GLuint> uniqueVertices;
+
+        for (int i = 0; i < this->shapes[0].mesh.indices.size(); i++) {
+
+            //Assign the Index data for easy access
+            tinyobj::index_t vData = this->shapes[0].mesh.indices[i];
+
+            //Reuse the vertex if this combination was already added
+            std::tuple<int, int, int> key(vData.vertex_index, vData.normal_index, vData.texcoord_index);
+            auto found = uniqueVertices.find(key);
+            if (found != uniqueVertices.end()) {
+                this->mesh_indices.push_back(found->second);
+                continue;
+            }
+            GLuint index = (GLuint)this->fullVertexData.size();
+            uniqueVertices[key] = index;
+            this->mesh_indices.push_back(index);
+
+            MeshVertex vertex;
+
+            //Multiply the index by 3 to get the base offset of X, Y and Z
+            vertex.position = glm::vec3(
+                this->attributes.vertices[(vData.vertex_index * 3)],
+                this->attributes.vertices[(vData.vertex_index * 3) + 1],
+                this->attributes.vertices[(vData.vertex_index * 3) + 2]
+            );
+
+            vertex.normal = glm::vec3(
+                this->attributes.normals[(vData.normal_index * 3)],
+                this->attributes.normals[(vData.normal_index * 3) + 1],
+                this->attributes.normals[(vData.normal_index * 3) + 2]
+            );
+
+            //Multiply the index by 2 to get the base offset of U and V
+            vertex.uv = glm::vec2(
+                this->attributes.texcoords[(vData.texcoord_index * 2)],
+                this->attributes.texcoords[(vData.texcoord_index * 2) + 1]
+            );
+
+            this->fullVertexData.push_back(vertex);
+        }
+
+        //Bounding sphere around the center of the box
+        if (this->fullVertexData.empty())
+            return;
+
+        glm::vec3 boxMin = this->fullVertexData[0].position;
+        glm::vec3 boxMax = boxMin;
+        for (const MeshVertex& vertex : this->fullVertexData) {
+            boxMin = glm::min(boxMin, vertex.position);
+            boxMax = glm::max(boxMax, vertex.position);
+        }
+        this->boundCenter = (boxMin + boxMax) * 0.5f;
+        this->boundExtent = (boxMax - boxMin) * 0.5f;
+        this->boundRadius = 0.f;
+        for (const MeshVertex& vertex : this->fullVertexData)
+            this->boundRadius = std::max(this->boundRadius, glm::length(vertex.position - this->boundCenter));
+    }
+
+public:
+    //Createing thhe model
+    void createModel() {
+        //Call the neccessary functions to create model
+        this->compileShaders();
+        this->setVertAndTex();
+
+        //Generate VAO
+        glGenVertexArrays(1, &this->VAO);
+
+        //Generate VBO and EBO
+        glGenBuffers(1, &this->VBO);
+        glGenBuffers(1, &this->EBO);
+
+
+        //Bind VAO and VBO
+        glState.bindVertexArray(this->VAO);
+
+        glState.bindBuffer(GL_ARRAY_BUFFER, this->VBO);
+
+        glBufferData(
+            GL_ARRAY_BUFFER,
+            //Size of the whole array in bytes
+            sizeof(MeshVertex) * this->fullVertexData.size(),
+            //Data of the array
+            this->fullVertexData.data(),
+            GL_DYNAMIC_DRAW
+        );
+
+        //Position, normal and UV pointers come from the MeshVertex layout
+        MeshVertexLayout::setup();
+
+        //The element buffer binding is part of the VAO
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->EBO);
+        glBufferData(
+            GL_ELEMENT_ARRAY_BUFFER,
+            sizeof(GLuint) * this->mesh_indices.size(),
+            this->mesh_indices.data(),
+            GL_STATIC_DRAW
+        );
+
+        glState.bindBuffer(GL_ARRAY_BUFFER, 0);
+        //Currently editing VBO = null
+
+        //Currently editing VAO = VAO
+        glState.bindVertexArray(0);
+        //Currently editing VAO = null
+    }
+
+    //Add a copy of the mesh, returns its index for the setters below
+    //Instances are drawn with the model's shaders and texture, each with its own transform and material slot
+    size_t addInstance(const glm::mat4& transform, Material* material) {
+        InstanceData instance;
+        instance.transform = transform;
+        instance.normalMatrix = computeNormalMatrix(transform);
+        instance.materialIndex = material->getIndex();
+
+        this->instances.push_back(instance);
+        this->markInstanceDirty(this->instances.size() - 1);
+
+        //The first instance reuses the model's leaf
+        if (this->tree != NULL && this->instances.size() > 1)
+            this->treeLeaves.push_back(this->tree->insert(this, this->instances.size() - 1));
+        else if (this->tree != NULL)
+            this->tree->markDirty(this->treeLeaves[0]);
+        return this->instances.size() - 1;
+    }
+
+    //Move an instance, only the changed range is uploaded on the next draw
+    void setInstanceTransform(size_t instance, const glm::mat4& transform) {
+        InstanceData& data = this->instances[instance];
+        if (data.transform == transform)
+            return;
+        data.transform = transform;
+        data.normalMatrix = computeNormalMatrix(transform);
+        this->markInstanceDirty(instance);
+
+        if (this->tree != NULL)
+            this->tree->markDirty(this->treeLeaves[instance]);
+    }
+
+    //Change the material slot an instance is lit with
+    void setInstanceMaterial(size_t instance, Material* material) {
+        InstanceData& data = this->instances[instance];
+        if (data.materialIndex == material->getIndex())
+            return;
+        data.materialIndex = material->getIndex();
+        this->markInstanceDirty(instance);
+    }
+
+    size_t getInstanceCount() {
+        return this->instances.size();
+    }
+
+    //Copy the mesh into a shared pool so it can be drawn by a DrawBatcher, call after createModel()
+    void addToPool(MeshPool& pool) {
+        this->poolRange = pool.addMesh(this->fullVertexData, this->mesh_indices);
+        this->pooled = true;
+    }
+
+    //Put the model, or each of its instances, in a scene tree, call after createModel()
+    //Models the tree's last frustum query didn't find are skipped by submit() and enqueue()
+    void addToTree(SceneTree& tree) {
+        this->tree = &tree;
+        size_t count = std::max(this->instances.size(), (size_t)1);
+        for (size_t i = 0; i < count; i++)
+            this->treeLeaves.push_back(tree.insert(this, i));
+    }
+
+    //Take the model out of its scene tree, it is drawn without culling
+    void removeFromTree() {
+        if (this->tree == NULL)
+            return;
+        for (int leaf : this->treeLeaves)
+            this->tree->remove(leaf);
+        this->treeLeaves.clear();
+        this->tree = NULL;
+    }
+
+    //World bounds of the model, or of one of its instances
+    WorldBounds getWorldBounds(size_t instance) {
+        const glm::mat4& transform = this->instances.empty() ? this->transformation_matrix : this->instances[instance].transform;
+        return transformBounds(transform, this->boundCenter, this->boundExtent, this->boundRadius);
+    }
+
+    //Per draw data of the model, or of one of its instances
+    InstanceData getDrawData(size_t instance) {
+        if (!this->instances.empty())
+            return this->instances[instance];
+
+        InstanceData draw;
+        this->updateNormalMatrix();
+        draw.transform = this->transformation_matrix;
+        draw.normalMatrix = this->normal_matrix;
+        draw.materialIndex = this->material->getIndex();
+        return draw;
+    }
+
+    //Add the depth of some of the model's draws to a batch, for a pass seen from a light
+    //program replaces the instanced depth variant, for passes with their own shaders
+    //Returns false when the mesh isn't pooled or the depth program isn't compiled yet
+    bool submitDepth(DrawBatcher& batcher, const InstanceData* draws, size_t count, ShaderProgram* program = NULL) {
+        if (!this->pooled)
+            return false;
+
+        ShaderVariant depth;
+        depth.depthOnly = true;
+        depth.instanced = true;
+        ShaderProgram* depthProg = program != NULL ? program : this->getVariant(depth);
+        if (!depthProg->isReady())
+            return false;
+
+        batcher.add(depthProg, depthProg, this->material, this->poolRange, draws, count, 0.f);
+        return true;
+    }
+
+    //The tree's frustum query found the model or one of its instances
+    void markVisible(size_t instance, unsigned int frame) {
+        if (this->visibleFrame != frame) {
+            this->visibleFrame = frame;
+            this->visibleInstances.clear();
+        }
+        if (!this->instances.empty())
+            this->visibleInstances.push_back(this->instances[instance]);
+    }
+
+    //Hide the objects behind this model when occlusion culling, meant for large simple meshes
+    void setOccluder(bool occluder) {
+        this->occluder = occluder;
+    }
+
+    //Mark the model as moving, point light shadows then redraw it without redrawing the still models
+    void setDynamic(bool dynamic) {
+        this->dynamic = dynamic;
+    }
+    bool isDynamic() {
+        return this->dynamic;
+    }
+
+    //Draw the model into this frame's occlusion depth buffer if it is an occluder
+    void addOccluder(OcclusionCuller& occlusion) {
+        if (!this->occluder || !this->instances.empty())
+            return;
+
+        if (this->occluderPositions.size() != this->fullVertexData.size()) {
+            this->occluderPositions.clear();
+            for (const MeshVertex& vertex : this->fullVertexData)
+                this->occluderPositions.push_back(vertex.position);
+        }
+        occlusion.addOccluder(this->occluderPositions, this->mesh_indices, this->transformation_matrix);
+    }
+
+    //Outside the frustum for the whole frame, every instance included
+    bool isCulled() {
+        return this->tree != NULL && this->visibleFrame != this->tree->getFrame();
+    }
+
+    //Add this frame's draw of the model to a batch instead of drawing it now
+    void submit(DrawBatcher& batcher, LightBuffer* lights);
+
+    //Add this frame's draws of the model to a render queue, drawn when the queue is performed
+    void enqueue(RenderQueue& queue, LightBuffer* lights);
+
+    //Distance along the view direction to the closest instance, used to sort draws front to back
+    float getViewDepth();
+
+private:
+    //The model's transform changed, its leaf is refit on the tree's next update
+    void moved() {
+        if (this->tree != NULL && this->instances.empty())
+            this->tree->markDirty(this->treeLeaves[0]);
+    }
+
+    //Grow the range of instances to upload
+    void markInstanceDirty(size_t instance) {
+        if (this->dirtyBegin == this->dirtyEnd) {
+            this->dirtyBegin = instance;
+            this->dirtyEnd = instance + 1;
+            return;
+        }
+        this->dirtyBegin = std::min(this->dirtyBegin, instance);
+        this->dirtyEnd = std::max(this->dirtyEnd, instance + 1);
+    }
+
+    //Upload the changed instances, the buffer is only reallocated when it runs out of room
+    void uploadInstances() {
+        if (this->dirtyBegin == this->dirtyEnd)
+            return;
+
+        if (this->instanceVBO == 0) {
+            glGenBuffers(1, &this->instanceVBO);
+
+            //Instance attributes advance once per instance on the model's VAO
+            glState.bindVertexArray(this->VAO);
+            glState.bindBuffer(GL_ARRAY_BUFFER, this->instanceVBO);
+            InstanceLayout::setup(1);
+        }
+        glState.bindBuffer(GL_ARRAY_BUFFER, this->instanceVBO);
+
+        if (this->instances.size() > this->instanceCapacity) {
+            //Double the room so adding instances one by one doesn't reallocate every frame
+            this->instanceCapacity = std::max(this->instances.size(), this->instanceCapacity * 2);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(InstanceData) * this->instanceCapacity, NULL, GL_DYNAMIC_DRAW);
+            this->dirtyBegin = 0;
+            this->dirtyEnd = this->instances.size();
+        }
+
+        glBufferSubData(
+            GL_ARRAY_BUFFER,
+            sizeof(InstanceData) * this->dirtyBegin,
+            sizeof(InstanceData) * (this->dirtyEnd - this->dirtyBegin),
+            this->instances.data() + this->dirtyBegin
+        );
+        this->dirtyBegin = this->dirtyEnd = 0;
+    }
+
+    //Draw the mesh once, or once per instance
+    void drawMesh() {
+        glState.bindVertexArray(this->VAO);
+
+        if (this->instances.empty())
+            glDrawElements(GL_TRIANGLES, (GLsizei)this->mesh_indices.size(), GL_UNSIGNED_INT, 0);
+        else
+            glDrawElementsInstanced(GL_TRIANGLES, (GLsizei)this->mesh_indices.size(), GL_UNSIGNED_INT, 0,
+                (GLsizei)this->instances.size());
+        glState.countDraw();
+    }
+
+public:
+
+    //Set Object Position
+    void updateTranslate(float translate_x, float translate_y, float translate_z) {
+        this->transformation_matrix =
+            glm::translate(this->identity_matrix4,
+                glm::vec3(translate_x, translate_y, translate_z)
+            );
+        this->moved();
+    }
+    //Scale the Object
+    void updateScale(float scale_x, float scale_y, float scale_z) {
+        this->transformation_matrix =
+            glm::scale(this->transformation_matrix,
+                glm::vec3(scale_x, scale_y, scale_z)
+            );
+        this->moved();
+    }
+
+    //Rotate the Object
+    void updateRotation(float rotate_x, float rotate_y, float rotate_z) {
+        //X Rotation
+        this->transformation_matrix =
+            glm::rotate(this->transformation_matrix,
+                glm::radians(rotate_x),
+                glm::normalize(glm::vec3(1.f, 0.f, 0.f))
+            );
+        //Y Rotation
+        this->transformation_matrix =
+            glm::rotate(this->transformation_matrix,
+                glm::radians(rotate_y),
+                glm::normalize(glm::vec3(0.f, 1.f, 0.f))
+            );
+        //Z Rotation
+        this->transformation_matrix =
+            glm::rotate(this->transformation_matrix,
+                glm::radians(rotate_z),
+                glm::normalize(glm::vec3(0.f, 0.f, 1.f))
+            );
+        this->moved();
+    }
+
+    //Revolve object around a center
+    void updateRevolution(float revolve_x, float revolve_y, float revolve_z, float rotate_x,
+        float rotate_y, float rotate_z, PointLight* lightPos);
+
+    //Updating Transformation matrix
+    void update() {
+        //Instances carry their own matrices
+        if (!this->instances.empty())
+            return;
+
+        this->updateNormalMatrix();
+        this->shaderProg->setMat4(UNIFORM_TRANSFORM, this->transformation_matrix);
+        this->shaderProg->setMat3(UNIFORM_NORMAL_MATRIX, this->normal_matrix);
+    }
+
+    //Rebuild the normal matrix if the transform changed since the last one
+    void updateNormalMatrix() {
+        if (this->transformation_matrix == this->normal_source)
+            return;
+        this->normal_source = this->transformation_matrix;
+        this->normal_matrix = computeNormalMatrix(this->transformation_matrix);
+    }
+    //Light per vertex when the quality setting or the object's size on screen allows it
+    bool usePerVertexLighting();
+
+    //Variant matching the material and the scene's lights
+    ShaderVariant pickVariant(LightBuffer* lights);
+
+    //Submit the variants the next draws will need so they compile together
+    void prepareVariants(LightBuffer* lights) {
+        this->getVariant(this->pickVariant(lights));
+
+        ShaderVariant depth;
+        depth.depthOnly = true;
+        depth.instanced = !this->instances.empty();
+        this->getVariant(depth);
+
+        //Batched draws always read the per draw data as instances
+        if (this->pooled) {
+            ShaderVariant batched = this->pickVariant(lights);
+            batched.instanced = true;
+            this->getVariant(batched);
+            depth.instanced = true;
+            this->getVariant(depth);
+        }
+    }
+
+    //Render only the depth of the object for the pre-pass
+    void performDepth();
+
+    //Render the Complete object
+    //Uses the smallest program variant for the material and the scene's lights
+    void perform(LightBuffer* lights);
+
+private:
+    //Program perform() will draw with, NULL when nothing is compiled yet
+    ShaderProgram* drawProgram(LightBuffer* lights);
+
+    //Depth only program, NULL until it is compiled
+    ShaderProgram* depthProgram();
+
+public:
+
+    //Getters
+    ShaderProgram* getShaderProg() {
+        return this->shaderProg;
+    }
+    Material* getMaterial() {
+        return this->material;
+    }
+    GLuint getVAO() {
+        return this->VAO;
+    }
+};
+
+void SceneTree::fetchBounds(Leaf& leaf) {
+    leaf.bounds = leaf.model->getWorldBounds(leaf.instance);
+}
+
+void SceneTree::markVisible(int leaf) {
+    this->leaves[leaf].model->markVisible(this->leaves[leaf].instance, this->frame);
+    this->visibleCount++;
+}
+
+//Draws of a frame, sorted by their keys before they are issued
+//Callers enqueue in any order, the queue orders the passes, groups the state and draws front to back
+class RenderQueue {
+//Fields for the queue
+private:
+    struct RenderPacket {
+        uint64_t key;
+        Model3D* model;
+    };
+    std::vector<RenderPacket> packets, scratch;
+
+    //Models also lay down their depth in a pre-pass this frame
+    bool depthPrepass = false;
+
+public:
+    //Forget the last frame's draws
+    void begin(bool depthPrepass) {
+        this->packets.clear();
+        this->depthPrepass = depthPrepass;
+    }
+
+    //Add a draw of a model in a pass
+    void add(RenderPass pass, ShaderProgram* program, GLuint texture, GLuint vao, float viewDepth, Model3D* model) {
+        this->packets.push_back({ makeSortKey(pass, program->getID(), texture, vao, viewDepth), model });
+    }
+
+    bool hasDepthPrepass() {
+        return this->depthPrepass;
+    }
+
+    //Sort the draws and issue them, the state cache drops the binds shared with the previous draw
+    void perform(LightBuffer* lights) {
+        radixSort(this->packets, this->scratch);
+
+        for (const RenderPacket& packet : this->packets) {
+            RenderPass pass = (RenderPass)(packet.key >> 60);
+
+            //Depth pre-pass only writes depth
+            glState.setColorMask(pass == PASS_DEPTH ? GL_FALSE : GL_TRUE);
+            if (pass == PASS_DEPTH)
+                packet.model->performDepth();
+            else
+                packet.model->perform(lights);
+        }
+        glState.setColorMask(GL_TRUE);
+    }
+};
+
+//Create Camera Abstract Class
+class MyCamera {
+//Camera Fields
+protected:
+    //Matrix for the projection
+    glm::mat4 projectionMatrix;
 
     //The camera's poistion
     glm::vec3 cameraPos;
@@ -583,6 +4514,19 @@ protected:
     float window_height;
     float window_width;
 
+    //Depth of the near and far planes, set by createProjection()
+    float zNear;
+    float zFar;
+
+    //Uniform buffer holding this camera's block
+    UniformBuffer cameraBuffer;
+
+    //Camera changed since the last upload
+    bool dirty = true;
+
+    //Camera whose buffer is bound to the Camera block
+    static MyCamera* boundCamera;
+
 //Default Constructor
 public:
     MyCamera() {}
@@ -658,36 +4602,107 @@ public:
         this->createCameraPos();
         this->createCameraOrientation();
         this->createCameraView();
+
+        this->cameraBuffer.create(BLOCK_CAMERA, sizeof(CameraBlock));
+        this->dirty = true;
+    }
+protected:
+    //Set a new view matrix, only flags an upload when it actually changed
+    void setViewMatrix(const glm::mat4& viewMatrix) {
+        if (viewMatrix != this->viewMatrix) {
+            this->viewMatrix = viewMatrix;
+            this->dirty = true;
+        }
     }
 public:
     //Render the camera
-    void render(GLuint shaderProg) {
-        unsigned int projectionLoc = glGetUniformLocation(shaderProg, "projection");
+    //Uploads the Camera block only when the camera changed
+    //and rebinds it only when switching cameras
+    void render() {
+        if (this->dirty) {
+            CameraBlock block;
+            block.view = this->viewMatrix;
+            block.projection = this->projectionMatrix;
+            block.viewProjection = this->projectionMatrix * this->viewMatrix;
+            block.inverseViewProjection = glm::inverse(block.viewProjection);
+            block.cameraPos = glm::vec4(this->cameraPos, 1.f);
+
+            this->cameraBuffer.write(block);
+            this->dirty = false;
+        }
+
+        if (MyCamera::boundCamera != this) {
+            this->cameraBuffer.bind();
+            MyCamera::boundCamera = this;
+        }
+    }
+    //Virtual function for children to edit
+    virtual void perform() {
+        this->render();
+    }
+
+    //Getters
+    glm::vec3 getCameraPos() {
+        return this->cameraPos;
+    }
+
+    //Bind this camera's block again after a pass drew through its own Camera block
+    void rebind() {
+        this->cameraBuffer.bind();
+        MyCamera::boundCamera = this;
+    }
+
+    //Camera of the draws being issued
+    static MyCamera* getBoundCamera() {
+        return MyCamera::boundCamera;
+    }
 
-        glUniformMatrix4fv(projectionLoc,
-            1,
-            GL_FALSE,
-            glm::value_ptr(this->projectionMatrix));
+    glm::mat4 getViewProjection() {
+        return this->projectionMatrix * this->viewMatrix;
+    }
+    glm::mat4 getView() {
+        return this->viewMatrix;
+    }
+    glm::mat4 getProjection() {
+        return this->projectionMatrix;
+    }
 
-        unsigned int viewLoc = glGetUniformLocation(shaderProg, "view");
+    float getNear() {
+        return this->zNear;
+    }
+    float getFar() {
+        return this->zFar;
+    }
 
-        glUniformMatrix4fv(viewLoc,
-            1,
-            GL_FALSE,
-            glm::value_ptr(this->viewMatrix)); //View Matrix
+    //Distance of a world space point in front of the camera
+    float getViewDepth(glm::vec3 point) {
+        return -(this->viewMatrix * glm::vec4(point, 1.f)).z;
     }
-    //Virtual function for children to edit
-    virtual void perform(GLuint shaderProg) {
-        this->render(shaderProg);
+
+    //Radius in pixels of a world space sphere on the screen
+    float getProjectedRadius(glm::vec3 center, float radius) {
+        //Perspective projections divide by the view depth, orthographic ones don't
+        float w = 1.f;
+        if (this->projectionMatrix[2][3] != 0.f) {
+            float depth = -(this->viewMatrix * glm::vec4(center, 1.f)).z;
+
+            //Camera inside the sphere, it covers the screen
+            if (depth <= radius)
+                return this->window_height;
+            w = depth;
+        }
+        return radius * this->projectionMatrix[1][1] / w * this->window_height * 0.5f;
     }
 
-    //Getters
-    glm::vec3 getCameraPos() {
-        return this->cameraPos;
+    //Free the camera buffer
+    void destroy() {
+        this->cameraBuffer.destroy();
     }
 
 };
 
+MyCamera* MyCamera::boundCamera = nullptr;
+
 //Create Camera with Orthographic Projection
 class OrthoCamera :
     public MyCamera {
@@ -701,12 +4716,14 @@ public:
 public:
     //Create Orthographic Projection
     void createProjection() {
+        this->zNear = -0.1f;
+        this->zFar = 100.f;
         this->projectionMatrix = glm::ortho(-10.0f, //Left
             10.0f, //Right
             -10.0f, //Bottom
             10.0f, //Top
-            -0.1f, //Z-Near
-            100.f); //Z-Far
+            this->zNear, //Z-Near
+            this->zFar); //Z-Far
     }
 private:
     //New camera position
@@ -746,7 +4763,7 @@ private:
     //Source::learnopengl.com/Getting-started/Camera
     void updateViewMatrix() {
         //Using the lookAt function for easy calculation of camera orientation and camera position
-        this->viewMatrix = glm::lookAt(this->cameraPos, this->cameraPos + this->F, this->U);
+        this->setViewMatrix(glm::lookAt(this->cameraPos, this->cameraPos + this->F, this->U));
     }
 
     //Update function that performs all updates
@@ -757,9 +4774,9 @@ private:
 
 public:
     //Perfrom camera
-    void perform(GLuint shaderProg){
+    void perform(){
         this->update();
-        this->render(shaderProg);
+        this->render();
     }
 
 };
@@ -777,11 +4794,13 @@ public:
 public:
     //Create Perpective Projection
     void createProjection() {
+        this->zNear = 0.1f;
+        this->zFar = 100.f;
         this->projectionMatrix = glm::perspective(
             glm::radians(90.f), //FOV
             this->window_height / this->window_width, //Aspect ratio
-            0.1f, //ZNear > 0
-            100.f // ZFar
+            this->zNear, //ZNear > 0
+            this->zFar // ZFar
         );
 
     }
@@ -827,7 +4846,7 @@ private:
     //Source::learnopengl.com/Getting-started/Camera
     void updateViewMatrix() {
         //Using the lookAt function for easy calculation of camera orientation and camera position
-        this->viewMatrix = glm::lookAt(this->cameraPos, this->cameraPos + this->F, this->U);
+        this->setViewMatrix(glm::lookAt(this->cameraPos, this->cameraPos + this->F, this->U));
     }
 
     //Update function that performs all updates
@@ -838,214 +4857,1696 @@ private:
     }
 public:
     //Perform Camera
-    void perform(GLuint shaderProg) {
+    void perform() {
         this->update();
-        this->render(shaderProg);
+        this->render();
+    }
+
+
+};
+
+//Create Light Abstract Class
+class Light {
+protected:
+    //Light Fields
+   
+    //Light Color
+    glm::vec3 lightColor;
+
+    //Ambient strength
+    float ambientStr;
+
+    //Ambient Color
+    glm::vec3 ambientColor;
+
+    //Light Brightness
+    float brightness;
+
+    //Light Type
+    int lightType;
+
+public:
+    //Constructor
+    Light(glm::vec3 lightColor, glm::vec3 ambientColor, float ambientStr, float brightness) {
+        this->lightColor = lightColor;
+        this->ambientColor = ambientColor;
+        this->ambientStr = ambientStr;
+        this->brightness = brightness;
+    }
+
+    //Pure Virtual Function for children to write themselves into the Lights block
+    //Returns false when the block has no room left for this light type
+    virtual bool packLight(LightBlock& block) = 0;
+
+    //Point lights append themselves to the lights shaded through the light clusters
+    //Other light types light every surface and add nothing
+    virtual void packClustered(std::vector<PointLightData>& /*lights*/) {
+    }
+};
+
+//Create Point Light from Light
+class PointLight : 
+    public Light {
+    //Point Light Fields
+private:
+    glm::vec3 lightPos; //Position of light
+
+    //Attentuation factor
+    float constant;
+    float linear;
+    float exponent;
+
+    //Slot in the PointShadows block, -1 when the light casts no shadows
+    int shadowSlot = -1;
+
+public:
+    //Constructor
+    PointLight(glm::vec3 lightColor, glm::vec3 ambientColor, float ambientStr, float brightness,
+        glm::vec3 lightPos, float constant, float linear, float exponent) :
+        Light(lightColor, ambientColor, ambientStr, brightness) {
+        this->lightPos = lightPos;
+        this->constant = constant;
+        this->linear = linear;
+        this->exponent = exponent;
+    }
+
+    //Write the Light Source into the next point light slot
+    bool packLight(LightBlock& block) {
+        int index = block.lightCounts.x;
+        if (index >= MAX_POINT_LIGHTS)
+            return false;
+
+        this->packData(block.pointLights[index]);
+        block.lightCounts.x++;
+        return true;
+    }
+
+    //Add the Light Source to the clustered point lights
+    void packClustered(std::vector<PointLightData>& lights) {
+        lights.emplace_back();
+        this->packData(lights.back());
+    }
+
+    //Getters & Setters
+    glm::vec3 getLightPos() {
+        return this->lightPos;
+    }
+
+    void setLightPos(glm::vec3 lightPos) {
+        this->lightPos = lightPos;
+    }
+
+    void setIntensity(float brightness) {
+        this->brightness = brightness;
+    }
+    void setColor(glm::vec3 lightColor) {
+        this->lightColor = lightColor;
+    }
+    void setShadowSlot(int shadowSlot) {
+        this->shadowSlot = shadowSlot;
+    }
+
+    //Same layout in the Lights block and the light clusters
+    void packData(PointLightData& data) {
+        data.position = glm::vec4(this->lightPos, this->brightness);
+        data.color = glm::vec4(this->lightColor, this->ambientStr);
+        data.ambientColor = glm::vec4(this->ambientColor, (float)(this->shadowSlot + 1));
+        data.attenuation = glm::vec4(this->constant, this->linear, this->exponent, 0.f);
+    }
+};
+
+//Create Directional Light from Light
+class DirectionLight :
+    public Light {
+private:
+    //Direction of light
+    glm::vec3 lightDirection;
+
+    //Slot given by the last packLight()
+    int slot = -1;
+
+public:
+    //Constructor
+    DirectionLight(glm::vec3 lightColor, glm::vec3 ambientColor, float ambientStr,
+        float brightness, glm::vec3 lightDirection) :
+        Light(lightColor, ambientColor, ambientStr, brightness){
+        this->lightDirection = lightDirection;
+    }
+
+    //Write the light source into the next directional light slot
+    bool packLight(LightBlock& block) {
+        int index = block.lightCounts.y;
+        this->slot = index < MAX_DIRECTION_LIGHTS ? index : -1;
+        if (index >= MAX_DIRECTION_LIGHTS)
+            return false;
+
+        DirectionLightData& data = block.directionLights[index];
+        data.direction = glm::vec4(this->lightDirection, this->brightness);
+        data.color = glm::vec4(this->lightColor, this->ambientStr);
+        data.ambientColor = glm::vec4(this->ambientColor, 0.f);
+
+        block.lightCounts.y++;
+        return true;
+    }
+
+    //Setter
+    void setIntensity(float brightness) {
+        this->brightness = brightness;
+    }
+
+    //Getters
+    glm::vec3 getDirection() {
+        return this->lightDirection;
+    }
+
+    //Slot of the light in the Lights block it was last packed into, -1 when it didn't fit
+    int getSlot() {
+        return this->slot;
+    }
+};
+
+//Light under this level is treated as none when sizing the range of a clustered point light
+const float CLUSTER_LIGHT_CUTOFF = 1.f / 256.f;
+
+//Lights kept per cluster, the rest are dropped
+const int CLUSTER_MAX_LIGHTS = 64;
+
+//Point lights the clusters can hold, the index lists are 16 bit
+const int MAX_CLUSTERED_LIGHTS = 16384;
+
+//Scenes with at least this many point lights shade them through the clusters
+const int CLUSTERED_LIGHTS_FROM = 16;
+
+//Depth of the first slice boundary, also used when the camera's near plane is at or behind the eye
+const float CLUSTER_NEAREST_DEPTH = 0.1f;
+
+//Distance where a point light falls under CLUSTER_LIGHT_CUTOFF
+//Solves constant + linear * d + exponent * d^2 = peak / cutoff, FLT_MAX when the light never fades
+float pointLightRange(const PointLightData& light) {
+    //Diffuse and specular reach brightness * color each for specular strengths up to 1
+    float brightness = light.position.w;
+    float diffuse = brightness * std::max(light.color.r, std::max(light.color.g, light.color.b));
+    float ambient = light.color.w * std::max(light.ambientColor.r, std::max(light.ambientColor.g, light.ambientColor.b));
+    float target = std::max(2.f * diffuse, ambient) / CLUSTER_LIGHT_CUTOFF;
+
+    float constant = light.attenuation.x;
+    float linear = light.attenuation.y;
+    float exponent = light.attenuation.z;
+    if (target <= constant)
+        return 0.f;
+    if (exponent > 0.f)
+        return (-linear + std::sqrt(linear * linear + 4.f * exponent * (target - constant))) / (2.f * exponent);
+    if (linear > 0.f)
+        return (target - constant) / linear;
+    return FLT_MAX;
+}
+
+//Splits the camera's view into screen tiles by exponential depth slices and lists the point lights reaching each cluster
+//Worker threads bin the lights into a band of slices each, the lists are uploaded to texture buffers once per frame
+class LightClusters {
+//Fields for the clusters
+private:
+    //Clusters a light's sphere reaches, inclusive
+    struct LightBox {
+        int minX, minY, minSlice;
+        int maxX, maxY, maxSlice;
+    };
+
+    //slice = log(view depth) * x + y, same as clusterDepth in the Lights block
+    glm::vec4 depthSlicing = glm::vec4(0.f);
+
+    std::vector<LightBox> boxes;
+    std::vector<int> boxedLights;
+
+    //View space sphere of each boxed light, w is the range
+    std::vector<glm::vec4> spheres;
+
+    //View space bounds of every cluster, rebuilt when the projection changes
+    std::vector<glm::vec3> cellMin, cellMax;
+    glm::mat4 boundsProjection = glm::mat4(0.f);
+
+    //Lights of each cluster while binning, CLUSTER_MAX_LIGHTS slots per cluster
+    std::vector<GLushort> cellLights;
+    std::vector<int> cellCounts;
+
+    //Uploaded lists: first index and light count of each cluster, then the indices back to back
+    std::vector<glm::uvec2> grid;
+    std::vector<GLushort> indices;
+    GLint maxTexels = 65536;
+
+    //Texture buffers in SharedTextureID order starting at TEXTURE_CLUSTER_LIGHTS
+    GLuint buffers[3] = { 0, 0, 0 };
+    GLuint textures[3] = { 0, 0, 0 };
+
+    //Workers bin their band of slices each frame
+    BandWorkers workers;
+
+public:
+    //Destructor
+    ~LightClusters() {
+        this->stop();
+    }
+
+public:
+    //Create the texture buffers and start the worker threads, the calling thread bins a band too
+    void create() {
+        this->cellLights.resize(CLUSTER_COUNT * CLUSTER_MAX_LIGHTS);
+        this->cellCounts.assign(CLUSTER_COUNT, 0);
+        this->grid.resize(CLUSTER_COUNT);
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &this->maxTexels);
+
+        const GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R16UI };
+        glGenBuffers(3, this->buffers);
+        glGenTextures(3, this->textures);
+        for (int i = 0; i < 3; i++) {
+            glState.bindBuffer(GL_TEXTURE_BUFFER, this->buffers[i]);
+            glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+            glState.bindTexture(sharedTextureUnit((SharedTextureID)(TEXTURE_CLUSTER_LIGHTS + i)), GL_TEXTURE_BUFFER, this->textures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, formats[i], this->buffers[i]);
+        }
+
+        this->workers.create([this](int band, int bands) { this->binBand(band, bands); });
+    }
+
+    //Join the workers
+    void stop() {
+        this->workers.stop();
+    }
+
+    //Bin the point lights into the clusters of the camera's view, upload the lists and bind them
+    void perform(MyCamera* camera, const std::vector<PointLightData>& lights) {
+        float nearest = std::max(camera->getNear(), CLUSTER_NEAREST_DEPTH);
+        float scale = CLUSTER_SLICES / std::log(camera->getFar() / nearest);
+        this->depthSlicing = glm::vec4(scale, -std::log(nearest) * scale, 0.f, 0.f);
+
+        if (camera->getProjection() != this->boundsProjection)
+            this->buildCellBounds(camera);
+
+        //Light boxes are cheap, the binning is split between the threads
+        size_t count = std::min(lights.size(), (size_t)std::min(MAX_CLUSTERED_LIGHTS, this->maxTexels / 4));
+        glm::mat4 viewProjection = camera->getViewProjection();
+        glm::mat4 view = camera->getView();
+        this->boxes.clear();
+        this->boxedLights.clear();
+        this->spheres.clear();
+        for (size_t i = 0; i < count; i++) {
+            LightBox box;
+            if (this->boxLight(lights[i], camera, viewProjection, box)) {
+                this->boxes.push_back(box);
+                this->boxedLights.push_back((int)i);
+                this->spheres.push_back(glm::vec4(glm::vec3(view * glm::vec4(glm::vec3(lights[i].position), 1.f)), pointLightRange(lights[i])));
+            }
+        }
+
+        this->workers.perform();
+
+        //Pack the lists back to back, the texture buffer size caps the total
+        this->indices.clear();
+        for (int cell = 0; cell < CLUSTER_COUNT; cell++) {
+            int cellCount = std::min(this->cellCounts[cell], this->maxTexels - (int)this->indices.size());
+            const GLushort* cellLights = &this->cellLights[cell * CLUSTER_MAX_LIGHTS];
+            this->grid[cell] = glm::uvec2((GLuint)this->indices.size(), (GLuint)cellCount);
+            this->indices.insert(this->indices.end(), cellLights, cellLights + cellCount);
+        }
+
+        this->upload(0, lights.data(), count * sizeof(PointLightData));
+        this->upload(1, this->grid.data(), this->grid.size() * sizeof(glm::uvec2));
+        this->upload(2, this->indices.data(), this->indices.size() * sizeof(GLushort));
+
+        for (int i = 0; i < 3; i++)
+            glState.bindTexture(sharedTextureUnit((SharedTextureID)(TEXTURE_CLUSTER_LIGHTS + i)), GL_TEXTURE_BUFFER, this->textures[i]);
+    }
+
+    //Getters
+    glm::vec4 getDepthSlicing() {
+        return this->depthSlicing;
+    }
+    size_t getVisibleLightCount() {
+        return this->boxes.size();
+    }
+    size_t getIndexCount() {
+        return this->indices.size();
+    }
+
+    //Free the texture buffers
+    void destroy() {
+        this->stop();
+        glDeleteTextures(3, this->textures);
+        glDeleteBuffers(3, this->buffers);
+    }
+
+private:
+    //Slice of a view depth, the shader's clusterOf() computes the same
+    int sliceOf(float depth) {
+        float slice = std::floor(std::log(std::max(depth, 1e-4f)) * this->depthSlicing.x + this->depthSlicing.y);
+        return (int)std::min(std::max(slice, 0.f), (float)(CLUSTER_SLICES - 1));
+    }
+
+    //View space box of every cluster, from the tile corners on the near and far planes cut at the slice depths
+    void buildCellBounds(MyCamera* camera) {
+        this->boundsProjection = camera->getProjection();
+        glm::mat4 inverse = glm::inverse(this->boundsProjection);
+        this->cellMin.resize(CLUSTER_COUNT);
+        this->cellMax.resize(CLUSTER_COUNT);
+
+        for (int slice = 0; slice < CLUSTER_SLICES; slice++) {
+            //The first and last slices also hold the depths clamped into them
+            float depths[2] = {
+                slice == 0 ? camera->getNear() : std::exp((slice - this->depthSlicing.y) / this->depthSlicing.x),
+                slice == CLUSTER_SLICES - 1 ? camera->getFar() : std::exp((slice + 1 - this->depthSlicing.y) / this->depthSlicing.x)
+            };
+
+            for (int y = 0; y < CLUSTER_TILES_Y; y++) {
+                for (int x = 0; x < CLUSTER_TILES_X; x++) {
+                    glm::vec3 boxMin = glm::vec3(FLT_MAX), boxMax = glm::vec3(-FLT_MAX);
+                    for (int corner = 0; corner < 4; corner++) {
+                        glm::vec2 ndc = glm::vec2((float)(x + (corner & 1)) / CLUSTER_TILES_X, (float)(y + (corner >> 1)) / CLUSTER_TILES_Y) * 2.f - 1.f;
+                        glm::vec4 nearPoint = inverse * glm::vec4(ndc, -1.f, 1.f);
+                        glm::vec4 farPoint = inverse * glm::vec4(ndc, 1.f, 1.f);
+                        glm::vec3 a = glm::vec3(nearPoint) / nearPoint.w;
+                        glm::vec3 b = glm::vec3(farPoint) / farPoint.w;
+
+                        //Point of the corner's ray at each slice depth
+                        for (float depth : depths) {
+                            glm::vec3 point = a + (b - a) * ((-depth - a.z) / (b.z - a.z));
+                            boxMin = glm::min(boxMin, point);
+                            boxMax = glm::max(boxMax, point);
+                        }
+                    }
+
+                    int cell = (slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x;
+                    this->cellMin[cell] = boxMin;
+                    this->cellMax[cell] = boxMax;
+                }
+            }
+        }
+    }
+
+    //Tile of a normalized device coordinate along an axis with a number of tiles
+    int tileOf(float ndc, int tiles) {
+        float tile = std::floor((ndc * 0.5f + 0.5f) * tiles);
+        return (int)std::min(std::max(tile, 0.f), (float)(tiles - 1));
+    }
+
+    //Clusters reached by the bounding box of a light's sphere, false when it is out of view
+    bool boxLight(const PointLightData& light, MyCamera* camera, const glm::mat4& viewProjection, LightBox& box) {
+        float range = pointLightRange(light);
+        if (range <= 0.f)
+            return false;
+
+        glm::vec3 center = glm::vec3(light.position);
+        float depth = camera->getViewDepth(center);
+        if (depth + range < camera->getNear() || depth - range > camera->getFar())
+            return false;
+        box.minSlice = this->sliceOf(depth - range);
+        box.maxSlice = this->sliceOf(depth + range);
+
+        //Boxes crossing the camera plane can't be projected, they may reach any tile
+        box.minX = 0;
+        box.minY = 0;
+        box.maxX = CLUSTER_TILES_X - 1;
+        box.maxY = CLUSTER_TILES_Y - 1;
+        if (range >= camera->getFar())
+            return true;
+
+        glm::vec2 ndcMin = glm::vec2(FLT_MAX), ndcMax = glm::vec2(-FLT_MAX);
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec3 offset = glm::vec3(corner & 1 ? range : -range, corner & 2 ? range : -range, corner & 4 ? range : -range);
+            glm::vec4 clip = viewProjection * glm::vec4(center + offset, 1.f);
+            if (clip.w <= 1e-4f)
+                return true;
+            glm::vec2 ndc = glm::vec2(clip) / clip.w;
+            ndcMin = glm::min(ndcMin, ndc);
+            ndcMax = glm::max(ndcMax, ndc);
+        }
+
+        if (ndcMax.x < -1.f || ndcMax.y < -1.f || ndcMin.x > 1.f || ndcMin.y > 1.f)
+            return false;
+        box.minX = this->tileOf(ndcMin.x, CLUSTER_TILES_X);
+        box.minY = this->tileOf(ndcMin.y, CLUSTER_TILES_Y);
+        box.maxX = this->tileOf(ndcMax.x, CLUSTER_TILES_X);
+        box.maxY = this->tileOf(ndcMax.y, CLUSTER_TILES_Y);
+        return true;
+    }
+
+    //Fill the light lists of one band of depth slices, the bands share no cluster
+    void binBand(int band, int bands) {
+        int firstSlice = band * CLUSTER_SLICES / bands;
+        int endSlice = (band + 1) * CLUSTER_SLICES / bands;
+        const int sliceSize = CLUSTER_TILES_X * CLUSTER_TILES_Y;
+
+        std::fill(this->cellCounts.begin() + firstSlice * sliceSize, this->cellCounts.begin() + endSlice * sliceSize, 0);
+
+        for (size_t i = 0; i < this->boxes.size(); i++) {
+            const LightBox& box = this->boxes[i];
+            int sliceBegin = std::max(box.minSlice, firstSlice);
+            int sliceEnd = std::min(box.maxSlice + 1, endSlice);
+            glm::vec3 center = glm::vec3(this->spheres[i]);
+            float range = this->spheres[i].w;
+
+            for (int slice = sliceBegin; slice < sliceEnd; slice++) {
+                for (int y = box.minY; y <= box.maxY; y++) {
+                    for (int x = box.minX; x <= box.maxX; x++) {
+                        //The screen box is loose around the sphere, check the cluster's own bounds
+                        int cell = slice * sliceSize + y * CLUSTER_TILES_X + x;
+                        glm::vec3 closest = glm::clamp(center, this->cellMin[cell], this->cellMax[cell]);
+                        glm::vec3 away = center - closest;
+                        if (glm::dot(away, away) > range * range)
+                            continue;
+
+                        int& cellCount = this->cellCounts[cell];
+                        if (cellCount < CLUSTER_MAX_LIGHTS)
+                            this->cellLights[cell * CLUSTER_MAX_LIGHTS + cellCount++] = (GLushort)this->boxedLights[i];
+                    }
+                }
+            }
+        }
+    }
+
+    //Replace the contents of one texture buffer, empty lists keep a texel so the buffer stays valid
+    void upload(int buffer, const void* data, size_t size) {
+        glState.bindBuffer(GL_TEXTURE_BUFFER, this->buffers[buffer]);
+        glBufferData(GL_TEXTURE_BUFFER, std::max(size, (size_t)16), size > 0 ? data : NULL, GL_STREAM_DRAW);
+    }
+};
+
+//Every light in the scene packed into the Lights uniform block
+//so each draw is lit by all of them at once
+class LightBuffer {
+//Fields for the buffer
+private:
+    std::vector<Light*> lights;
+
+    //Uniform buffer holding the Lights block
+    UniformBuffer buffer;
+
+    //Last uploaded block, used to skip unchanged uploads
+    LightBlock uploaded;
+    bool hasUploaded = false;
+
+    //Every point light of the frame, shaded through the clusters when there are enough of them and a camera is bound
+    LightClusters clusters;
+    std::vector<PointLightData> pointLights;
+    bool clustered = false;
+
+public:
+    //Constructor
+    LightBuffer() {
+        memset(&this->uploaded, 0, sizeof(LightBlock));
+    }
+
+public:
+    //Create the buffer and bind it to the Lights block
+    void create() {
+        this->buffer.create(BLOCK_LIGHTS, sizeof(LightBlock));
+        this->buffer.bind();
+        this->clusters.create();
+    }
+
+    //Add a light to the scene
+    void addLight(Light* light) {
+        this->lights.push_back(light);
+    }
+
+    //Take a light out of the scene
+    void removeLight(Light* light) {
+        this->lights.erase(std::remove(this->lights.begin(), this->lights.end(), light), this->lights.end());
+    }
+
+    //Pack every light and upload the block when something changed
+    //With many point lights they are binned into the bound camera's clusters instead
+    void perform() {
+        LightBlock block;
+        memset(&block, 0, sizeof(LightBlock));
+
+        int ignored = 0;
+        this->pointLights.clear();
+        for (Light* light : this->lights) {
+            light->packClustered(this->pointLights);
+            if (!light->packLight(block))
+                ignored++;
+        }
+
+        MyCamera* camera = MyCamera::getBoundCamera();
+        this->clustered = camera != nullptr && (int)this->pointLights.size() >= CLUSTERED_LIGHTS_FROM;
+        if (this->clustered) {
+            //The clusters hold every point light, the block keeps the rest
+            block.lightCounts.x = 0;
+            memset(block.pointLights, 0, sizeof(block.pointLights));
+
+            this->clusters.perform(camera, this->pointLights);
+            block.clusterDepth = this->clusters.getDepthSlicing();
+        }
+        else {
+            for (int i = 0; i < ignored; i++)
+                std::cout << "Light ignored, the Lights block is full" << std::endl;
+        }
+
+        if (this->hasUploaded && memcmp(&block, &this->uploaded, sizeof(LightBlock)) == 0)
+            return;
+
+        this->buffer.write(block);
+        this->uploaded = block;
+        this->hasUploaded = true;
+    }
+
+    //Getters for the uploaded light counts
+    int getPointLightCount() {
+        return this->uploaded.lightCounts.x;
+    }
+    int getDirectionLightCount() {
+        return this->uploaded.lightCounts.y;
+    }
+
+    //Every point light packed this frame
+    const std::vector<PointLightData>& getPointLights() {
+        return this->pointLights;
+    }
+
+    //Point lights are shaded through the clusters this frame
+    bool isClustered() {
+        return this->clustered;
+    }
+
+    //Point lights in view of the clusters and the entries of all their lists
+    size_t getClusteredLightCount() {
+        return this->clusters.getVisibleLightCount();
+    }
+    size_t getClusterIndexCount() {
+        return this->clusters.getIndexCount();
+    }
+
+    //Free the buffer
+    void destroy() {
+        this->buffer.destroy();
+        this->clusters.destroy();
+    }
+};
+
+//Shadow cascades in use, at most MAX_SHADOW_CASCADES
+const int SHADOW_CASCADES = 3;
+
+//Size of each cascade's depth map
+const int SHADOW_MAP_SIZE = 1024;
+
+//View depth the cascades reach, surfaces further away are lit without shadows
+const float SHADOW_DISTANCE = 50.f;
+
+//Blend of the cascade splits, 0 spaces them evenly and 1 logarithmically
+const float SHADOW_SPLIT_BLEND = 0.75f;
+
+//A cascade covers this much more than its slice of the view so the camera can move before it is fitted again
+const float SHADOW_CASCADE_MARGIN = 1.15f;
+
+//Casters up to this far toward the light from a cascade still shadow it
+const float SHADOW_CASTER_REACH = 200.f;
+
+//Slope and constant depth bias of the shadow maps
+const float SHADOW_SLOPE_BIAS = 2.f;
+const float SHADOW_CONSTANT_BIAS = 4.f;
+
+//Cascaded shadow maps of one directional light
+//The camera's view is sliced by depth and each slice gets its own map around its bounding sphere
+//A cascade is fitted again only when its slice leaves the sphere, and drawn again only when its casters changed
+//Far cascade i is drawn at most every 2^i frames for moved casters, its shadows are far and small on screen
+class ShadowCascades {
+//Fields for the cascades
+private:
+    struct Cascade {
+        //World space sphere the map covers, its center snapped to the map's texels
+        glm::vec3 center = glm::vec3(0.f);
+        float radius = 0.f;
+        bool fitted = false;
+
+        glm::mat4 view = glm::mat4(1.f);
+        glm::mat4 projection = glm::mat4(1.f);
+
+        //Casters drawn into the map and the frame they were drawn on
+        uint64_t casters = 0;
+        unsigned int drawnFrame = 0;
+
+        //Camera block the map is drawn through
+        UniformBuffer camera;
+    };
+    Cascade cascades[SHADOW_CASCADES];
+
+    //One depth layer per cascade and the framebuffer drawing into them
+    GLuint texture = 0;
+    GLuint framebuffer = 0;
+
+    //Uniform buffer holding the Shadows block, and the last uploaded block
+    UniformBuffer buffer;
+    ShadowBlock uploaded;
+    bool hasUploaded = false;
+
+    //Casters of the cascade being drawn, a model's draws are next to each other
+    struct CasterRun {
+        Model3D* model;
+        size_t first;
+        size_t count;
+    };
+    FrustumCuller culler;
+    std::vector<int> found;
+    std::vector<InstanceData> draws;
+    std::vector<CasterRun> runs;
+
+    //Depth only draws of the casters, from the scene's mesh pool
+    DrawBatcher batcher;
+    bool supported = false;
+
+    //Light direction the cascades were fitted for
+    glm::vec3 direction = glm::vec3(0.f);
+
+    //Size of the default framebuffer, restored after drawing
+    int width = 0, height = 0;
+
+    unsigned int frame = 0;
+    int drawnCount = 0;
+
+public:
+    //Constructor
+    ShadowCascades() {
+        memset(&this->uploaded, 0, sizeof(ShadowBlock));
+    }
+
+public:
+    //Create the depth maps, the Shadows block and the batcher over the scene's mesh pool
+    void create(MeshPool* pool, int width, int height) {
+        this->width = width;
+        this->height = height;
+
+        this->buffer.create(BLOCK_SHADOWS, sizeof(ShadowBlock));
+        this->buffer.bind();
+        for (Cascade& cascade : this->cascades)
+            cascade.camera.create(BLOCK_CAMERA, sizeof(CameraBlock));
+
+        //Depth compared by the sampler, linear filtering blends four compares
+        glGenTextures(1, &this->texture);
+        glState.bindTexture(sharedTextureUnit(TEXTURE_SHADOW_CASCADES), GL_TEXTURE_2D_ARRAY, this->texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, SHADOW_CASCADES,
+            0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+        glGenFramebuffers(1, &this->framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, this->texture, 0, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Shadow map framebuffer is incomplete" << std::endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        //Casters are drawn as batches, without them there are no shadows
+        this->batcher.create(pool);
+        this->supported = this->batcher.isSupported();
+        if (!this->supported)
+            std::cout << "Shadows need batched draws, the directional light is unshadowed" << std::endl;
+    }
+
+    //Fit the cascades to the camera's view and draw the ones whose casters changed
+    //Call after the scene tree is updated and before the scene's draws, the camera is bound again after
+    void perform(MyCamera* camera, DirectionLight* light, SceneTree& tree) {
+        this->frame++;
+        this->drawnCount = 0;
+
+        ShadowBlock block;
+        memset(&block, 0, sizeof(ShadowBlock));
+        block.shadowInfo.y = light->getSlot();
+
+        if (this->supported && light->getSlot() >= 0) {
+            glm::vec3 direction = glm::normalize(light->getDirection());
+            bool turned = direction != this->direction;
+            this->direction = direction;
+
+            //Corners of the camera's view on its near and far planes
+            glm::mat4 inverse = glm::inverse(camera->getViewProjection());
+            glm::vec3 nearCorners[4], farCorners[4];
+            for (int i = 0; i < 4; i++) {
+                glm::vec2 corner = glm::vec2((i & 1) ? 1.f : -1.f, (i & 2) ? 1.f : -1.f);
+                glm::vec4 nearPoint = inverse * glm::vec4(corner, -1.f, 1.f);
+                glm::vec4 farPoint = inverse * glm::vec4(corner, 1.f, 1.f);
+                nearCorners[i] = glm::vec3(nearPoint) / nearPoint.w;
+                farCorners[i] = glm::vec3(farPoint) / farPoint.w;
+            }
+
+            float zNear = camera->getNear(), zFar = camera->getFar();
+            float splits[SHADOW_CASCADES + 1];
+            this->splitDepths(zNear, std::min(zFar, SHADOW_DISTANCE), splits);
+
+            bool drawing = false;
+            for (int i = 0; i < SHADOW_CASCADES; i++) {
+                Cascade& cascade = this->cascades[i];
+
+                //Slice of the view, the view depth changes linearly along each edge
+                glm::vec3 corners[8];
+                float from = (splits[i] - zNear) / (zFar - zNear);
+                float to = (splits[i + 1] - zNear) / (zFar - zNear);
+                glm::vec3 center = glm::vec3(0.f);
+                for (int c = 0; c < 4; c++) {
+                    corners[c] = glm::mix(nearCorners[c], farCorners[c], from);
+                    corners[c + 4] = glm::mix(nearCorners[c], farCorners[c], to);
+                    center += corners[c] + corners[c + 4];
+                }
+                center /= 8.f;
+
+                //The slice keeps its shape when the camera turns, so the radius only changes with the projection
+                float radius = 0.f;
+                for (const glm::vec3& corner : corners)
+                    radius = std::max(radius, glm::distance(corner, center));
+
+                bool refit = turned || !cascade.fitted || glm::distance(center, cascade.center) + radius > cascade.radius;
+                if (refit)
+                    this->fit(cascade, radius, center);
+
+                //Casters changed since the map was drawn, far cascades wait their turn
+                uint64_t casters = this->findCasters(cascade, tree);
+                bool due = this->frame - cascade.drawnFrame >= (1u << i);
+                if (refit || (casters != cascade.casters && due)) {
+                    if (!drawing) {
+                        this->beginPass();
+                        drawing = true;
+                    }
+                    cascade.casters = this->drawCascade(i) ? casters : 0;
+                    cascade.drawnFrame = this->frame;
+                    this->drawnCount++;
+                }
+
+                //World space to the map's [0, 1] texture coordinates and depth
+                glm::mat4 toTexture = glm::translate(glm::mat4(1.f), glm::vec3(0.5f)) * glm::scale(glm::mat4(1.f), glm::vec3(0.5f));
+                block.cascadeMatrices[i] = toTexture * cascade.projection * cascade.view;
+                block.cascadeSplits[i] = splits[i + 1];
+                block.cascadeTexels[i] = 2.f * cascade.radius / SHADOW_MAP_SIZE;
+            }
+            block.shadowInfo.x = SHADOW_CASCADES;
+
+            if (drawing)
+                this->endPass(camera);
+        }
+
+        if (this->hasUploaded && memcmp(&block, &this->uploaded, sizeof(ShadowBlock)) == 0)
+            return;
+
+        this->buffer.write(block);
+        this->uploaded = block;
+        this->hasUploaded = true;
+    }
+
+    //Getters
+    int getDrawnCount() {
+        return this->drawnCount;
+    }
+    int getCascadeCount() {
+        return SHADOW_CASCADES;
+    }
+
+    //Free the maps, the buffers and the batcher
+    void destroy() {
+        glDeleteTextures(1, &this->texture);
+        glDeleteFramebuffers(1, &this->framebuffer);
+        this->buffer.destroy();
+        for (Cascade& cascade : this->cascades)
+            cascade.camera.destroy();
+        this->batcher.destroy();
+    }
+
+private:
+    //View depth where each cascade starts, splits[SHADOW_CASCADES] is where the last one ends
+    void splitDepths(float zNear, float zFar, float* splits) {
+        //Orthographic views can start behind the camera, the logarithmic part starts in front of it
+        float logNear = std::max(zNear, CLUSTER_NEAREST_DEPTH);
+        for (int i = 0; i <= SHADOW_CASCADES; i++) {
+            float part = (float)i / SHADOW_CASCADES;
+            float logSplit = logNear * std::pow(zFar / logNear, part);
+            float evenSplit = zNear + (zFar - zNear) * part;
+            splits[i] = glm::mix(evenSplit, logSplit, SHADOW_SPLIT_BLEND);
+        }
+        splits[0] = zNear;
+        splits[SHADOW_CASCADES] = zFar;
     }
 
+    //Cover a slice's sphere with some margin, looking along the light
+    void fit(Cascade& cascade, float radius, glm::vec3 center) {
+        //Whole units keep the texel size the same between fits
+        cascade.radius = std::ceil(radius * SHADOW_CASCADE_MARGIN);
+
+        //Move the center across the light in whole texels, every fit then puts the texels on the same world positions
+        glm::vec3 up = std::abs(this->direction.y) > 0.99f ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f);
+        glm::mat4 rotation = glm::lookAt(glm::vec3(0.f), this->direction, up);
+        float texel = 2.f * cascade.radius / SHADOW_MAP_SIZE;
+        glm::vec3 local = glm::vec3(rotation * glm::vec4(center, 1.f));
+        local.x = std::floor(local.x / texel) * texel;
+        local.y = std::floor(local.y / texel) * texel;
+        cascade.center = glm::vec3(glm::transpose(rotation) * glm::vec4(local, 1.f));
+
+        //Casters in front of the near plane are flattened onto it by depth clamping
+        float r = cascade.radius;
+        cascade.view = glm::lookAt(cascade.center - this->direction * r, cascade.center, up);
+        cascade.projection = glm::ortho(-r, r, -r, r, 0.f, 2.f * r);
+        cascade.fitted = true;
+    }
 
-};
+    //Find the casters of a cascade and group their draws by model, returns a hash of what they are and where
+    uint64_t findCasters(const Cascade& cascade, SceneTree& tree) {
+        float r = cascade.radius;
+        this->culler.begin(glm::ortho(-r, r, -r, r, -SHADOW_CASTER_REACH, 2.f * r) * cascade.view);
+        tree.queryFrustum(this->culler, this->found);
+
+        std::sort(this->found.begin(), this->found.end(), [&](int a, int b) {
+            const SceneTree::Leaf& left = tree.getLeaf(a);
+            const SceneTree::Leaf& right = tree.getLeaf(b);
+            return left.model != right.model ? left.model < right.model : left.instance < right.instance;
+        });
+
+        this->draws.clear();
+        this->runs.clear();
+        uint64_t hash = HASH_SEED;
+        for (int index : this->found) {
+            const SceneTree::Leaf& leaf = tree.getLeaf(index);
+            if (this->runs.empty() || this->runs.back().model != leaf.model)
+                this->runs.push_back({ leaf.model, this->draws.size(), 0 });
+            this->draws.push_back(leaf.model->getDrawData(leaf.instance));
+            this->runs.back().count++;
+
+            hash = hashBytes(hash, &index, sizeof(int));
+            hash = hashBytes(hash, &this->draws.back().transform, sizeof(glm::mat4));
+        }
+        return hash;
+    }
 
-//Create Light Abstract Class
-class Light {
-protected:
-    //Light Fields
-   
-    //Light Color
-    glm::vec3 lightColor;
+    //Bind the shadow framebuffer and the depth state of the shadow passes
+    void beginPass() {
+        glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+        glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+        glEnable(GL_DEPTH_CLAMP);
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(SHADOW_SLOPE_BIAS, SHADOW_CONSTANT_BIAS);
+    }
 
-    //Ambient strength
-    float ambientStr;
+    //Back to the default framebuffer and the camera's block
+    void endPass(MyCamera* camera) {
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        glDisable(GL_DEPTH_CLAMP);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, this->width, this->height);
+        camera->rebind();
+    }
 
-    //Ambient Color
-    glm::vec3 ambientColor;
+    //Draw the casters found last into a cascade's layer, returns false when some of them couldn't be drawn yet
+    bool drawCascade(int index) {
+        Cascade& cascade = this->cascades[index];
+
+        CameraBlock block;
+        block.view = cascade.view;
+        block.projection = cascade.projection;
+        block.viewProjection = cascade.projection * cascade.view;
+        block.inverseViewProjection = glm::inverse(block.viewProjection);
+        block.cameraPos = glm::vec4(cascade.center - this->direction * cascade.radius, 1.f);
+        cascade.camera.write(block);
+        cascade.camera.bind();
+
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, this->texture, 0, index);
+        glState.setDepthMask(GL_TRUE);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        bool complete = true;
+        this->batcher.begin();
+        for (const CasterRun& run : this->runs)
+            complete = run.model->submitDepth(this->batcher, this->draws.data() + run.first, run.count) && complete;
+        this->batcher.performDepth();
+        return complete;
+    }
+};
 
-    //Spec strength
-    float specStr;
+//Sizes of the point light shadow tiers, finest first
+const int POINT_SHADOW_SIZES[POINT_SHADOW_TIERS] = { 256, 128, 64 };
 
-    //Spec phong
-    float specPhong;
+//Memory of every point light shadow map together, each tier gets an even share
+//A slot holds six faces of 4 byte depth twice: the cached still casters and the live map with the moving ones
+const size_t POINT_SHADOW_BUDGET = 32u << 20;
 
-    //Light Brightness
-    float brightness;
+//Near plane of the cube faces, and the furthest a point light's shadows reach
+const float POINT_SHADOW_NEAR = 0.05f;
+const float POINT_SHADOW_MAX_RANGE = 50.f;
 
-    //Light Type
-    int lightType;
+//A light's radius on screen must pass a tier's threshold by this factor to change tier, lights near one don't flip every frame
+const float POINT_SHADOW_HYSTERESIS = 1.25f;
 
-    //Variable address of frag shaders
-    GLuint tex0Address;
-    GLuint lightColorAddress;
-    GLuint ambientStrAddress;
-    GLuint ambientColorAddress;
-    GLuint cameraPosAddress;
-    GLuint specStrAddress;
-    GLuint specPhongAddress;
-    GLuint brightnessAddress;
+//Cube shadow maps of the point lights
+//The casters are drawn into all of a light's faces in one layered pass, the geometry shader copies each triangle to the faces it touches
+//Still models are drawn into a cached map, moving ones into a live copy of it, and each face only when its casters or the light moved
+//Lights take a slot of a resolution tier by their radius on screen, every tier has a fixed share of the memory budget
+class PointShadows {
+//Fields for the shadows
+private:
+    //Six face layers in a tier, the faces stay cached until the light moves or another light takes the slot
+    struct Slot {
+        PointLight* owner = NULL;
+        unsigned int takenFrame = 0;
+        bool drawn = false;
+
+        //Where the faces were drawn from and how far they reach
+        glm::vec3 position = glm::vec3(0.f);
+        float range = 0.f;
+
+        //Still and moving casters of each face
+        uint64_t stillCasters[6] = {};
+        uint64_t movingCasters[6] = {};
+    };
+
+    //Maps of one resolution, six layers per slot
+    struct Tier {
+        int size = 0;
+        std::vector<Slot> slots;
+        GLuint stillMaps = 0; //Only the still casters, copied into the live maps before the moving ones are drawn
+        GLuint liveMaps = 0; //Every caster, sampled by the shaders
+        int firstShadow = 0; //Slot 0 of the tier in the PointShadows block
+    };
+    Tier tiers[POINT_SHADOW_TIERS];
+
+    struct ShadowedLight {
+        PointLight* light;
+        Model3D* proxy; //Drawn at the light's position, never casts its shadows
+        float radius = 0.f; //Of its range on screen, in pixels, 0 when out of view
+        float distance = 0.f; //From the camera, the nearest light wins between lights of the same radius
+        float range = 0.f;
+        int tier = -1;
+        int slot = -1;
+    };
+    std::vector<ShadowedLight> lights;
+    std::vector<size_t> order;
+
+    //Draws into the maps, and reads the still faces when they are copied into the live ones
+    GLuint framebuffer = 0;
+    GLuint copyFramebuffer = 0;
+
+    //Uniform buffers holding the PointShadows block and the CubeShadow block of the pass being drawn
+    UniformBuffer buffer;
+    UniformBuffer cubeBuffer;
+    PointShadowBlock uploaded;
+    bool hasUploaded = false;
+
+    //Casters of the light being drawn and the faces each one reaches
+    struct CasterRun {
+        Model3D* model;
+        size_t first;
+        size_t count;
+    };
+    FrustumCuller culler;
+    std::vector<int> found;
+    std::vector<uint8_t> faces;
+    std::vector<int> passCasters;
+    std::vector<InstanceData> draws;
+    std::vector<CasterRun> runs;
+    glm::mat4 faceMatrices[6];
+
+    //Layered depth only draws from the scene's mesh pool
+    ShaderProgram* program = NULL;
+    DrawBatcher batcher;
+    bool supported = false;
+
+    //Size of the default framebuffer, restored after drawing
+    int width = 0, height = 0;
+
+    unsigned int frame = 0;
+    int shadowedCount = 0;
+    int drawnFaces = 0;
 
 public:
     //Constructor
-    Light(glm::vec3 lightColor, glm::vec3 ambientColor, float ambientStr,
-        float specStr, float specPhong, float brightness) {
-        this->lightColor = lightColor;
-        this->ambientColor = ambientColor;
-        this->ambientStr = ambientStr;
-        this->specStr = specStr;
-        this->specPhong = specPhong;
-        this->brightness = brightness;
+    PointShadows() {
+        memset(&this->uploaded, 0, sizeof(PointShadowBlock));
     }
 
-    //Pure Virtual Function for children to implement
-    virtual void createLight(GLuint shaderProg, GLuint texture, glm::vec3 cameraPos) = 0;
-};
+public:
+    //Create the maps of every tier within the budget, the blocks and the batcher over the scene's mesh pool
+    void create(MeshPool* pool, int width, int height) {
+        this->width = width;
+        this->height = height;
+
+        this->buffer.create(BLOCK_POINT_SHADOWS, sizeof(PointShadowBlock));
+        this->buffer.bind();
+        this->cubeBuffer.create(BLOCK_CUBE_SHADOW, sizeof(CubeShadowBlock));
+        this->cubeBuffer.bind();
+
+        GLint maxLayers = 0;
+        glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+
+        int total = 0;
+        for (int t = 0; t < POINT_SHADOW_TIERS; t++) {
+            Tier& tier = this->tiers[t];
+            tier.size = POINT_SHADOW_SIZES[t];
+            tier.firstShadow = total;
+
+            size_t slotBytes = 6 * (size_t)tier.size * tier.size * 4 * 2;
+            int count = (int)(POINT_SHADOW_BUDGET / POINT_SHADOW_TIERS / slotBytes);
+            count = std::min(count, std::min(maxLayers / 6, MAX_POINT_SHADOWS - total));
+            tier.slots.resize(std::max(count, 0));
+            total += (int)tier.slots.size();
+            if (tier.slots.empty())
+                continue;
+
+            tier.stillMaps = this->createMaps(tier, 0);
+            tier.liveMaps = this->createMaps(tier, sharedTextureUnit((SharedTextureID)(TEXTURE_POINT_SHADOWS + t)));
+        }
 
-//Create Point Light from Light
-class PointLight : 
-    public Light {
-    //Point Light Fields
-private:
-    glm::vec3 lightPos; //Position of light
+        glGenFramebuffers(1, &this->framebuffer);
+        glGenFramebuffers(1, &this->copyFramebuffer);
+        for (GLuint target : { this->framebuffer, this->copyFramebuffer }) {
+            glBindFramebuffer(GL_FRAMEBUFFER, target);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        //Casters are drawn as batches, without them there are no shadows
+        this->program = shaderCache.getProgram("Shaders/ShadowCube.vert", "Shaders/ShadowCube.frag", "", "Shaders/ShadowCube.geom");
+        this->batcher.create(pool);
+        this->supported = this->batcher.isSupported();
+        if (!this->supported)
+            std::cout << "Shadows need batched draws, the point lights are unshadowed" << std::endl;
+    }
 
-    //Attentuation factor
-    float constant;
-    float linear;
-    float exponent;
+    //Cast the shadows of a light, proxy is a model drawn where the light is that would hide it
+    void addLight(PointLight* light, Model3D* proxy = NULL) {
+        ShadowedLight shadowed;
+        shadowed.light = light;
+        shadowed.proxy = proxy;
+        this->lights.push_back(shadowed);
+    }
 
-    //Neccessary address to frag Shader
-    GLuint linearAddress;
-    GLuint constantAddress;
-    GLuint exponentAddress;
-    GLuint lightAddress;
+    //Stop casting the shadows of a light, its slot goes back to the tier
+    void removeLight(PointLight* light) {
+        for (Tier& tier : this->tiers)
+            for (Slot& slot : tier.slots)
+                if (slot.owner == light)
+                    slot = Slot();
 
-public:
-    //Constructor
-    PointLight(glm::vec3 lightColor, glm::vec3 ambientColor, float ambientStr,
-        float specStr, float specPhong, float brightness, 
-        glm::vec3 lightPos, float constant, float linear, float exponent) :
-        Light(lightColor, ambientColor, ambientStr, specStr, specPhong, brightness) {
-        this->lightPos = lightPos;
-        this->constant = constant;
-        this->linear = linear;
-        this->exponent = exponent;
+        light->setShadowSlot(-1);
+        this->lights.erase(std::remove_if(this->lights.begin(), this->lights.end(),
+            [&](const ShadowedLight& shadowed) { return shadowed.light == light; }), this->lights.end());
     }
 
-    //Creating the Light Source
-    void createLight(GLuint shaderProg, GLuint texture, glm::vec3 cameraPos) {
+    //Give the lights in view a slot and draw the faces whose casters changed
+    //Call after the scene tree is updated and before the lights are packed, each light's slot goes into its PointLightData
+    void perform(MyCamera* camera, SceneTree& tree) {
+        this->frame++;
+        this->shadowedCount = 0;
+        this->drawnFaces = 0;
+
+        PointShadowBlock block;
+        memset(&block, 0, sizeof(PointShadowBlock));
+
+        if (this->supported)
+            this->assignSlots(camera);
+
+        bool drawing = false;
+        for (ShadowedLight& shadowed : this->lights) {
+            if (shadowed.tier < 0) {
+                shadowed.light->setShadowSlot(-1);
+                continue;
+            }
+
+            Tier& tier = this->tiers[shadowed.tier];
+            Slot& slot = tier.slots[shadowed.slot];
+            int index = tier.firstShadow + shadowed.slot;
+            shadowed.light->setShadowSlot(index);
+            block.pointShadowMaps[index] = glm::vec4((float)shadowed.tier, (float)(shadowed.slot * 6), POINT_SHADOW_NEAR, shadowed.range);
+            this->shadowedCount++;
+
+            //Moving the light or changing its reach redraws every face
+            glm::vec3 position = shadowed.light->getLightPos();
+            int stillFaces = 0, liveFaces = 0;
+            if (!slot.drawn || position != slot.position || shadowed.range != slot.range) {
+                slot.drawn = true;
+                slot.position = position;
+                slot.range = shadowed.range;
+                stillFaces = 0x3F;
+            }
+
+            //Faces whose still or moving casters changed
+            this->findCasters(shadowed, position, tree);
+            for (int face = 0; face < 6; face++) {
+                uint64_t still = 0, moving = 0;
+                this->hashFace(tree, face, still, moving);
+                if (still != slot.stillCasters[face])
+                    stillFaces |= 1 << face;
+                if (moving != slot.movingCasters[face])
+                    liveFaces |= 1 << face;
+                slot.stillCasters[face] = still;
+                slot.movingCasters[face] = moving;
+            }
+            liveFaces |= stillFaces;
+            if (liveFaces == 0)
+                continue;
 
-        glActiveTexture(GL_TEXTURE0);
+            if (!drawing) {
+                this->beginPass();
+                drawing = true;
+            }
+            int firstLayer = shadowed.slot * 6;
+            glViewport(0, 0, tier.size, tier.size);
+
+            //Casters that couldn't be drawn yet are drawn again next frame
+            if (stillFaces != 0) {
+                this->clearFaces(tier.stillMaps, firstLayer, stillFaces);
+                if (!this->drawCasters(tree, tier.stillMaps, firstLayer, stillFaces, false))
+                    this->forgetFaces(slot.stillCasters, stillFaces);
+            }
+            this->copyFaces(tier, firstLayer, liveFaces);
+            if (!this->drawCasters(tree, tier.liveMaps, firstLayer, liveFaces, true))
+                this->forgetFaces(slot.movingCasters, liveFaces);
 
-        this->tex0Address = glGetUniformLocation(shaderProg, "tex0");
+            for (int face = 0; face < 6; face++)
+                this->drawnFaces += (liveFaces >> face) & 1;
+        }
 
-        glBindTexture(GL_TEXTURE_2D, texture);
+        if (drawing)
+            this->endPass();
 
-        this->lightAddress = glGetUniformLocation(shaderProg, "lightPos");
-        glUniform3fv(this->lightAddress, 1, glm::value_ptr(this->lightPos));
+        if (this->hasUploaded && memcmp(&block, &this->uploaded, sizeof(PointShadowBlock)) == 0)
+            return;
 
-        this->lightColorAddress = glGetUniformLocation(shaderProg, "lightColor");
-        glUniform3fv(this->lightColorAddress, 1, glm::value_ptr(this->lightColor));
+        this->buffer.write(block);
+        this->uploaded = block;
+        this->hasUploaded = true;
+    }
 
-        this->ambientStrAddress = glGetUniformLocation(shaderProg, "ambientStr");
-        glUniform1f(this->ambientStrAddress, this->ambientStr);
+    //Getters
+    int getShadowedCount() {
+        return this->shadowedCount;
+    }
+    int getDrawnFaces() {
+        return this->drawnFaces;
+    }
 
-        this->ambientColorAddress = glGetUniformLocation(shaderProg, "ambientColor");
-        glUniform3fv(this->ambientColorAddress, 1, glm::value_ptr(this->ambientColor));
+    //Free the maps, the framebuffers, the buffers and the batcher
+    void destroy() {
+        for (Tier& tier : this->tiers) {
+            if (tier.slots.empty())
+                continue;
+            glDeleteTextures(1, &tier.stillMaps);
+            glDeleteTextures(1, &tier.liveMaps);
+        }
+        glDeleteFramebuffers(1, &this->framebuffer);
+        glDeleteFramebuffers(1, &this->copyFramebuffer);
+        this->buffer.destroy();
+        this->cubeBuffer.destroy();
+        this->batcher.destroy();
+    }
 
-        this->cameraPosAddress = glGetUniformLocation(shaderProg, "cameraPos");
-        glUniform3fv(this->cameraPosAddress, 1, glm::value_ptr(cameraPos));
+private:
+    //Depth array with six layers per slot of the tier, compared by the sampler like the cascades
+    GLuint createMaps(const Tier& tier, GLuint unit) {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glState.bindTexture(unit, GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, tier.size, tier.size, (GLsizei)tier.slots.size() * 6,
+            0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        return texture;
+    }
 
-        this->specStrAddress = glGetUniformLocation(shaderProg, "specStr");
-        glUniform1f(this->specStrAddress, this->specStr);
+    //Finest tier a light's radius on screen asks for, a map about as wide as the light's range on screen
+    //Passing the threshold of another tier than the current one takes POINT_SHADOW_HYSTERESIS times more or less
+    int pickTier(float radius, int current) {
+        for (int t = 0; t < POINT_SHADOW_TIERS - 1; t++) {
+            float threshold = POINT_SHADOW_SIZES[t] * 0.5f;
+            if (current >= 0 && t < current)
+                threshold *= POINT_SHADOW_HYSTERESIS;
+            else if (t == current)
+                threshold /= POINT_SHADOW_HYSTERESIS;
+            if (radius >= threshold)
+                return t;
+        }
+        return POINT_SHADOW_TIERS - 1;
+    }
 
-        this->specPhongAddress = glGetUniformLocation(shaderProg, "specPhong");
-        glUniform1f(this->specPhongAddress, this->specPhong);
+    //Hand out the tiers' slots to the lights in view, the largest on screen first
+    //Lights that stay in their tier keep their slot and its cached faces
+    void assignSlots(MyCamera* camera) {
+        this->culler.begin(camera->getViewProjection());
+        for (ShadowedLight& shadowed : this->lights) {
+            PointLightData data;
+            shadowed.light->packData(data);
+            shadowed.range = std::min(pointLightRange(data), POINT_SHADOW_MAX_RANGE);
+
+            //A light whose range misses the view lights nothing that is seen
+            glm::vec3 position = shadowed.light->getLightPos();
+            bool seen = shadowed.range > POINT_SHADOW_NEAR &&
+                this->culler.classify(position, glm::vec3(shadowed.range)) != FRUSTUM_OUTSIDE;
+            shadowed.radius = seen ? camera->getProjectedRadius(position, shadowed.range) : 0.f;
+            shadowed.distance = glm::distance(camera->getCameraPos(), position);
+        }
 
-        this->constantAddress = glGetUniformLocation(shaderProg, "constant");
-        glUniform1f(this->constantAddress, this->constant);
+        this->order.resize(this->lights.size());
+        for (size_t i = 0; i < this->order.size(); i++)
+            this->order[i] = i;
+        std::sort(this->order.begin(), this->order.end(), [&](size_t a, size_t b) {
+            const ShadowedLight& left = this->lights[a];
+            const ShadowedLight& right = this->lights[b];
+            return left.radius != right.radius ? left.radius > right.radius : left.distance < right.distance;
+        });
+
+        //Lights the camera is inside of all cover the screen, the nearest of them come first
+        //Pick the tiers, lights fall back to coarser ones when a tier is full
+        int used[POINT_SHADOW_TIERS] = {};
+        for (size_t i : this->order) {
+            ShadowedLight& shadowed = this->lights[i];
+            int current = shadowed.tier;
+            shadowed.tier = -1;
+            shadowed.slot = -1;
+            if (shadowed.radius <= 0.f)
+                continue;
+
+            for (int t = this->pickTier(shadowed.radius, current); t < POINT_SHADOW_TIERS; t++) {
+                if (used[t] < (int)this->tiers[t].slots.size()) {
+                    used[t]++;
+                    shadowed.tier = t;
+                    break;
+                }
+            }
+        }
 
-        this->linearAddress = glGetUniformLocation(shaderProg, "linear");
-        glUniform1f(this->linearAddress, this->linear);
+        //Slots the lights already own, then free ones for the rest
+        for (size_t i : this->order) {
+            ShadowedLight& shadowed = this->lights[i];
+            if (shadowed.tier < 0)
+                continue;
+            std::vector<Slot>& slots = this->tiers[shadowed.tier].slots;
+            for (size_t s = 0; s < slots.size(); s++) {
+                if (slots[s].owner == shadowed.light) {
+                    slots[s].takenFrame = this->frame;
+                    shadowed.slot = (int)s;
+                    break;
+                }
+            }
+        }
+        for (size_t i : this->order) {
+            ShadowedLight& shadowed = this->lights[i];
+            if (shadowed.tier < 0 || shadowed.slot >= 0)
+                continue;
+
+            //Unowned slots first, they hold nobody's cached faces
+            std::vector<Slot>& slots = this->tiers[shadowed.tier].slots;
+            int pick = -1;
+            for (size_t s = 0; s < slots.size(); s++) {
+                if (slots[s].takenFrame == this->frame)
+                    continue;
+                if (pick == -1 || slots[s].owner == NULL)
+                    pick = (int)s;
+                if (slots[s].owner == NULL)
+                    break;
+            }
 
-        this->exponentAddress = glGetUniformLocation(shaderProg, "exponent");
-        glUniform1f(this->exponentAddress, this->exponent);
+            slots[pick] = Slot();
+            slots[pick].owner = shadowed.light;
+            slots[pick].takenFrame = this->frame;
+            shadowed.slot = pick;
+        }
+    }
 
-        this->brightnessAddress = glGetUniformLocation(shaderProg, "brightness");
-        glUniform1f(this->brightnessAddress, this->brightness);
+    //Find the casters in a light's range and the faces each one reaches
+    void findCasters(const ShadowedLight& shadowed, glm::vec3 position, SceneTree& tree) {
+        static const glm::vec3 forward[6] = {
+            glm::vec3(1.f, 0.f, 0.f), glm::vec3(-1.f, 0.f, 0.f), glm::vec3(0.f, 1.f, 0.f),
+            glm::vec3(0.f, -1.f, 0.f), glm::vec3(0.f, 0.f, 1.f), glm::vec3(0.f, 0.f, -1.f)
+        };
+        static const glm::vec3 up[6] = {
+            glm::vec3(0.f, -1.f, 0.f), glm::vec3(0.f, -1.f, 0.f), glm::vec3(0.f, 0.f, 1.f),
+            glm::vec3(0.f, 0.f, -1.f), glm::vec3(0.f, -1.f, 0.f), glm::vec3(0.f, -1.f, 0.f)
+        };
+
+        //Same faces as CUBE_FORWARD and CUBE_UP in Lighting.glsl
+        glm::mat4 projection = glm::perspective(glm::radians(90.f), 1.f, POINT_SHADOW_NEAR, shadowed.range);
+        for (int face = 0; face < 6; face++)
+            this->faceMatrices[face] = projection * glm::lookAt(position, position + forward[face], up[face]);
+
+        tree.querySphere(position, shadowed.range, this->found);
+        this->found.erase(std::remove_if(this->found.begin(), this->found.end(),
+            [&](int index) { return tree.getLeaf(index).model == shadowed.proxy; }), this->found.end());
+        std::sort(this->found.begin(), this->found.end());
+
+        this->faces.assign(this->found.size(), 0);
+        for (int face = 0; face < 6; face++) {
+            this->culler.begin(this->faceMatrices[face]);
+            for (int index : this->found)
+                this->culler.add(tree.getLeaf(index).bounds);
+            this->culler.perform();
+            for (size_t i = 0; i < this->found.size(); i++)
+                if (this->culler.isVisible(i))
+                    this->faces[i] |= 1 << face;
+        }
+    }
 
-        glUniform1i(this->tex0Address, 0);
+    //Hash the still and the moving casters of a face by their transforms
+    //Still ones can be rotated, scaled or moved as props instances too, keeping their bounds' center
+    void hashFace(SceneTree& tree, int face, uint64_t& still, uint64_t& moving) {
+        still = moving = HASH_SEED;
+        for (size_t i = 0; i < this->found.size(); i++) {
+            if (!(this->faces[i] & (1 << face)))
+                continue;
+
+            int index = this->found[i];
+            const SceneTree::Leaf& leaf = tree.getLeaf(index);
+            glm::mat4 transform = leaf.model->getDrawData(leaf.instance).transform;
+            uint64_t& hash = leaf.model->isDynamic() ? moving : still;
+            hash = hashBytes(hash, &index, sizeof(int));
+            hash = hashBytes(hash, &transform, sizeof(glm::mat4));
+        }
     }
 
-    //Getters & Setters
-    glm::vec3 getLightPos() {
-        return this->lightPos;
+    //Faces whose draws failed are hashed as never drawn
+    void forgetFaces(uint64_t* casters, int faces) {
+        for (int face = 0; face < 6; face++)
+            if (faces & (1 << face))
+                casters[face] = 0;
     }
 
-    void setLightPos(glm::vec3 lightPos) {
-        this->lightPos = lightPos;
+    //Bind the shadow framebuffer and the depth bias of the shadow passes
+    void beginPass() {
+        glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+        glState.setDepthMask(GL_TRUE);
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(SHADOW_SLOPE_BIAS, SHADOW_CONSTANT_BIAS);
     }
 
-    void setIntensity(float brightness) {
-        this->brightness = brightness;
+    //Back to the default framebuffer
+    void endPass() {
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, this->width, this->height);
     }
-    void setColor(glm::vec3 lightColor) {
-        this->lightColor = lightColor;
+
+    //Clear some faces of a slot, a layered attachment would clear all of them
+    void clearFaces(GLuint maps, int firstLayer, int faces) {
+        for (int face = 0; face < 6; face++) {
+            if (!(faces & (1 << face)))
+                continue;
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, maps, 0, firstLayer + face);
+            glClear(GL_DEPTH_BUFFER_BIT);
+        }
+    }
+
+    //Start some live faces from the cached still casters
+    void copyFaces(const Tier& tier, int firstLayer, int faces) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, this->copyFramebuffer);
+        for (int face = 0; face < 6; face++) {
+            if (!(faces & (1 << face)))
+                continue;
+            glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, tier.stillMaps, 0, firstLayer + face);
+            glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, tier.liveMaps, 0, firstLayer + face);
+            glBlitFramebuffer(0, 0, tier.size, tier.size, 0, 0, tier.size, tier.size, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, this->framebuffer);
+    }
+
+    //Draw the still or the moving casters reaching some faces into a slot's layers, in one layered pass
+    //Returns false when some of them couldn't be drawn yet
+    bool drawCasters(SceneTree& tree, GLuint maps, int firstLayer, int faces, bool moving) {
+        this->passCasters.clear();
+        for (size_t i = 0; i < this->found.size(); i++) {
+            const SceneTree::Leaf& leaf = tree.getLeaf(this->found[i]);
+            if ((this->faces[i] & faces) && leaf.model->isDynamic() == moving)
+                this->passCasters.push_back(this->found[i]);
+        }
+        if (this->passCasters.empty())
+            return true;
+
+        //A model's draws are next to each other
+        std::sort(this->passCasters.begin(), this->passCasters.end(), [&](int a, int b) {
+            const SceneTree::Leaf& left = tree.getLeaf(a);
+            const SceneTree::Leaf& right = tree.getLeaf(b);
+            return left.model != right.model ? left.model < right.model : left.instance < right.instance;
+        });
+        this->draws.clear();
+        this->runs.clear();
+        for (int index : this->passCasters) {
+            const SceneTree::Leaf& leaf = tree.getLeaf(index);
+            if (this->runs.empty() || this->runs.back().model != leaf.model)
+                this->runs.push_back({ leaf.model, this->draws.size(), 0 });
+            this->draws.push_back(leaf.model->getDrawData(leaf.instance));
+            this->runs.back().count++;
+        }
+
+        CubeShadowBlock cube;
+        for (int face = 0; face < 6; face++)
+            cube.faceMatrices[face] = this->faceMatrices[face];
+        cube.cubeFaces = glm::ivec4(firstLayer, faces, 0, 0);
+        this->cubeBuffer.write(cube);
+
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, maps, 0);
+
+        bool complete = true;
+        this->batcher.begin();
+        for (const CasterRun& run : this->runs)
+            complete = run.model->submitDepth(this->batcher, this->draws.data() + run.first, run.count, this->program) && complete;
+        this->batcher.performDepth();
+        return complete;
     }
 };
 
-//Create Directional Light from Light
-class DirectionLight :
-    public Light {
+//Rings and segments of the light volume sphere
+const int VOLUME_RINGS = 8;
+const int VOLUME_SEGMENTS = 12;
+
+//Deferred shading: the scene's surfaces go into a G-buffer, then each light is applied once in screen space
+//Directional lights light every pixel in one full-screen pass, point lights only the pixels inside their range sphere
+class DeferredRenderer {
+//Fields for the renderer
 private:
-    //Direction of light
-    glm::vec3 lightDirection;
+    int width = 0, height = 0;
+
+    //G-buffer: albedo, normal with the material slot, depth
+    GLuint gBuffer = 0;
+    GLuint albedoTexture = 0, normalTexture = 0, depthTexture = 0;
+
+    //Lit image, the volumes are depth tested against a copy of the G-buffer depth so it can still be sampled
+    GLuint lightBuffer = 0;
+    GLuint lightTexture = 0, lightDepth = 0;
+
+    //Unit sphere drawn once per point light, scaled to its range
+    GLuint volumeVAO = 0, volumeVBO = 0, volumeEBO = 0, instanceVBO = 0;
+    GLsizei volumeIndexCount = 0;
+    size_t instanceCapacity = 0;
+    std::vector<PointLightData> volumes;
+
+    //Programs whose attributes were checked against the volume layouts
+    std::vector<GLuint> checkedPrograms;
 
-    //light Address to frag Shader
-    GLuint lightAddress;
 public:
-    //Constructor
-    DirectionLight(glm::vec3 lightColor, glm::vec3 ambientColor, float ambientStr,
-        float specStr, float specPhong, float brightness, glm::vec3 lightDirection) :
-        Light(lightColor, ambientColor, ambientStr, specStr, specPhong, brightness){
-        this->lightDirection = lightDirection;
+    //Create the G-buffer and the light buffer at the framebuffer size, and the volume sphere
+    void create(int width, int height) {
+        this->width = width;
+        this->height = height;
+
+        glGenFramebuffers(1, &this->gBuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, this->gBuffer);
+        this->albedoTexture = this->createTarget(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        this->normalTexture = this->createTarget(GL_RGBA16F, GL_RGBA, GL_FLOAT);
+        this->depthTexture = this->createTarget(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_FLOAT);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->albedoTexture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, this->normalTexture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, this->depthTexture, 0);
+        const GLenum targets[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        glDrawBuffers(2, targets);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "G-buffer is incomplete" << std::endl;
+
+        glGenFramebuffers(1, &this->lightBuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, this->lightBuffer);
+        this->lightTexture = this->createTarget(GL_RGBA16F, GL_RGBA, GL_FLOAT);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, this->lightTexture, 0);
+        glGenRenderbuffers(1, &this->lightDepth);
+        glBindRenderbuffer(GL_RENDERBUFFER, this->lightDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, this->lightDepth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "Deferred light buffer is incomplete" << std::endl;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        this->createVolume();
     }
 
-    //Create the light source
-    void createLight(GLuint shaderProg, GLuint texture, glm::vec3 cameraPos) {
-        glActiveTexture(GL_TEXTURE0);
+    //Start the geometry pass, the scene's draws until perform() fill the G-buffer
+    void begin() {
+        glBindFramebuffer(GL_FRAMEBUFFER, this->gBuffer);
+        glState.setDepthMask(GL_TRUE);
+        glClearColor(0.f, 0.f, 0.f, 0.f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    //Light the G-buffer and copy the lit image to the default framebuffer
+    void perform(LightBuffer& lights) {
+        //Surfaces of every material share the passes, materials without specular have a zero strength
+        ShaderProgram* directionProg = shaderCache.getProgram("Shaders/Deferred.vert", "Shaders/Deferred.frag",
+            shadowsEnabled ? "#define SPECULAR\n#define SHADOWS\n" : "#define SPECULAR\n");
+        ShaderProgram* volumeProg = shaderCache.getProgram("Shaders/Deferred.vert", "Shaders/Deferred.frag",
+            shadowsEnabled ? "#define SPECULAR\n#define LIGHT_VOLUME\n#define SHADOWS\n" : "#define SPECULAR\n#define LIGHT_VOLUME\n");
+
+        //The volumes test against the scene's depth without writing it
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, this->gBuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, this->lightBuffer);
+        glBlitFramebuffer(0, 0, this->width, this->height, 0, 0, this->width, this->height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, this->lightBuffer);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        glState.bindTexture(sharedTextureUnit(TEXTURE_GBUFFER_ALBEDO), GL_TEXTURE_2D, this->albedoTexture);
+        glState.bindTexture(sharedTextureUnit(TEXTURE_GBUFFER_NORMAL), GL_TEXTURE_2D, this->normalTexture);
+        glState.bindTexture(sharedTextureUnit(TEXTURE_GBUFFER_DEPTH), GL_TEXTURE_2D, this->depthTexture);
+        glState.bindVertexArray(this->volumeVAO);
+
+        //Every light adds to the pixels it reaches
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glState.setDepthMask(GL_FALSE);
+
+        //Directional lights, one triangle covering the screen
+        if (directionProg->isReady()) {
+            directionProg->use();
+            glState.setDepthTest(false);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glState.countDraw();
+        }
 
-        this->tex0Address = glGetUniformLocation(shaderProg, "tex0");
+        //Point lights, the back faces of each sphere pass where a surface is in front of them
+        //Depth clamping keeps the far side of spheres larger than the view
+        if (volumeProg->isReady() && this->uploadVolumes(lights.getPointLights(), volumeProg)) {
+            volumeProg->use();
+            glState.setDepthTest(true);
+            glState.setDepthFunc(GL_GEQUAL);
+            glEnable(GL_CULL_FACE);
+            glCullFace(GL_FRONT);
+            glEnable(GL_DEPTH_CLAMP);
+
+            glDrawElementsInstanced(GL_TRIANGLES, this->volumeIndexCount, GL_UNSIGNED_INT, 0, (GLsizei)this->volumes.size());
+            glState.countDraw();
+
+            glDisable(GL_DEPTH_CLAMP);
+            glCullFace(GL_BACK);
+            glDisable(GL_CULL_FACE);
+        }
 
-        glBindTexture(GL_TEXTURE_2D, texture);
+        glDisable(GL_BLEND);
+        glState.setDepthTest(true);
+        glState.setDepthFunc(GL_LESS);
+        glState.setDepthMask(GL_TRUE);
 
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, this->lightBuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, this->width, this->height, 0, 0, this->width, this->height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
 
-        this->lightAddress = glGetUniformLocation(shaderProg, "lightDirection");
-        glUniform3fv(this->lightAddress, 1, glm::value_ptr(this->lightDirection));
+    //Free the framebuffers, textures and the volume sphere
+    void destroy() {
+        glDeleteFramebuffers(1, &this->gBuffer);
+        glDeleteFramebuffers(1, &this->lightBuffer);
+        const GLuint textures[4] = { this->albedoTexture, this->normalTexture, this->depthTexture, this->lightTexture };
+        glDeleteTextures(4, textures);
+        glDeleteRenderbuffers(1, &this->lightDepth);
+
+        glState.forgetBuffer(this->volumeVBO);
+        glState.forgetBuffer(this->instanceVBO);
+        glDeleteVertexArrays(1, &this->volumeVAO);
+        glDeleteBuffers(1, &this->volumeVBO);
+        glDeleteBuffers(1, &this->volumeEBO);
+        glDeleteBuffers(1, &this->instanceVBO);
+    }
 
-        this->lightColorAddress = glGetUniformLocation(shaderProg, "lightColor");
-        glUniform3fv(this->lightColorAddress, 1, glm::value_ptr(this->lightColor));
+private:
+    //Screen sized texture read back with texelFetch
+    GLuint createTarget(GLenum internalFormat, GLenum format, GLenum type) {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glState.bindTexture(0, GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, this->width, this->height, 0, format, type, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        return texture;
+    }
 
-        this->ambientStrAddress = glGetUniformLocation(shaderProg, "ambientStr");
-        glUniform1f(this->ambientStrAddress, this->ambientStr);
+    //Sphere around the unit sphere, the flat faces never cut inside the light's range
+    void createVolume() {
+        float scale = 1.f / (std::cos(glm::pi<float>() / VOLUME_RINGS) * std::cos(glm::pi<float>() / VOLUME_SEGMENTS));
 
-        this->ambientColorAddress = glGetUniformLocation(shaderProg, "ambientColor");
-        glUniform3fv(this->ambientColorAddress, 1, glm::value_ptr(this->ambientColor));
+        std::vector<VolumeVertex> vertices;
+        for (int ring = 0; ring <= VOLUME_RINGS; ring++) {
+            float theta = glm::pi<float>() * ring / VOLUME_RINGS;
+            for (int segment = 0; segment <= VOLUME_SEGMENTS; segment++) {
+                float phi = 2.f * glm::pi<float>() * segment / VOLUME_SEGMENTS;
+                vertices.push_back({ glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)) * scale });
+            }
+        }
 
-        this->cameraPosAddress = glGetUniformLocation(shaderProg, "cameraPos");
-        glUniform3fv(this->cameraPosAddress, 1, glm::value_ptr(cameraPos));
+        //Counter clockwise seen from outside
+        std::vector<GLuint> indices;
+        for (int ring = 0; ring < VOLUME_RINGS; ring++) {
+            for (int segment = 0; segment < VOLUME_SEGMENTS; segment++) {
+                GLuint a = ring * (VOLUME_SEGMENTS + 1) + segment;
+                GLuint b = a + VOLUME_SEGMENTS + 1;
+                indices.insert(indices.end(), { a, a + 1, b + 1, a, b + 1, b });
+            }
+        }
+        this->volumeIndexCount = (GLsizei)indices.size();
 
-        this->specStrAddress = glGetUniformLocation(shaderProg, "specStr");
-        glUniform1f(this->specStrAddress, this->specStr);
+        glGenVertexArrays(1, &this->volumeVAO);
+        glGenBuffers(1, &this->volumeVBO);
+        glGenBuffers(1, &this->volumeEBO);
+        glGenBuffers(1, &this->instanceVBO);
+        glState.bindVertexArray(this->volumeVAO);
 
-        this->specPhongAddress = glGetUniformLocation(shaderProg, "specPhong");
-        glUniform1f(this->specPhongAddress, this->specPhong);
+        glState.bindBuffer(GL_ARRAY_BUFFER, this->volumeVBO);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(VolumeVertex), vertices.data(), GL_STATIC_DRAW);
+        VolumeVertexLayout::setup();
 
-        this->brightnessAddress = glGetUniformLocation(shaderProg, "brightness");
-        glUniform1f(this->brightnessAddress, this->brightness);
+        glState.bindBuffer(GL_ARRAY_BUFFER, this->instanceVBO);
+        LightVolumeLayout::setup(1);
 
-        glUniform1i(this->tex0Address, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->volumeEBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
     }
 
-    //Setter
-    void setIntensity(float brightness) {
-        this->brightness = brightness;
+    //One volume per point light that reaches anything, returns false when there are none
+    bool uploadVolumes(const std::vector<PointLightData>& lights, ShaderProgram* program) {
+        GLuint programID = program->getID();
+        if (std::find(this->checkedPrograms.begin(), this->checkedPrograms.end(), programID) == this->checkedPrograms.end()) {
+            validateVertexInputs<VolumeVertexLayout, LightVolumeLayout>(programID, "Light volumes");
+            this->checkedPrograms.push_back(programID);
+        }
+
+        this->volumes.clear();
+        for (const PointLightData& light : lights) {
+            float range = pointLightRange(light);
+            if (range <= 0.f)
+                continue;
+
+            //Lights that never fade are capped, depth clamping keeps them on screen
+            PointLightData volume = light;
+            volume.attenuation.w = std::min(range, 1e6f);
+            this->volumes.push_back(volume);
+        }
+        if (this->volumes.empty())
+            return false;
+
+        glState.bindBuffer(GL_ARRAY_BUFFER, this->instanceVBO);
+        size_t size = this->volumes.size() * sizeof(PointLightData);
+        if (this->volumes.size() > this->instanceCapacity) {
+            this->instanceCapacity = this->volumes.size();
+            glBufferData(GL_ARRAY_BUFFER, size, this->volumes.data(), GL_STREAM_DRAW);
+        }
+        else
+            glBufferSubData(GL_ARRAY_BUFFER, 0, size, this->volumes.data());
+        return true;
     }
 };
 
@@ -1055,31 +6556,14 @@ int main(void)
     Model3D object;
     Model3D object2;
 
-    //Load the shader file into a string stream
-    std::fstream vertSrc("Shaders/Sample.vert");
-    std::stringstream vertBuff;
-
-    //Add the file stream to the string stream
-    vertBuff << vertSrc.rdbuf();
-
-    //Convert the stream to a character array
-    std::string vertS = vertBuff.str();
-    const char* v = vertS.c_str();
-
-    //Load the shader file into a string stream
-    std::fstream fragSrc("Shaders/Sample.frag");
-    std::stringstream fragBuff;
-
-    //Add the file stream to the string stream
-    fragBuff << fragSrc.rdbuf();
-
-    //Convert the stream to a character array
-    std::string fragS = fragBuff.str();
-    const char* f = fragS.c_str();
+    //Grid of hydrants drawn with one instanced call
+    Model3D props;
 
     //Set the shaders to the object
-    object.setShaders(v, f);
-    object2.setShaders(v, f);
+    //The shader cache reads each file once
+    object.setShaders("Shaders/Sample.vert", "Shaders/Sample.frag");
+    object2.setShaders("Shaders/Sample.vert", "Shaders/Sample.frag");
+    props.setShaders("Shaders/Sample.vert", "Shaders/Sample.frag");
 
     //Create window
     GLFWwindow* window;
@@ -1113,14 +6597,56 @@ int main(void)
     glfwMakeContextCurrent(window);
     gladLoadGL();
 
+    //Spec strength
+    float specStr = 10.0f;
+
+    //Spec phong
+    float specPhong = 50.f;
+
+    //Materials of the two objects
+    MaterialLibrary materials;
+    materials.create();
+
     //Hydrant obj and png file source:
     //cgtrader.com/free-3d-models/industrial/industrial-machine/fire-hydrant-7ba25670-3f38-4a77-a0c9-56ce888c9df2
-    object.setTextureAndObj("3D/hydrant_BaseColor.png", "3D/hydrant_low.obj");
+    Material* hydrant = materials.createMaterial();
+    hydrant->loadTexture("3D/hydrant_BaseColor.png");
+    hydrant->setSpecular(specStr, specPhong);
+    object.setMaterial(hydrant);
+    object.setObj("3D/hydrant_low.obj");
 
     //Brick obj file source:
     //cgtrader.com/free-3d-models/architectural/decoration/red-brick-lowpoly-pack-of-bricks-blocks-low-poly 
     //Brick png source: freepik.com/free-photos-vectors/white-background
-    object2.setTextureAndObj("3D/white.jpg", "3D/redBrick.obj");
+    Material* brick = materials.createMaterial();
+    brick->loadTexture("3D/white.jpg");
+    brick->setSpecular(specStr, specPhong);
+    object2.setMaterial(brick);
+    object2.setObj("3D/redBrick.obj");
+
+    //Props reuse the hydrant mesh and texture, every other one is tinted
+    Material* tintedHydrant = materials.createMaterial();
+    tintedHydrant->setColor(glm::vec3(0.4f, 0.6f, 1.f));
+    tintedHydrant->setSpecular(specStr, specPhong);
+    props.setMaterial(hydrant);
+    props.setObj("3D/hydrant_low.obj");
+
+    const int propRows = 32;
+    for (int row = 0; row < propRows; row++) {
+        for (int column = 0; column < propRows; column++) {
+            glm::mat4 transform = glm::translate(glm::mat4(1.f),
+                glm::vec3((column - propRows / 2) * 3.f, -6.f, (row - propRows / 2) * 3.f));
+            transform = glm::rotate(transform, glm::radians(row * 37.f + column * 11.f), glm::vec3(0.f, 1.f, 0.f));
+            transform = glm::scale(transform, glm::vec3(0.02f));
+            props.addInstance(transform, (row + column) % 2 ? tintedHydrant : hydrant);
+        }
+    }
+
+    //Upload the materials once, they only change when edited
+    materials.perform();
+
+    //Closer surfaces hide the ones behind them
+    glState.setDepthTest(true);
 
     //Keyboard and Mouse inputs
     glfwSetKeyCallback(window, Key_Callback);
@@ -1132,6 +6658,39 @@ int main(void)
  
     //MODEL 2
     object2.createModel();
+
+    //Instanced props
+    props.createModel();
+
+    //Shared copy of every mesh for batched draws
+    MeshPool meshPool;
+    meshPool.create();
+    object.addToPool(meshPool);
+    object2.addToPool(meshPool);
+    props.addToPool(meshPool);
+
+    DrawBatcher batcher;
+    batcher.create(&meshPool);
+
+    //Models drawn one by one are ordered by the render queue
+    RenderQueue renderQueue;
+
+    //Bounds of the models and instances, culled against the camera each frame
+    SceneTree sceneTree;
+    FrustumCuller frustumCuller;
+    object.addToTree(sceneTree);
+    object2.addToTree(sceneTree);
+    bool propsInTree = false;
+
+    //The hydrant and the brick hide what is behind them
+    OcclusionCuller occlusionCuller;
+    occlusionCuller.create();
+    object.setOccluder(true);
+    object2.setOccluder(true);
+
+    //The hydrant turns and the brick revolves with the light, their shadows are redrawn apart from the props'
+    object.setDynamic(true);
+    object2.setDynamic(true);
     
 
     //CAMERA 1
@@ -1161,12 +6720,6 @@ int main(void)
     //Ambient Color
     glm::vec3 ambientColor = lightColor;
 
-    //Spec strength
-    float specStr = 10.0f;
-
-    //Spec phong
-    float specPhong = 50.f;
-
     //Constant
     float constant = 1.f;
 
@@ -1180,127 +6733,438 @@ int main(void)
     float brightness = 1.f;
     
     //Instantiate point light and directional light by type-casting light 
-    Light* pointLight = new PointLight(lightColor,ambientColor,ambientStr,specStr,
-        specPhong,brightness,lightPosPoint,constant,linear,exponent);
+    Light* pointLight = new PointLight(lightColor,ambientColor,ambientStr,
+        brightness,lightPosPoint,constant,linear,exponent);
 
     PointLight* pPointLight = (PointLight*)pointLight;
 
-    Light* directionlight = new DirectionLight(lightColor, ambientColor, ambientStr, specStr,
-        specPhong, brightness, lightDirection);
+    Light* directionlight = new DirectionLight(lightColor, ambientColor, ambientStr,
+        brightness, lightDirection);
 
     DirectionLight* pDirectionlight = (DirectionLight*)directionlight;
 
 
+    //Every object is lit by every light in the buffer
+    LightBuffer lights;
+    lights.create();
+    lights.addLight(pointLight);
+    lights.addLight(directionlight);
+    lights.perform();
+
+    //Small colored lights over the props, enough of them to be shaded through the clusters
+    std::vector<Light*> lightField;
+    const int lightFieldRows = 16;
+    for (int row = 0; row < lightFieldRows; row++) {
+        for (int column = 0; column < lightFieldRows; column++) {
+            float hue = (row * lightFieldRows + column) * 0.37f;
+            glm::vec3 color = glm::vec3(0.5f) + 0.5f * glm::vec3(std::cos(hue), std::cos(hue + 2.1f), std::cos(hue + 4.2f));
+            glm::vec3 position = glm::vec3((column - lightFieldRows / 2) * 6.f + 1.5f, -5.f, (row - lightFieldRows / 2) * 6.f + 1.5f);
+            lightField.push_back(new PointLight(color, color, 0.f, 2.f, position, 1.f, 0.f, 2.f));
+        }
+    }
+    bool lightFieldInBuffer = false;
+
+    //G-buffer and light buffer of the deferred path, sized like the window's framebuffer
+    int framebufferWidth = 0, framebufferHeight = 0;
+    glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+    DeferredRenderer deferred;
+    deferred.create(framebufferWidth, framebufferHeight);
+
+    //Shadow maps of the directional light, the casters are drawn from the shared mesh pool
+    ShadowCascades shadows;
+    shadows.create(&meshPool, framebufferWidth, framebufferHeight);
+
+    //Cube shadow maps of the point lights, the brick drawn around the main light doesn't block it
+    PointShadows pointShadows;
+    pointShadows.create(&meshPool, framebufferWidth, framebufferHeight);
+    pointShadows.addLight(pPointLight, &object2);
+
+    //Submit every variant up front so the driver compiles them together
+    object.prepareVariants(&lights);
+    object2.prepareVariants(&lights);
+    props.prepareVariants(&lights);
+
     float last_x = 0.f, last_y = 0.f, last_z = 0.f;
+    double lastStatsTime = 0.0;
     /* Loop until the user closes the window */
     while (!glfwWindowShouldClose(window) && !escape)
     {
         /* Render here */
-        glClear(GL_COLOR_BUFFER_BIT);
+        //Depth writes must be on for the depth clear to happen
+        glState.setDepthMask(GL_TRUE);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        //Finish any shader builds the driver completed
+        shaderCache.poll();
+
+        //Count this frame's GL calls, printed once a second
+        glState.beginFrame();
+        if (showStats && glfwGetTime() - lastStatsTime >= 1.0) {
+            glState.printStats();
+            std::cout << "Visible " << sceneTree.getVisibleCount() << " of " << sceneTree.getLeafCount()
+                << " | Tested one by one " << frustumCuller.getCount() << std::endl;
+            if (lights.isClustered())
+                std::cout << "Clustered lights " << lights.getClusteredLightCount()
+                    << " | Cluster entries " << lights.getClusterIndexCount() << std::endl;
+            if (shadowsEnabled)
+                std::cout << "Shadow cascades drawn " << shadows.getDrawnCount() << " of " << shadows.getCascadeCount()
+                    << " | Shadowed point lights " << pointShadows.getShadowedCount()
+                    << " | Cube faces drawn " << pointShadows.getDrawnFaces() << std::endl;
+            lastStatsTime = glfwGetTime();
+        }
 
         
-        glUseProgram(object.getShaderProg());
-
         //Set Light intensity
         pPointLight->setIntensity(pointBrightness_mod);
         pDirectionlight->setIntensity(dirBrightness_mod);
 
+        //The light source turns green while it is being moved
+        if (!changeLight)
+            pPointLight->setColor(glm::vec3(1.f, 1.f, 1.f));
+        else
+            pPointLight->setColor(glm::vec3(1.f, 3.f, 1.f));
+
         //Toggle Perspcetive & Orthographic Camera
 
         //Perspective Camera
         if (!changeCamera) {
             //Make Perspective Camera
-            pCameraPerspective->perform(object.getShaderProg());
-
-            //Set Position and Scale of MODEL1
-            object.updateTranslate(0.f, 0.f, 0.f);
-            object.updateScale(0.05f, 0.05f, 0.05f);
-
-            //Toggle between Main obj and Light Source
-            if (!changeLight) {
-                object.updateRotation(x_mod, y_mod, z_mod);
-                last_x = x_mod;
-                last_y = y_mod;
-                last_z = z_mod;
-                pPointLight->setColor(glm::vec3(1.f, 1.f, 1.f));
-            }
-            else {
-                //Remember last position
-                object.updateRotation(last_x, last_y, last_z);
-            }
-            //Render MODEL1
-            object.perform(directionlight, pCameraPerspective->getCameraPos());
-
-            //Set Position and Scale of MODEL2
-            object2.updateTranslate(-8.0f, 0.f, 0.f);
-            object2.updateScale(10.f, 10.f, 10.f);
-
-            //Toggle
-            if (changeLight) {
-                //Revolve Light source around Main obj
-                object2.updateRevolution(8.f, 0.f, 0.f, x_mod, y_mod, z_mod, pPointLight);
-                object2.updateScale(10.f, 10.f, 10.f);
-                pPointLight->setColor(glm::vec3(1.f, 3.f, 1.f));
-
-            }
-            //Render MODEL2
-            object2.perform(pPointLight, pCameraPerspective->getCameraPos());
+            pCameraPerspective->perform();
         }
 
         //Orthographic Camera
         else {
             //Make OrthoGraphic Camera
-            pCameraOrtho->perform(object.getShaderProg());
-
-            //Set Position and Scale of MODEL1
-            object.updateTranslate(0.f, 0.f, 0.f);
-            object.updateScale(0.05f, 0.05f, 0.05f);
-
-            //Toggle between Main obj and Light Source
-            if (!changeLight) {
-                object.updateRotation(x_mod, y_mod, z_mod);
-                last_x = x_mod;
-                last_y = y_mod;
-                last_z = z_mod;
-                pPointLight->setColor(glm::vec3(1.f, 1.f, 1.f));
-            }
-            else {
-                //Remember last position
-                object.updateRotation(last_x, last_y, last_z);
+            pCameraOrtho->perform();
+        }
+
+        //Add or take out the light field
+        if (showLightField != lightFieldInBuffer) {
+            for (Light* light : lightField) {
+                if (showLightField) {
+                    lights.addLight(light);
+                    pointShadows.addLight((PointLight*)light);
+                }
+                else {
+                    lights.removeLight(light);
+                    pointShadows.removeLight((PointLight*)light);
+                }
             }
+            lightFieldInBuffer = showLightField;
+        }
+
+        //Set Position and Scale of MODEL1
+        object.updateTranslate(0.f, 0.f, 0.f);
+        object.updateScale(0.05f, 0.05f, 0.05f);
+
+        //Toggle between Main obj and Light Source
+        if (!changeLight) {
+            object.updateRotation(x_mod, y_mod, z_mod);
+            last_x = x_mod;
+            last_y = y_mod;
+            last_z = z_mod;
+        }
+        else {
+            //Remember last position
+            object.updateRotation(last_x, last_y, last_z);
+        }
 
-            //Render MODEL1
-            object.perform(directionlight, pCameraOrtho->getCameraPos());
+        //Set Position and Scale of MODEL2
+        object2.updateTranslate(-8.0f, 0.f, 0.f);
+        object2.updateScale(10.f, 10.f, 10.f);
 
-            //Set Position and Scale of MODEL2
-            object2.updateTranslate(-8.0f, 0.f, 0.f);
+        //Toggle
+        if (changeLight) {
+            //Revolve Light source around Main obj
+            object2.updateRevolution(8.f, 0.f, 0.f, x_mod, y_mod, z_mod, pPointLight);
             object2.updateScale(10.f, 10.f, 10.f);
 
-            //Toggle
-            if (changeLight) {
+        }
+
+        //Hidden props leave the tree so they aren't culled or counted
+        if (showProps != propsInTree) {
+            if (showProps)
+                props.addToTree(sceneTree);
+            else
+                props.removeFromTree();
+            propsInTree = showProps;
+        }
+
+        //Refit the moved models, then skip the ones outside the camera's view
+        sceneTree.update();
+        glm::mat4 viewProjection = MyCamera::getBoundCamera()->getViewProjection();
+
+        //Draw the occluders on the CPU so the objects behind them are skipped too
+        OcclusionCuller* occlusion = NULL;
+        if (occlusionCulling) {
+            occlusionCuller.begin(viewProjection);
+            object.addOccluder(occlusionCuller);
+            object2.addOccluder(occlusionCuller);
+            occlusionCuller.perform();
+            occlusion = &occlusionCuller;
+        }
+
+        frustumCuller.begin(viewProjection);
+        sceneTree.cullFrustum(frustumCuller, occlusion);
 
-                //Revolve light source around Main obj
-                object2.updateRevolution(8.f, 0.f, 0.f, x_mod, y_mod, z_mod, pPointLight);
-                object2.updateScale(10.f, 10.f, 10.f);
-                pPointLight->setColor(glm::vec3(1.f, 3.f, 1.f));
+        //Draw the shadow maps whose casters changed, before the scene's batch takes the mesh pool's draw buffer
+        if (shadowsEnabled) {
+            shadows.perform(MyCamera::getBoundCamera(), pDirectionlight, sceneTree);
+            pointShadows.perform(MyCamera::getBoundCamera(), sceneTree);
+        }
 
+        //Upload the lights once for every draw this frame, after the models moved them and the point lights got their shadow slots
+        //Clustered point lights are binned for the camera that was just bound
+        lights.perform();
+
+        //The draws below only write the surfaces, the lights are applied after
+        if (deferredShading)
+            deferred.begin();
+
+        //Whole scene in one multi draw per program and texture
+        if (batchDraws && batcher.isSupported()) {
+            batcher.begin();
+            object.submit(batcher, &lights);
+            object2.submit(batcher, &lights);
+            if (showProps)
+                props.submit(batcher, &lights);
+
+            //Depth only pass, the lighting pass then shades each pixel once
+            if (depthPrepass) {
+                glState.setColorMask(GL_FALSE);
+                batcher.performDepth();
+                glState.setColorMask(GL_TRUE);
             }
-            //Render MODEL2
-            object2.perform(pPointLight, pCameraOrtho->getCameraPos());
+            batcher.perform();
+        }
+        else {
+            //The queue draws the depth pre-pass first, then the models grouped by state, front to back
+            renderQueue.begin(depthPrepass);
+
+            //Render MODEL1 and MODEL2
+            object.enqueue(renderQueue, &lights);
+            object2.enqueue(renderQueue, &lights);
+
+            //Render every prop in one draw
+            if (showProps)
+                props.enqueue(renderQueue, &lights);
+
+            renderQueue.perform(&lights);
         }
+
+        if (deferredShading)
+            deferred.perform(lights);
+
         /* Swap front and back buffers */
         glfwSwapBuffers(window);
 
         /* Poll for and process events */
         glfwPollEvents();
     }
+    //Free the shared programs and buffers before the context goes away
+    shaderCache.clear();
+    cameraPerspective->destroy();
+    cameraOrtho->destroy();
+    lights.destroy();
+    deferred.destroy();
+    shadows.destroy();
+    pointShadows.destroy();
+    materials.destroy();
+    batcher.destroy();
+    meshPool.destroy();
+    occlusionCuller.stop();
+
     glfwTerminate();
     return 0;
 }
 
-void Model3D::renderTexture(Light* light, glm::vec3 cameraPos) {
+bool Model3D::usePerVertexLighting() {
+    if (shadingQuality != SHADING_AUTO)
+        return shadingQuality == SHADING_PER_VERTEX;
+
+    //Instances share one program, their sizes on screen differ
+    if (!this->instances.empty())
+        return false;
+
+    MyCamera* camera = MyCamera::getBoundCamera();
+    if (camera == nullptr)
+        return false;
+
+    //Bounding sphere in world space, scaled by the largest axis
+    glm::vec3 center = glm::vec3(this->transformation_matrix * glm::vec4(this->boundCenter, 1.f));
+    glm::mat3 model = glm::mat3(this->transformation_matrix);
+    float scale = std::max(glm::length(model[0]), std::max(glm::length(model[1]), glm::length(model[2])));
+
+    return camera->getProjectedRadius(center, this->boundRadius * scale) < perVertexRadius;
+}
+
+ShaderVariant Model3D::pickVariant(LightBuffer* lights) {
+    ShaderVariant variant;
+    variant.pointLights = lights->getPointLightCount();
+    variant.directionLights = lights->getDirectionLightCount();
+    //Deferred draws only write the surface, the lights are applied in screen space
+    if (deferredShading) {
+        variant.gbuffer = true;
+        variant.instanced = !this->instances.empty();
+        this->material->applyVariant(variant);
+        return variant;
+    }
+
+    //The clusters and the shadow maps are looked up per pixel
+    variant.clustered = lights->isClustered();
+    variant.shadowed = shadowsEnabled;
+    variant.perVertex = !variant.clustered && !variant.shadowed && this->usePerVertexLighting();
+    variant.instanced = !this->instances.empty();
+    this->material->applyVariant(variant);
+    return variant;
+}
+
+ShaderProgram* Model3D::drawProgram(LightBuffer* lights) {
+    //Pick the variant matching this draw
+    ShaderProgram* program = this->getVariant(this->pickVariant(lights));
+
+    //Draw with the default variant until the exact one is compiled
+    if (!program->isReady())
+        program = this->defaultProg;
+
+    //Nothing to draw with yet, or the shaders are broken
+    if (!program->isReady())
+        return NULL;
+    return program;
+}
+
+ShaderProgram* Model3D::depthProgram() {
+    ShaderVariant variant;
+    variant.depthOnly = true;
+    variant.instanced = !this->instances.empty();
+    ShaderProgram* program = this->getVariant(variant);
+    return program->isReady() ? program : NULL;
+}
+
+float Model3D::getViewDepth() {
+    MyCamera* camera = MyCamera::getBoundCamera();
+    if (camera == nullptr)
+        return 0.f;
+
+    if (this->instances.empty())
+        return camera->getViewDepth(glm::vec3(this->transformation_matrix * glm::vec4(this->boundCenter, 1.f)));
+
+    float closest = FLT_MAX;
+    for (const InstanceData& instance : this->instances)
+        closest = std::min(closest, camera->getViewDepth(glm::vec3(instance.transform * glm::vec4(this->boundCenter, 1.f))));
+    return closest;
+}
+
+void Model3D::enqueue(RenderQueue& queue, LightBuffer* lights) {
+    //Instanced models are drawn whole when any instance is in view
+    if (this->isCulled())
+        return;
+
+    ShaderProgram* program = this->drawProgram(lights);
+    if (program == NULL)
+        return;
+
+    float viewDepth = this->getViewDepth();
+    GLuint texture = this->material->getHasTexture() ? this->material->getTexture() : 0;
+
+    ShaderProgram* depthProg = queue.hasDepthPrepass() ? this->depthProgram() : NULL;
+    if (depthProg != NULL)
+        queue.add(PASS_DEPTH, depthProg, 0, this->VAO, viewDepth, this);
+    queue.add(PASS_OPAQUE, program, texture, this->VAO, viewDepth, this);
+}
+
+void Model3D::perform(LightBuffer* lights) {
+    ShaderProgram* program = this->drawProgram(lights);
+    if (program == NULL)
+        return;
+    this->shaderProg = program;
+
+    //Pixels the pre-pass wrote are shaded only where this object is the closest
+    if (this->depthPrepared) {
+        glState.setDepthFunc(GL_EQUAL);
+        glState.setDepthMask(GL_FALSE);
+        this->depthPrepared = false;
+    }
+    else {
+        glState.setDepthFunc(GL_LESS);
+        glState.setDepthMask(GL_TRUE);
+    }
+
+    //Check the program's inputs against the vertex format once
+    GLuint programID = this->shaderProg->getID();
+    if (std::find(this->checkedPrograms.begin(), this->checkedPrograms.end(), programID) == this->checkedPrograms.end()) {
+        if (this->instances.empty())
+            validateVertexInputs<MeshVertexLayout>(programID, this->v + ", " + this->f);
+        else
+            validateVertexInputs<MeshVertexLayout, InstanceLayout>(programID, this->v + ", " + this->f);
+        this->checkedPrograms.push_back(programID);
+    }
+
+    this->shaderProg->use();
+
+    //Update object
+    this->update();
+    //Texture and material index, only when they differ from the last draw
+    this->material->bind(this->shaderProg);
+
+    //Rendering the model
+    this->uploadInstances();
+    this->drawMesh();
+}
+
+void Model3D::submit(DrawBatcher& batcher, LightBuffer* lights) {
+    if (this->isCulled())
+        return;
+
+    //Batched draws read the transform and material slot from the per draw buffer
+    ShaderVariant variant = this->pickVariant(lights);
+    variant.instanced = true;
+    ShaderProgram* program = this->getVariant(variant);
+
+    //The default variant can't read per draw data, wait for the exact one
+    if (!program->isReady())
+        return;
+
+    ShaderVariant depth;
+    depth.depthOnly = true;
+    depth.instanced = true;
+    ShaderProgram* depthProg = this->getVariant(depth);
+
+    float viewDepth = this->getViewDepth();
+    if (!this->instances.empty()) {
+        //Per draw data is uploaded every frame, only the instances in view are sent
+        const InstanceData* drawn = this->instances.data();
+        size_t count = this->instances.size();
+        if (this->tree != NULL) {
+            drawn = this->visibleInstances.data();
+            count = this->visibleInstances.size();
+        }
+
+        batcher.add(program, depthProg, this->material, this->poolRange, drawn, count, viewDepth);
+        return;
+    }
+
+    InstanceData draw = this->getDrawData(0);
+    batcher.add(program, depthProg, this->material, this->poolRange, &draw, 1, viewDepth);
+}
+
+void Model3D::performDepth() {
+    ShaderProgram* depthProg = this->depthProgram();
+
+    //The main pass falls back to a normal depth test until the depth program is built
+    if (depthProg == NULL)
+        return;
+
+    this->shaderProg = depthProg;
+    this->shaderProg->use();
+    this->update();
+
+    glState.setDepthFunc(GL_LESS);
+    glState.setDepthMask(GL_TRUE);
 
-    light->createLight(this->shaderProg, this->texture, cameraPos);
+    this->uploadInstances();
+    this->drawMesh();
+    this->depthPrepared = true;
 }
 
 void Model3D::updateRevolution(float revolve_x, float revolve_y, float revolve_z, float rotate_x,
@@ -1337,4 +7201,5 @@ void Model3D::updateRevolution(float revolve_x, float revolve_y, float revolve_z
 
     std::cout << lightPos->getLightPos().x << " " << lightPos->getLightPos().y << " " << lightPos->getLightPos().z << std::endl;*/
 
+    this->moved();
 }
\ No newline at end of file
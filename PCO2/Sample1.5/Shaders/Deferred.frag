@@ -0,0 +1,64 @@
+#version 330 core
+
+//Lights the G-buffer written by the GBUFFER variant of Sample.frag
+//Each pass adds its light to the pixel, see DeferredRenderer in PCO2.cpp
+
+//Albedo, normal with the material slot, and depth of the surfaces
+uniform sampler2D gAlbedo;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+
+//directionLight(), pointLight() and lightSurface()
+#include "Lighting.glsl"
+
+#ifdef LIGHT_VOLUME
+//The light of this volume, from Deferred.vert
+flat in vec4 volumePosition;
+flat in vec4 volumeColor;
+flat in vec4 volumeAmbientColor;
+flat in vec4 volumeAttenuation; //w is the range
+#endif
+
+out vec4 FragColor;
+
+void main(){
+	ivec2 pixel = ivec2(gl_FragCoord.xy);
+
+	//Nothing was drawn here
+	float depth = texelFetch(gDepth, pixel, 0).r;
+	if (depth == 1.0)
+		discard;
+
+	//World position of the surface from its depth
+	vec2 screen = gl_FragCoord.xy / vec2(textureSize(gDepth, 0));
+	vec4 world = inverseViewProjection * vec4(vec3(screen, depth) * 2.0 - 1.0, 1.0);
+	vec3 position = world.xyz / world.w;
+
+	vec4 normalData = texelFetch(gNormal, pixel, 0);
+	vec3 normal = normalize(normalData.xyz);
+	MaterialData material = materials[int(normalData.w)];
+
+	//Get our view direction from the camera to the surface
+	vec3 viewDir = normalize(cameraPos.xyz - position);
+
+#ifdef LIGHT_VOLUME
+	PointLightData light;
+	light.position = volumePosition;
+	light.color = volumeColor;
+	light.ambientColor = volumeAmbientColor;
+	light.attenuation = volumeAttenuation;
+
+	//The surface is in front of the volume
+	if (distance(light.position.xyz, position) > volumeAttenuation.w)
+		discard;
+
+	vec3 result = pointLight(light, material, position, normal, viewDir, pointShadow(light, position, normal));
+#else
+	vec3 result = vec3(0.0);
+	for (int i = 0; i < DIRECTION_LIGHT_COUNT; i++)
+		result += directionLight(directionLights[i], material, normal, viewDir, directionShadow(i, position, normal));
+#endif
+
+	//The albedo already holds the material color and the texture
+	FragColor = vec4(result * texelFetch(gAlbedo, pixel, 0).rgb, 1.0);
+}
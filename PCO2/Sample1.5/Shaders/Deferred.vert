@@ -0,0 +1,39 @@
+#version 330 core
+
+//Screen space passes of DeferredRenderer in PCO2.cpp
+//Without LIGHT_VOLUME: one triangle covering the screen for the directional lights
+//With LIGHT_VOLUME: a sphere around each point light, one instance per light
+
+#ifdef LIGHT_VOLUME
+//Unit sphere, scaled to the light's range
+layout(location = 0) in vec3 aPos;
+
+//The light of the instance, see LightVolumeLayout
+layout(location = 1) in vec4 lightPosition;
+layout(location = 2) in vec4 lightColor;
+layout(location = 3) in vec4 lightAmbientColor;
+layout(location = 4) in vec4 lightAttenuation; //w is the range
+
+//Passed on unchanged to the fragment shader
+flat out vec4 volumePosition;
+flat out vec4 volumeColor;
+flat out vec4 volumeAmbientColor;
+flat out vec4 volumeAttenuation;
+#endif
+
+//The Camera block is declared by the shader cache
+
+void main(){
+#ifdef LIGHT_VOLUME
+	gl_Position = viewProjection * vec4(lightPosition.xyz + aPos * lightAttenuation.w, 1.0);
+
+	volumePosition = lightPosition;
+	volumeColor = lightColor;
+	volumeAmbientColor = lightAmbientColor;
+	volumeAttenuation = lightAttenuation;
+#else
+	//Corners at (-1, -1), (3, -1) and (-1, 3)
+	vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+	gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+#endif
+}
@@ -0,0 +1,268 @@
+//Lighting shared by Sample.vert (per vertex) and Sample.frag (per pixel)
+//Included by the shader cache, keep #include "Lighting.glsl" outside of #ifdef blocks
+//Uses the Camera, Lights, Materials, Shadows and PointShadows blocks declared by the shader cache
+
+//Light counts of this variant, compiled in by the shader cache
+//Without them the counts are read from the Lights block
+#ifndef POINT_LIGHT_COUNT
+#define POINT_LIGHT_COUNT lightCounts.x
+#endif
+#ifndef DIRECTION_LIGHT_COUNT
+#define DIRECTION_LIGHT_COUNT lightCounts.y
+#endif
+
+#ifdef CLUSTERED_LIGHTING
+//Point lights binned into clusters by LightClusters in PCO2.cpp
+//Four texels per light, in PointLightData order
+uniform samplerBuffer clusterLights;
+//First index and light count of each cluster
+uniform usamplerBuffer clusterGrid;
+//Light indices of every cluster, back to back
+uniform usamplerBuffer clusterIndices;
+
+//Point light from the clustered lights
+PointLightData clusterLight(int index){
+	PointLightData light;
+	light.position = texelFetch(clusterLights, index * 4);
+	light.color = texelFetch(clusterLights, index * 4 + 1);
+	light.ambientColor = texelFetch(clusterLights, index * 4 + 2);
+	light.attenuation = texelFetch(clusterLights, index * 4 + 3);
+	return light;
+}
+
+//Cluster of a world space position: its screen tile and exponential depth slice
+int clusterOf(vec3 position){
+	vec4 clip = viewProjection * vec4(position, 1.0);
+	vec2 tiles = vec2(CLUSTER_TILES_X, CLUSTER_TILES_Y);
+	ivec2 tile = ivec2(clamp(floor((clip.xy / clip.w * 0.5 + 0.5) * tiles), vec2(0.0), tiles - 1.0));
+
+	float depth = -(view * vec4(position, 1.0)).z;
+	int slice = int(clamp(floor(log(max(depth, 1e-4)) * clusterDepth.x + clusterDepth.y), 0.0, float(CLUSTER_SLICES - 1)));
+
+	return (slice * CLUSTER_TILES_Y + tile.y) * CLUSTER_TILES_X + tile.x;
+}
+#endif
+
+#ifdef SHADOWS
+//Depth maps of the shadow cascades from ShadowCascades in PCO2.cpp, one layer per cascade
+//The sampler compares the surface's depth against the map
+uniform sampler2DArrayShadow shadowCascades;
+
+//Texels a surface is pushed along its normal before it is looked up, so it doesn't shadow itself
+#define SHADOW_NORMAL_OFFSET 1.5
+
+//Light of a directional light reaching a position, 0 in its shadow and 1 when lit
+float directionShadow(int light, vec3 position, vec3 normal){
+	if (light != shadowInfo.y)
+		return 1.0;
+
+	//First cascade reaching the position's depth, positions past the last one are lit
+	float depth = -(view * vec4(position, 1.0)).z;
+	int cascade = 0;
+	while (cascade < shadowInfo.x && depth > cascadeSplits[cascade])
+		cascade++;
+	if (cascade == shadowInfo.x)
+		return 1.0;
+
+	vec3 offset = normal * cascadeTexels[cascade] * SHADOW_NORMAL_OFFSET;
+	vec3 coord = (cascadeMatrices[cascade] * vec4(position + offset, 1.0)).xyz;
+
+	//Four taps half a texel apart, the sampler already blends 2x2 texels for each
+	vec2 texel = 1.0 / vec2(textureSize(shadowCascades, 0).xy);
+	float lit = 0.0;
+	for (int i = 0; i < 4; i++) {
+		vec2 tap = vec2(i & 1, i >> 1) - 0.5;
+		lit += texture(shadowCascades, vec4(coord.xy + tap * texel, float(cascade), coord.z));
+	}
+	return lit * 0.25;
+}
+
+//Cube shadow maps of the point lights from PointShadows in PCO2.cpp, one sampler per resolution tier
+//Each shadowed light has six layers, one per cube face
+uniform sampler2DArrayShadow pointShadows0;
+uniform sampler2DArrayShadow pointShadows1;
+uniform sampler2DArrayShadow pointShadows2;
+
+//Looking and up directions of the cube faces, in the order PointShadows draws them
+const vec3 CUBE_FORWARD[6] = vec3[6](vec3(1.0, 0.0, 0.0), vec3(-1.0, 0.0, 0.0), vec3(0.0, 1.0, 0.0),
+	vec3(0.0, -1.0, 0.0), vec3(0.0, 0.0, 1.0), vec3(0.0, 0.0, -1.0));
+const vec3 CUBE_UP[6] = vec3[6](vec3(0.0, -1.0, 0.0), vec3(0.0, -1.0, 0.0), vec3(0.0, 0.0, 1.0),
+	vec3(0.0, 0.0, -1.0), vec3(0.0, -1.0, 0.0), vec3(0.0, -1.0, 0.0));
+
+//Compare against one tier's maps, samplers can't be picked by index in GLSL 330
+float pointShadowTap(int tier, vec4 coord){
+	if (tier == 0)
+		return texture(pointShadows0, coord);
+	if (tier == 1)
+		return texture(pointShadows1, coord);
+	return texture(pointShadows2, coord);
+}
+
+//Size of one tier's maps
+float pointShadowSize(int tier){
+	if (tier == 0)
+		return float(textureSize(pointShadows0, 0).x);
+	if (tier == 1)
+		return float(textureSize(pointShadows1, 0).x);
+	return float(textureSize(pointShadows2, 0).x);
+}
+
+//Light of a point light reaching a position, 0 in its shadow and 1 when lit
+float pointShadow(PointLightData light, vec3 position, vec3 normal){
+	int slot = int(light.ambientColor.w) - 1;
+	if (slot < 0)
+		return 1.0;
+
+	vec4 map = pointShadowMaps[slot];
+	int tier = int(map.x);
+	float zNear = map.z, zFar = map.w;
+
+	//The face looking along the major axis holds the position
+	vec3 toSurface = position - light.position.xyz;
+	vec3 axis = abs(toSurface);
+	int face = axis.x >= axis.y && axis.x >= axis.z ? (toSurface.x > 0.0 ? 0 : 1) :
+		axis.y >= axis.z ? (toSurface.y > 0.0 ? 2 : 3) : (toSurface.z > 0.0 ? 4 : 5);
+	vec3 forward = CUBE_FORWARD[face];
+	vec3 up = CUBE_UP[face];
+
+	//Positions past the far plane are lit
+	float depth = dot(forward, toSurface);
+	if (depth >= zFar)
+		return 1.0;
+
+	//A texel of a 90 degree face is 2 * depth / size wide
+	float size = pointShadowSize(tier);
+	toSurface += normal * (2.0 * depth / size) * SHADOW_NORMAL_OFFSET;
+	depth = max(dot(forward, toSurface), zNear);
+
+	//Same projection as the face's perspective matrix in PointShadows
+	vec2 ndc = vec2(dot(cross(forward, up), toSurface), dot(up, toSurface)) / depth;
+	float ndcDepth = (zFar + zNear) / (zFar - zNear) - 2.0 * zFar * zNear / ((zFar - zNear) * depth);
+	vec3 coord = vec3(ndc, ndcDepth) * 0.5 + 0.5;
+
+	//Four taps half a texel apart, like the cascades
+	float layer = map.y + float(face);
+	float lit = 0.0;
+	for (int i = 0; i < 4; i++) {
+		vec2 tap = (vec2(i & 1, i >> 1) - 0.5) / size;
+		lit += pointShadowTap(tier, vec4(coord.xy + tap, layer, coord.z));
+	}
+	return lit * 0.25;
+}
+#else
+//Without shadows every directional light reaches everything
+float directionShadow(int light, vec3 position, vec3 normal){
+	return 1.0;
+}
+
+//And so does every point light
+float pointShadow(PointLightData light, vec3 position, vec3 normal){
+	return 1.0;
+}
+#endif
+
+//Light from one directional light
+//shadow scales the diffuse and specular light, the ambient light is never shadowed
+vec3 directionLight(DirectionLightData light, MaterialData material, vec3 normal, vec3 viewDir, float shadow){
+	vec3 lightColor = light.color.rgb;
+	float brightness = light.direction.w;
+
+	//Get the direction of the light to the fragment
+	vec3 lightDir = normalize(-light.direction.xyz);
+
+	//Apply the diffuse formula heree
+	float diff = max(dot(normal, lightDir), 0.0);
+
+	//Multiply it to the desired light color and intensity
+	vec3 diffuse = diff * shadow * lightColor * brightness;
+
+	//Get the ambient light
+	vec3 ambientCol = light.ambientColor.rgb * light.color.w;
+
+	vec3 result = diffuse + ambientCol;
+
+#ifdef SPECULAR
+	//Get the reflection vector
+	vec3 reflectDir = reflect(-lightDir, normal);
+
+	//Get the specular light
+	float spec = pow(max(dot(reflectDir, viewDir), 0.1), material.specular.y);
+
+	//Get the specColor
+	result += spec * shadow * material.specular.x * lightColor * brightness;
+#endif
+
+	return result;
+}
+
+//Light from one point light
+//shadow scales the diffuse and specular light, the ambient light is never shadowed
+vec3 pointLight(PointLightData light, MaterialData material, vec3 position, vec3 normal, vec3 viewDir, float shadow){
+	vec3 lightColor = light.color.rgb;
+	float brightness = light.position.w;
+
+	//Get the vector of the surface to the light
+	vec3 toLight = light.position.xyz - position;
+
+	//Get the direction of the light to the fragment
+	vec3 lightDir = normalize(toLight);
+
+	//Apply the diffuse formula heree
+	float diff = max(dot(normal, lightDir), 0.0);
+
+	//Multiply it to the desired light color and intensity
+	vec3 diffuse = diff * shadow * lightColor * brightness;
+
+	//Get the ambient light
+	vec3 ambientCol = light.ambientColor.rgb * light.color.w;
+
+	vec3 result = diffuse + ambientCol;
+
+#ifdef SPECULAR
+	//Get the reflection vector
+	vec3 reflectDir = reflect(-lightDir, normal);
+
+	//Get the specular light
+	float spec = pow(max(dot(reflectDir, viewDir), 0.1), material.specular.y);
+
+	//Get the specColor
+	result += spec * shadow * material.specular.x * lightColor * brightness;
+#endif
+
+	//Get distance of object to light
+	float distance = length(toLight);
+
+	//Get the Attenuation factor
+	float attenuation = light.attenuation.x + light.attenuation.y * distance + light.attenuation.z * distance * distance;
+
+	return result / attenuation;
+}
+
+//Light reaching a surface point from every light, tinted by the material
+//normal must be normalized
+vec3 lightSurface(MaterialData material, vec3 position, vec3 normal){
+	vec3 result = vec3(0.0);
+
+	//Get our view direction from the camera to the surface
+	vec3 viewDir = normalize(cameraPos.xyz - position);
+
+	//Add every directional light
+	for (int i = 0; i < DIRECTION_LIGHT_COUNT; i++)
+		result += directionLight(directionLights[i], material, normal, viewDir, directionShadow(i, position, normal));
+
+	//Add every point light
+	for (int i = 0; i < POINT_LIGHT_COUNT; i++)
+		result += pointLight(pointLights[i], material, position, normal, viewDir, pointShadow(pointLights[i], position, normal));
+
+#ifdef CLUSTERED_LIGHTING
+	//Add only the point lights reaching this position's cluster
+	uvec2 cluster = texelFetch(clusterGrid, clusterOf(position)).xy;
+	for (uint i = 0u; i < cluster.y; i++) {
+		PointLightData light = clusterLight(int(texelFetch(clusterIndices, int(cluster.x + i)).x));
+		result += pointLight(light, material, position, normal, viewDir, pointShadow(light, position, normal));
+	}
+#endif
+
+	//Tint by the material color
+	return result * material.color.rgb;
+}
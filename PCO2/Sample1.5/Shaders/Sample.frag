@@ -1,6 +1,6 @@
 #version 330 core
 
-//Point Light
+//Point Lights and Directional Lights
 
 //Textures
 //Texture to be passed
@@ -12,123 +12,60 @@ in vec3 normCoord;
 //fragment data
 in vec3 fragPos;
 
+//The Camera, Lights and Materials blocks and their structs
+//are declared by the shader cache from the block structs in PCO2.cpp
+//Camera gives cameraPos, Lights gives lightCounts, pointLights and directionLights
+//Materials gives materials
 
-//Position of the light source
-uniform vec3 lightPos;
+//Slot of the material in the Materials block, from the draw or the instance
+flat in int fragMaterial;
 
-//Color of the light 
-uniform vec3 lightColor;
+//directionLight(), pointLight() and lightSurface()
+#include "Lighting.glsl"
 
-//Strength of the  ambient light
-uniform float ambientStr;
-
-//color of the ambient light
-uniform vec3 ambientColor;
-
-//Camera position
-uniform vec3 cameraPos;
-
-//Specular str
-uniform float specStr;
-
-//Specular Phong
-uniform float specPhong;
-
-//Attenuation Constant 
-uniform float constant;
-
-//Attenuation Linear
-uniform float linear;
-
-//Attenuation Exponential
-uniform float exponent;
-
-//Intensity of Light (Brightness)
-uniform float brightness;
-
-//Light Direction
-uniform vec3 lightDirection;
+#ifdef PER_VERTEX_LIGHTING
+//Light computed by Sample.vert, interpolated across the triangle
+in vec3 vertexLight;
+#endif
 
 //Should recieve the texCoord
 //from the vertex shader
 in vec2 texCoord;
 
-out vec4 FragColor; //Returns a Color
-//Simple shader that colors the model Red
-
-void main(){
-	
-	vec3 result = vec3(0.0);
-
-
-	//normalize the recieved normals
-	vec3 normal = normalize(normCoord);
-
-	//Get the direction of the light to the fragment
-	vec3 lightDir = normalize(-lightDirection);
-
-	//Apply the diffuse formula heree
-	float diff = max(dot(normal, lightDir), 0.0);
-
-	//Multiply it to the desired light color and intensity
-	vec3 diffuse = diff * lightColor * brightness;
+layout(location = 0) out vec4 FragColor; //Returns a Color
 
-	//Get the ambient light
-	vec3 ambientCol = ambientColor * ambientStr;
-
-	//Get our view direction from the camera to the fragment
-	vec3 viewDir = normalize(cameraPos - fragPos);
-
-	//Get the reflection vector
-	vec3 reflectDir = reflect(-lightDir, normal);
-
-	//Get the specular light
-	float spec = pow(max(dot(reflectDir, viewDir), 0.1), specPhong);
-
-	//Get the specColor
-	vec3 specColorDir = spec * specStr * lightColor * brightness;
-
-	result += diffuse + ambientCol + specColorDir;
+#ifdef GBUFFER
+//Deferred shading: FragColor holds the albedo, this the normal and the material slot
+layout(location = 1) out vec4 gBufferNormal;
+#endif
 
+void main(){
+	//Depth pre-pass (DEPTH_ONLY) writes no color, only the depth
+#ifdef GBUFFER
+	//Surface only, Deferred.frag lights it later
+	vec4 albedo = vec4(materials[fragMaterial].color.rgb, 1.0);
+#ifdef TEXTURED
+	albedo *= texture(tex0, texCoord);
+#endif
+	FragColor = albedo;
+	gBufferNormal = vec4(normalize(normCoord), float(fragMaterial));
+
+#elif !defined(DEPTH_ONLY)
+	//Forward shading, lit here
+#ifdef PER_VERTEX_LIGHTING
+	vec3 result = vertexLight;
+#else
 	//normalize the recieved normals
-	vec3 normalPoint = normalize(normCoord);
-
-	//Get the direction of the light to the fragment
-	vec3 lightDirPoint = normalize(lightPos - fragPos);
-
-	//Apply the diffuse formula heree
-	float diffPoint = max(dot(normalPoint, lightDirPoint), 0.0);
-
-	//Multiply it to the desired light color and intensity
-	vec3 diffusePoint = diffPoint * lightColor * brightness;
-
-	//Get the ambient light
-	vec3 ambientColPoint = ambientColor * ambientStr;
-
-	//Get our view direction from the camera to the fragment
-	vec3 viewDirPoint = normalize(cameraPos - fragPos);
-
-	//Get the reflection vector
-	vec3 reflectDirPoint = reflect(-lightDirPoint, normalPoint);
-
-	//Get the specular light
-	float specPoint = pow(max(dot(reflectDirPoint, viewDirPoint), 0.1), specPhong);
-	//Get distance of object to light direction
-	float distancePoint = length(lightDirPoint);
-
-	//Get the Attenuation factor
-	float attenuation = constant + linear * distancePoint + exponent * distancePoint * distancePoint;
-
-	//Get the specColor
-	vec3 specColorPoint = specPoint * specStr * lightColor * brightness;
-
-	result += (diffusePoint + ambientColPoint + specColorPoint) / attenuation;
-	
-	//				 r   g	  b   a		Ranges from 0->1
-	//FragColor = vec4(0.7f,0.f,0.f, 1.f); //Sets the color of the Fragment
+	vec3 result = lightSurface(materials[fragMaterial], fragPos, normalize(normCoord));
+#endif
 
+#ifdef TEXTURED
 	//Apply it to the texture
 	//Assign the texture color using the function
-	//Divide the texture color by the attenuation factor to get the point light
 	FragColor = vec4(result,1.0) * texture(tex0, texCoord);
-}
\ No newline at end of file
+#else
+	FragColor = vec4(result,1.0);
+#endif
+
+#endif
+}
@@ -19,6 +19,9 @@ layout(location = 2 ) in vec2 aTex;
 //Pass the tex coord to the fragment shader
 out vec2 texCoord;
 
+//The depth pre-pass and the lighting pass must produce the exact same depth for GL_EQUAL
+invariant gl_Position;
+
 //Declare a variable to hold the data
 //that we're going to pass
 //uniform float x;
@@ -28,11 +31,33 @@ out vec2 texCoord;
 //We'll assign the transformation matrix here later
 uniform mat4 transform;
 
-//Projection Mat
-uniform mat4 projection;
+//Inverse transpose of the transform, computed once per transform change by Model3D
+uniform mat3 normalMatrix;
+
+//The Camera block with the shared matrices is declared by the shader cache
+//from CameraBlock in PCO2.cpp, MyCamera fills it only when the camera changes
+
+//Slot of this draw's material in the Materials block
+uniform int materialIndex;
+
+#ifdef INSTANCED
+//Per instance data from the instance buffer, see InstanceData in PCO2.cpp
+//Used instead of the transform, normalMatrix and materialIndex uniforms
+layout(location = 3) in mat4 instanceTransform;
+layout(location = 7) in mat3 instanceNormalMatrix;
+layout(location = 10) in int instanceMaterial;
+#endif
 
-//Camera View Matrix
-uniform mat4 view;
+//Material slot of the vertex, the same for the whole draw or instance
+flat out int fragMaterial;
+
+//directionLight(), pointLight() and lightSurface()
+#include "Lighting.glsl"
+
+#ifdef PER_VERTEX_LIGHTING
+//Light of the vertex, used instead of lighting every fragment
+out vec3 vertexLight;
+#endif
 
 void main(){
 	//Create a new vec3 for the new Position
@@ -45,22 +70,36 @@ void main(){
 
 	//Multiply the transformation matrix to the
 	//vec4
-	gl_Position = projection * //Multiply the Projection Matrix with the view
-					view *		//Multiply the View with the Position
-					transform * //Multiply the matrix with the position
+#ifdef INSTANCED
+	mat4 model = instanceTransform;
+#else
+	mat4 model = transform;
+#endif
+	gl_Position = viewProjection * //Projection multiplied with the view
+					model * //Multiply the matrix with the position
 					vec4(aPos, 1.0); //Turns vex3 into a vec4
 
-	//normCoord = mat3(Get the Normmal Matrix and convert it to a 3x3 matrix
-					//transpose(inverse(transform))
-					//) * vertexNormal; Apply the normal matrix to the normal data 
+#ifndef DEPTH_ONLY
 
-	mat3 modelMat = mat3(transpose(inverse(transform)));
-	normCoord = modelMat * vertexNormal;
+	//Apply the normal matrix to the normal data
+#ifdef INSTANCED
+	normCoord = instanceNormalMatrix * vertexNormal;
+	fragMaterial = instanceMaterial;
+#else
+	normCoord = normalMatrix * vertexNormal;
+	fragMaterial = materialIndex;
+#endif
 
 	//The position is just your transfom matrix
 	//applied to the vertex as a vector 3
-	fragPos = vec3(transform * vec4(aPos,1.0));
+	fragPos = vec3(model * vec4(aPos,1.0));
 
 	//Assign the UV
 	texCoord = aTex;
+
+#ifdef PER_VERTEX_LIGHTING
+	//Gouraud shading: light the vertex once, the fragments interpolate it
+	vertexLight = lightSurface(materials[fragMaterial], fragPos, normalize(normCoord));
+#endif
+#endif
 }
\ No newline at end of file
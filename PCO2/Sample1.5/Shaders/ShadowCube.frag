@@ -0,0 +1,6 @@
+#version 330 core
+
+//Cube shadow maps only keep the depth, see ShadowCube.geom
+
+void main(){
+}
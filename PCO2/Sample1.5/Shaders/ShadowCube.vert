@@ -0,0 +1,14 @@
+#version 330 core
+
+//Casters of a point light's cube shadow map, drawn by PointShadows in PCO2.cpp
+//Only the world position is passed on, ShadowCube.geom projects it onto each face
+
+//Gets the data at Attrib Index 0
+layout(location = 0) in vec3 aPos;
+
+//Per instance transform from the instance buffer, see InstanceData in PCO2.cpp
+layout(location = 3) in mat4 instanceTransform;
+
+void main(){
+	gl_Position = instanceTransform * vec4(aPos, 1.0);
+}